@@ -0,0 +1,365 @@
+// Benchmarks for the serializer, the renderer, the stroke eraser and the PDF exporter.
+//
+// All documents are generated synthetically (see generator.h) from a fixed random seed, so that results are comparable between runs.
+// Use --benchmark_format=json (or --benchmark_out=<file> --benchmark_out_format=json) to obtain machine-readable results.
+// The program exits with status 1 if a benchmark that also checks a result (BM_ScanlineRasterizerDifference) fails.
+
+#include "document.h"
+#include "eraser-clip.h"
+#include "generator.h"
+#include "renderer.h"
+#include "serializer.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <optional>
+
+#include <QBuffer>
+#include <QDataStream>
+#include <QFile>
+#include <QTemporaryDir>
+
+namespace {
+
+// Size of the widget the page pictures are rendered for.
+const int WIDGET_WIDTH = 1000;
+const int WIDGET_HEIGHT = 1400;
+
+// Set by benchmarks whose check fails (see main).
+bool check_failed = false;
+
+std::unique_ptr<Document> synthetic_document(int number_of_pages, int strokes_per_page, int points_per_stroke, bool embed_pdf = false) {
+	GeneratorOptions options;
+	options.pages = number_of_pages;
+	options.strokes_per_page = strokes_per_page;
+	options.points_per_stroke = points_per_stroke;
+	options.eraser_ratio = 0.05;
+	options.colors = {Color::BLACK, Color::color(255, 0, 0, 255), Color::color(0, 0, 255, 255)};
+	options.embed_pdf = embed_pdf;
+	return generate_document(options);
+}
+
+// The handwriting layer of the given page.
+NormalLayer* handwriting_layer(Document* doc, int page = 0) {
+	return std::get<NormalLayer*>(doc->pages()[page]->layers().back());
+}
+
+QByteArray save_to_bytes(Document* doc) {
+	QByteArray data;
+	QBuffer buffer(&data);
+	buffer.open(QBuffer::WriteOnly);
+	QDataStream out(&buffer);
+	Serializer::save(doc, out);
+	return data;
+}
+
+void BM_SerializerSave(benchmark::State& state) {
+	auto doc = synthetic_document(state.range(0), 300, 60);
+	size_t bytes = 0;
+	for (auto _ : state) {
+		QByteArray data = save_to_bytes(doc.get());
+		bytes = data.size();
+		benchmark::DoNotOptimize(data.data());
+	}
+	state.counters["file_bytes"] = bytes;
+	state.SetBytesProcessed(state.iterations() * bytes);
+}
+BENCHMARK(BM_SerializerSave)->Arg(1)->Arg(10)->Arg(50)->Unit(benchmark::kMillisecond);
+
+void BM_SerializerLoad(benchmark::State& state) {
+	QByteArray data = save_to_bytes(synthetic_document(state.range(0), 300, 60).get());
+	for (auto _ : state) {
+		QBuffer buffer(&data);
+		buffer.open(QBuffer::ReadOnly);
+		QDataStream in(&buffer);
+		std::unique_ptr<Document> doc = Serializer::load(in);
+		benchmark::DoNotOptimize(doc.get());
+	}
+	state.counters["file_bytes"] = data.size();
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_SerializerLoad)->Arg(1)->Arg(10)->Arg(50)->Unit(benchmark::kMillisecond);
+
+// Drawing a single black pen stroke with the given number of points, a wave across the page.
+void BM_RendererDrawStroke(benchmark::State& state) {
+	auto doc = synthetic_document(1, 0, 1);
+	SPage* page = doc->pages()[0];
+	PictureTransformation transformation(page, WIDGET_WIDTH, WIDGET_HEIGHT);
+	Renderer renderer(transformation);
+	PenStroke stroke(1000, Color::BLACK);
+	int n = state.range(0);
+	for (int i = 0; i < n; i++)
+		stroke.push_back(Point(page->width() * (i + 1) / (n + 1), page->height() / 2 + page->height() / 4 * std::sin(i * 12.0 / n)));
+	for (auto _ : state) {
+		QRect rect = renderer.draw_stroke(&stroke);
+		benchmark::DoNotOptimize(rect);
+	}
+	state.counters["points"] = n;
+}
+BENCHMARK(BM_RendererDrawStroke)->Arg(10)->Arg(100)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+// Drawing all strokes of a page one by one (0), with Renderer::draw_strokes (1) or with Renderer::draw_strokes_parallel (2).
+void BM_RendererDrawStrokes(benchmark::State& state) {
+	auto doc = synthetic_document(1, state.range(0), 60);
+	PictureTransformation transformation(doc->pages()[0], WIDGET_WIDTH, WIDGET_HEIGHT);
+	Renderer renderer(transformation);
+	std::vector<ptr_Stroke> strokes;
+	for (ptr_Stroke stroke : handwriting_layer(doc.get())->strokes())
+		strokes.push_back(stroke);
+	int mode = state.range(1);
+	for (auto _ : state) {
+		if (mode == 2) {
+			renderer.draw_strokes_parallel(strokes);
+		} else if (mode == 1) {
+			renderer.draw_strokes(strokes);
+		} else {
+			for (ptr_Stroke stroke : strokes)
+				renderer.draw_stroke(stroke);
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * strokes.size());
+}
+BENCHMARK(BM_RendererDrawStrokes)->Args({1000, 0})->Args({1000, 1})->Args({1000, 2})->Args({5000, 0})->Args({5000, 1})->Args({5000, 2})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Drawing all strokes of a page with the given backend (0 = cairo, 1 = scanline).
+void BM_RendererBackend(benchmark::State& state) {
+	auto doc = synthetic_document(1, state.range(0), 60);
+	PictureTransformation transformation(doc->pages()[0], WIDGET_WIDTH, WIDGET_HEIGHT);
+	Renderer renderer(transformation, state.range(1) ? Renderer::Backend::Scanline : Renderer::Backend::Cairo);
+	std::vector<ptr_Stroke> strokes;
+	for (ptr_Stroke stroke : handwriting_layer(doc.get())->strokes())
+		strokes.push_back(stroke);
+	for (auto _ : state) {
+		for (ptr_Stroke stroke : strokes)
+			renderer.draw_stroke(stroke);
+	}
+	state.SetItemsProcessed(state.iterations() * strokes.size());
+}
+BENCHMARK(BM_RendererBackend)->Args({1000, 0})->Args({1000, 1})->Unit(benchmark::kMillisecond);
+
+// Compares the pictures drawn by the cairo and the scanline backend (with pen and eraser strokes of various widths and colors).
+// The counters give the largest difference of a color channel (out of 255), the mean difference and the fraction of pixels that differ by more than 16.
+// The benchmark fails if the mean difference or the fraction of large differences exceeds the tolerance (antialiasing of the two backends differs slightly along the edges).
+void BM_ScanlineRasterizerDifference(benchmark::State& state) {
+	const double MAX_MEAN_DIFFERENCE = 0.5;
+	const double MAX_LARGE_DIFFERENCES = 0.001;
+	auto doc = synthetic_document(1, 300, 60);
+	PictureTransformation transformation(doc->pages()[0], WIDGET_WIDTH, WIDGET_HEIGHT);
+	std::vector<ptr_Stroke> strokes;
+	for (ptr_Stroke stroke : handwriting_layer(doc.get())->strokes())
+		strokes.push_back(stroke);
+	for (auto _ : state) {
+		Renderer cairo(transformation, Renderer::Backend::Cairo), scanline(transformation, Renderer::Backend::Scanline);
+		for (ptr_Stroke stroke : strokes) {
+			cairo.draw_stroke(stroke);
+			scanline.draw_stroke(stroke);
+		}
+		QImage a = cairo.img(), b = scanline.img();
+		int max_difference = 0;
+		double sum = 0;
+		size_t large = 0;
+		for (int y = 0; y < a.height(); y++) {
+			const uchar* line_a = a.constScanLine(y);
+			const uchar* line_b = b.constScanLine(y);
+			for (int x = 0; x < 4 * a.width(); x++) {
+				int difference = std::abs(line_a[x] - line_b[x]);
+				max_difference = std::max(max_difference, difference);
+				sum += difference;
+				if (difference > 16)
+					large++;
+			}
+		}
+		size_t channels = 4 * (size_t)a.width() * a.height();
+		state.counters["max_difference"] = max_difference;
+		state.counters["mean_difference"] = sum / channels;
+		state.counters["large_differences"] = (double)large / channels;
+		if (sum / channels > MAX_MEAN_DIFFERENCE || (double)large / channels > MAX_LARGE_DIFFERENCES) {
+			check_failed = true;
+			state.SkipWithError("The scanline rasterizer does not match cairo within the tolerance.");
+			break;
+		}
+	}
+}
+BENCHMARK(BM_ScanlineRasterizerDifference)->Iterations(1)->Unit(benchmark::kMillisecond);
+
+// Full redraw of a layer at a small size (e.g. a thumbnail), where most points fall onto the same pixels as their neighbors.
+void BM_DrawingLayerPictureRedrawSmall(benchmark::State& state) {
+	auto doc = synthetic_document(1, 1000, state.range(0));
+	PictureTransformation transformation(doc->pages()[0], WIDGET_WIDTH / 8, WIDGET_HEIGHT / 8);
+	NormalLayer* layer = handwriting_layer(doc.get());
+	for (auto _ : state) {
+		DrawingLayerPicture picture(layer, transformation);
+		benchmark::DoNotOptimize(&picture);
+	}
+}
+BENCHMARK(BM_DrawingLayerPictureRedrawSmall)->Arg(60)->Arg(600)->Unit(benchmark::kMillisecond);
+
+// Full redraw of a layer, which is what happens whenever a page picture is constructed (page switch, resize).
+void BM_DrawingLayerPictureRedraw(benchmark::State& state) {
+	auto doc = synthetic_document(1, state.range(0), 60);
+	PictureTransformation transformation(doc->pages()[0], WIDGET_WIDTH, WIDGET_HEIGHT);
+	NormalLayer* layer = handwriting_layer(doc.get());
+	for (auto _ : state) {
+		DrawingLayerPicture picture(layer, transformation);
+		benchmark::DoNotOptimize(&picture);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DrawingLayerPictureRedraw)->Arg(100)->Arg(1000)->Arg(5000)->Unit(benchmark::kMillisecond);
+
+// Undoing and redoing the last stroke. After the first redo, the undo restores the checkpoint taken when the stroke was drawn.
+void BM_DrawingLayerPictureUndoRedo(benchmark::State& state) {
+	auto doc = synthetic_document(1, state.range(0), 60);
+	PictureTransformation transformation(doc->pages()[0], WIDGET_WIDTH, WIDGET_HEIGHT);
+	NormalLayer* layer = handwriting_layer(doc.get());
+	DrawingLayerPicture picture(layer, transformation);
+	for (auto _ : state) {
+		unique_ptr_Stroke stroke = layer->delete_stroke();
+		layer->add_stroke(std::move(stroke));
+	}
+}
+BENCHMARK(BM_DrawingLayerPictureUndoRedo)->Arg(100)->Arg(1000)->Arg(5000)->Unit(benchmark::kMicrosecond);
+
+// Holding Ctrl+Z: Undoing the last 100 strokes of a layer after they were drawn (which took checkpoints).
+void BM_DrawingLayerPictureUndoMany(benchmark::State& state) {
+	auto doc = synthetic_document(1, state.range(0), 60);
+	PictureTransformation transformation(doc->pages()[0], WIDGET_WIDTH, WIDGET_HEIGHT);
+	NormalLayer* layer = handwriting_layer(doc.get());
+	std::vector<unique_ptr_Stroke> undone;
+	for (int i = 0; i < 100; i++)
+		undone.push_back(layer->delete_stroke());
+	DrawingLayerPicture picture(layer, transformation);
+	for (auto _ : state) {
+		state.PauseTiming();
+		while (!undone.empty()) {
+			layer->add_stroke(std::move(undone.back()));
+			undone.pop_back();
+		}
+		state.ResumeTiming();
+		for (int i = 0; i < 100; i++)
+			undone.push_back(layer->delete_stroke());
+	}
+	state.SetItemsProcessed(state.iterations() * 100);
+}
+BENCHMARK(BM_DrawingLayerPictureUndoMany)->Arg(1000)->Arg(5000)->Unit(benchmark::kMillisecond);
+
+// Jumping back 100 strokes in the undo history of a page that was just opened (so there are no checkpoints).
+// With a ChangeTransaction (second argument 1), the union of the affected rectangles is redrawn once at the end instead of once per stroke.
+void BM_DrawingLayerPictureUndoJump(benchmark::State& state) {
+	auto doc = synthetic_document(1, state.range(0), 60);
+	PictureTransformation transformation(doc->pages()[0], WIDGET_WIDTH, WIDGET_HEIGHT);
+	NormalLayer* layer = handwriting_layer(doc.get());
+	std::vector<unique_ptr_Stroke> undone;
+	std::optional<DrawingLayerPicture> picture;
+	for (auto _ : state) {
+		state.PauseTiming();
+		picture.reset();
+		while (!undone.empty()) {
+			layer->add_stroke(std::move(undone.back()));
+			undone.pop_back();
+		}
+		picture.emplace(layer, transformation);
+		state.ResumeTiming();
+		std::optional<ChangeTransaction> transaction;
+		if (state.range(1))
+			transaction.emplace();
+		for (int i = 0; i < 100; i++)
+			undone.push_back(layer->delete_stroke());
+	}
+}
+BENCHMARK(BM_DrawingLayerPictureUndoJump)->Args({1000, 0})->Args({1000, 1})->Args({5000, 0})->Args({5000, 1})->Unit(benchmark::kMillisecond);
+
+// Hit testing of the stroke eraser: Moving the eraser across the page in short segments (as between two frames).
+void BM_StrokeIndexFind(benchmark::State& state) {
+	auto doc = synthetic_document(1, state.range(0), 60);
+	SPage* page = doc->pages()[0];
+	NormalLayer* layer = handwriting_layer(doc.get());
+	layer->strokes_near(Point(0, 0), Point(0, 0), 0);  // Builds the index.
+	const int STEPS = 100;
+	size_t found = 0;
+	for (auto _ : state) {
+		for (int i = 0; i < STEPS; i++) {
+			Point a(page->width() * i / STEPS, page->height() * i / STEPS);
+			Point b(page->width() * (i + 1) / STEPS, page->height() * (i + 1) / STEPS);
+			found += layer->strokes_near(a, b, 15000).size();
+		}
+	}
+	benchmark::DoNotOptimize(found);
+	state.SetItemsProcessed(state.iterations() * STEPS);
+}
+BENCHMARK(BM_StrokeIndexFind)->Arg(1000)->Arg(10000)->Arg(50000)->Unit(benchmark::kMicrosecond);
+
+// Deleting the strokes touched by one eraser segment and inserting them again (undo), including the redraw of the affected region.
+void BM_StrokeEraserDelete(benchmark::State& state) {
+	auto doc = synthetic_document(1, state.range(0), 60);
+	SPage* page = doc->pages()[0];
+	PictureTransformation transformation(page, WIDGET_WIDTH, WIDGET_HEIGHT);
+	NormalLayer* layer = handwriting_layer(doc.get());
+	DrawingLayerPicture picture(layer, transformation);
+	Point a(page->width() / 2, page->height() / 2), b(page->width() / 2 + 5000, page->height() / 2);
+	std::vector<size_t> positions = layer->strokes_near(a, b, 15000);
+	for (auto _ : state) {
+		std::vector<unique_ptr_Stroke> deleted = layer->delete_strokes(positions);
+		layer->insert_strokes(positions, std::move(deleted));
+	}
+	state.counters["strokes"] = positions.size();
+}
+BENCHMARK(BM_StrokeEraserDelete)->Arg(1000)->Arg(10000)->Arg(50000)->Unit(benchmark::kMillisecond);
+
+void BM_PDFLayerPictureRender(benchmark::State& state) {
+	auto doc = synthetic_document(1, 0, 1, true);
+	SPage* page = doc->pages()[0];
+	PictureTransformation transformation(page, WIDGET_WIDTH, WIDGET_HEIGHT);
+	PDFLayer* layer = std::get<PDFLayer*>(page->layers()[0]);
+	for (auto _ : state) {
+		PDFLayerPicture picture(layer, transformation);
+		benchmark::DoNotOptimize(&picture);
+	}
+}
+BENCHMARK(BM_PDFLayerPictureRender)->Unit(benchmark::kMillisecond);
+
+// Clipping a long pen stroke to an eraser stroke that scribbles across it in a zigzag with the given number of points (as the PDFExporter does).
+// The more points, the denser the scribble. The time should grow about linearly.
+void BM_EraserClipHeavyEraser(benchmark::State& state) {
+	NormalLayer layer;
+	auto pen = std::make_unique<PenStroke>(1000, Color::BLACK);
+	for (int i = 0; i <= 100; i++)
+		pen->push_back(Point(i * 2000, 10000));
+	layer.add_stroke(std::move(pen));
+	auto eraser = std::make_unique<EraserStroke>(3000);
+	for (int i = 0; i < state.range(0); i++)
+		eraser->push_back(Point(i * 200000 / state.range(0), i % 2 ? 0 : 20000));
+	layer.add_stroke(std::move(eraser));
+	EraserClip clip(&layer);
+	for (auto _ : state) {
+		std::optional<std::vector<EraserClip::Trapezoid> > region = clip.visible_region(0);
+		benchmark::DoNotOptimize(region);
+	}
+	state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_EraserClipHeavyEraser)->Arg(100)->Arg(1000)->Arg(4000)->Arg(16000)->Complexity()->Unit(benchmark::kMillisecond);
+
+// Exporting pages without (0) or with (1) a PDF background, erasing by clipping (0) or with groups (1).
+// With a PDF background, the eraser strokes are on the second layer, so they cannot simply be painted white.
+void BM_PDFExporterSave(benchmark::State& state) {
+	auto doc = synthetic_document(state.range(0), 300, 60, state.range(1));
+	QTemporaryDir dir;
+	std::string file_name = dir.filePath("export.pdf").toStdString();
+	PDFExporter::EraserMode mode = state.range(2) ? PDFExporter::EraserMode::Groups : PDFExporter::EraserMode::Clip;
+	for (auto _ : state)
+		PDFExporter::save(doc.get(), file_name, mode);
+	state.counters["file_bytes"] = QFile(QString::fromStdString(file_name)).size();
+}
+BENCHMARK(BM_PDFExporterSave)->Args({1, 0, 0})->Args({10, 0, 0})->Args({10, 1, 0})->Args({10, 1, 1})->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+int main(int argc, char** argv) {
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	benchmark::RunSpecifiedBenchmarks();
+	return check_failed ? 1 : 0;
+}
@@ -9,6 +9,7 @@ class SPage;
 class DrawingLayer;
 class NormalLayer;
 class PDFLayer;
+class PathStroke;
 class PenStroke;
 class EraserStroke;
 class TemporaryLayer;
@@ -1,9 +1,11 @@
 #include "commands.h"
 
 #include "document.h"
+#include "memory-stats.h"
+#include "serializer.h"
 
 AddPagesCommand::AddPagesCommand(Document* _doc, int _first_page, std::vector<std::unique_ptr<SPage> > _pages, QUndoCommand* parent) :
-    QUndoCommand(parent),
+    Command(parent),
     doc(_doc),
     first_page(_first_page),
     number_of_pages(_pages.size()),
@@ -13,6 +15,7 @@ AddPagesCommand::AddPagesCommand(Document* _doc, int _first_page, std::vector<st
 
 void AddPagesCommand::redo() {
 	// 	assert(pages);
+	unspill();
 	doc->add_pages(first_page, std::move(pages));
 }
 
@@ -22,13 +25,26 @@ void AddPagesCommand::undo() {
 }
 
 DeletePagesCommand::DeletePagesCommand(Document* _doc, int _first_page, int _number_of_pages, QUndoCommand* parent) :
-    QUndoCommand(parent),
+    Command(parent),
     doc(_doc),
     first_page(_first_page),
     number_of_pages(_number_of_pages) {
 	setText(number_of_pages == 1 ? QObject::tr("Delete page") : QObject::tr("Delete pages"));
 }
 
+void AddPagesCommand::account_memory(MemoryStats& stats) const {
+	for (const auto& page : pages)
+		stats.account_page(page.get(), MemoryStats::UndoHistory);
+}
+
+void AddPagesCommand::spill() {
+	spilled_layers.spill(pages);
+}
+
+void AddPagesCommand::unspill() {
+	spilled_layers.restore();
+}
+
 void DeletePagesCommand::redo() {
 	// 	assert(!pages);
 	pages = doc->delete_pages(first_page, number_of_pages);
@@ -36,17 +52,32 @@ void DeletePagesCommand::redo() {
 
 void DeletePagesCommand::undo() {
 	// 	assert(pages);
+	unspill();
 	doc->add_pages(first_page, std::move(pages));
 }
 
+void DeletePagesCommand::account_memory(MemoryStats& stats) const {
+	for (const auto& page : pages)
+		stats.account_page(page.get(), MemoryStats::UndoHistory);
+}
+
+void DeletePagesCommand::spill() {
+	spilled_layers.spill(pages);
+}
+
+void DeletePagesCommand::unspill() {
+	spilled_layers.restore();
+}
+
 AddStrokeCommand::AddStrokeCommand(NormalLayer* _layer, unique_ptr_Stroke _stroke, QUndoCommand* parent) :
-    QUndoCommand(parent),
+    Command(parent),
     layer(_layer),
     stroke(std::move(_stroke)) {
 	setText(std::visit(overloaded{[](PenStroke*) { return QObject::tr("Draw stroke"); }, [](EraserStroke*) { return QObject::tr("Erase"); }}, get(stroke)));
 }
 
 void AddStrokeCommand::redo() {
+	unspill();
 	assert(convert_variant<bool>(get(stroke)));
 	layer->add_stroke(std::move(stroke));
 }
@@ -56,8 +87,122 @@ void AddStrokeCommand::undo() {
 	stroke = layer->delete_stroke();
 }
 
+void AddStrokeCommand::account_memory(MemoryStats& stats) const {
+	if (convert_variant<bool>(get(stroke)))
+		stats.account_stroke(get(stroke), MemoryStats::UndoHistory);
+}
+
+void AddStrokeCommand::spill() {
+	if (!convert_variant<bool>(get(stroke)))
+		return;  // The stroke is in the document or already spilled.
+	spilled_stroke = UndoSpillFile::self()->write(Serializer::save_strokes({get(stroke)}));
+	if (spilled_stroke)
+		stroke = unique_ptr_Stroke();
+}
+
+void AddStrokeCommand::unspill() {
+	if (spilled_stroke) {
+		std::vector<unique_ptr_Stroke> strokes = Serializer::load_strokes(UndoSpillFile::self()->read(spilled_stroke));
+		if (strokes.size() != 1)
+			throw SauklaueReadException("The undo history is corrupt.");
+		stroke = std::move(strokes[0]);
+		spilled_stroke = UndoSpillFile::Block();
+	}
+}
+
+DeleteStrokesCommand::DeleteStrokesCommand(NormalLayer* layer, std::vector<size_t> positions, QUndoCommand* parent) :
+    Command(parent),
+    m_layer(layer),
+    m_positions(std::move(positions)) {
+	setText(QObject::tr("Erase strokes"));
+}
+
+void DeleteStrokesCommand::redo() {
+	assert(m_strokes.empty() && !m_spilled_strokes);
+	m_strokes = m_layer->delete_strokes(m_positions);
+}
+
+void DeleteStrokesCommand::undo() {
+	unspill();
+	assert(m_strokes.size() == m_positions.size());
+	m_layer->insert_strokes(m_positions, std::move(m_strokes));
+	m_strokes.clear();
+}
+
+void DeleteStrokesCommand::account_memory(MemoryStats& stats) const {
+	for (const unique_ptr_Stroke& stroke : m_strokes)
+		stats.account_stroke(get(stroke), MemoryStats::UndoHistory);
+}
+
+void DeleteStrokesCommand::spill() {
+	if (m_strokes.empty())
+		return;
+	std::vector<ptr_Stroke> strokes;
+	for (const unique_ptr_Stroke& stroke : m_strokes)
+		strokes.push_back(get(stroke));
+	m_spilled_strokes = UndoSpillFile::self()->write(Serializer::save_strokes(strokes));
+	if (m_spilled_strokes)
+		m_strokes.clear();
+}
+
+void DeleteStrokesCommand::unspill() {
+	if (m_spilled_strokes) {
+		m_strokes = Serializer::load_strokes(UndoSpillFile::self()->read(m_spilled_strokes));
+		m_spilled_strokes = UndoSpillFile::Block();
+	}
+}
+
+ReplaceStrokesCommand::ReplaceStrokesCommand(NormalLayer* layer, std::vector<size_t> deleted, std::vector<size_t> inserted, std::vector<unique_ptr_Stroke> new_strokes, QUndoCommand* parent) :
+    Command(parent),
+    m_layer(layer),
+    m_deleted(std::move(deleted)),
+    m_inserted(std::move(inserted)),
+    m_strokes(std::move(new_strokes)) {
+	setText(QObject::tr("Replace strokes"));
+}
+
+void ReplaceStrokesCommand::redo() {
+	unspill();
+	// Redraw the layer once.
+	ChangeTransaction transaction;
+	std::vector<unique_ptr_Stroke> deleted = m_layer->delete_strokes(m_deleted);
+	m_layer->insert_strokes(m_inserted, std::move(m_strokes));
+	m_strokes = std::move(deleted);
+}
+
+void ReplaceStrokesCommand::undo() {
+	unspill();
+	ChangeTransaction transaction;
+	std::vector<unique_ptr_Stroke> inserted = m_layer->delete_strokes(m_inserted);
+	m_layer->insert_strokes(m_deleted, std::move(m_strokes));
+	m_strokes = std::move(inserted);
+}
+
+void ReplaceStrokesCommand::account_memory(MemoryStats& stats) const {
+	for (const unique_ptr_Stroke& stroke : m_strokes)
+		stats.account_stroke(get(stroke), MemoryStats::UndoHistory);
+}
+
+void ReplaceStrokesCommand::spill() {
+	if (m_strokes.empty())
+		return;
+	std::vector<ptr_Stroke> strokes;
+	for (const unique_ptr_Stroke& stroke : m_strokes)
+		strokes.push_back(get(stroke));
+	m_spilled_strokes = UndoSpillFile::self()->write(Serializer::save_strokes(strokes));
+	if (m_spilled_strokes)
+		m_strokes.clear();
+}
+
+void ReplaceStrokesCommand::unspill() {
+	if (m_spilled_strokes) {
+		m_strokes = Serializer::load_strokes(UndoSpillFile::self()->read(m_spilled_strokes));
+		m_spilled_strokes = UndoSpillFile::Block();
+	}
+}
+
 AddEmbeddedPDFCommand::AddEmbeddedPDFCommand(Document* doc, std::unique_ptr<EmbeddedPDF> pdf, QUndoCommand* parent) :
-    QUndoCommand(parent),
+    Command(parent),
     m_doc(doc),
     m_pdf(std::move(pdf)) {
 	setText(QObject::tr("Embed PDF"));
@@ -73,8 +218,13 @@ void AddEmbeddedPDFCommand::undo() {
 	m_pdf = m_doc->delete_embedded_pdf(m_it);
 }
 
+void AddEmbeddedPDFCommand::account_memory(MemoryStats& stats) const {
+	if (m_pdf)
+		stats.account_embedded_pdf(m_pdf.get(), MemoryStats::UndoHistory);
+}
+
 GotoPDFPageCommand::GotoPDFPageCommand(PDFLayer* layer, int page, QUndoCommand* parent) :
-    QUndoCommand(parent), m_layer(layer), m_page(page) {
+    Command(parent), m_layer(layer), m_page(page) {
 	setText(QObject::tr("Switch PDF page"));
 }
 
@@ -87,3 +237,6 @@ void GotoPDFPageCommand::redo() {
 void GotoPDFPageCommand::undo() {
 	redo();
 }
+
+void GotoPDFPageCommand::account_memory(MemoryStats&) const {
+}
@@ -2,51 +2,117 @@
 #define COMMANDS_H
 
 #include "all-types.h"
+#include "undo-spill.h"
 
 #include <QUndoCommand>
 
-class AddPagesCommand : public QUndoCommand {
+class MemoryStats;
+
+// Base class of all our undo commands.
+class Command : public QUndoCommand {
+public:
+	using QUndoCommand::QUndoCommand;
+	// Accounts the document data that is currently owned by the command (as opposed to the document).
+	virtual void account_memory(MemoryStats& stats) const = 0;
+	// Moves the document data owned by the command to the UndoSpillFile. It is loaded back when the command is undone or redone.
+	virtual void spill() {
+	}
+	// Loads the data back from the UndoSpillFile. May throw SauklaueReadException, in which case the command stays spilled.
+	virtual void unspill() {
+	}
+};
+
+class AddPagesCommand : public Command {
 public:
 	AddPagesCommand(Document* _doc, int _first_page, std::vector<std::unique_ptr<SPage> > _pages, QUndoCommand* parent = nullptr);
 	void redo() override;
 	void undo() override;
+	void account_memory(MemoryStats& stats) const override;
+	void spill() override;
+	void unspill() override;
 
 private:
 	Document* doc;
 	int first_page;
 	int number_of_pages;
 	std::vector<std::unique_ptr<SPage> > pages;
+	SpilledLayers spilled_layers;
 };
 
-class DeletePagesCommand : public QUndoCommand {
+class DeletePagesCommand : public Command {
 public:
 	DeletePagesCommand(Document* _doc, int _first_page, int _number_of_pages, QUndoCommand* parent = nullptr);
 	void redo() override;
 	void undo() override;
+	void account_memory(MemoryStats& stats) const override;
+	void spill() override;
+	void unspill() override;
 
 private:
 	Document* doc;
 	int first_page;
 	int number_of_pages;
 	std::vector<std::unique_ptr<SPage> > pages;
+	SpilledLayers spilled_layers;
 };
 
-class AddStrokeCommand : public QUndoCommand {
+class AddStrokeCommand : public Command {
 public:
 	AddStrokeCommand(NormalLayer* _layer, unique_ptr_Stroke _stroke, QUndoCommand* parent = nullptr);
 	void redo() override;
 	void undo() override;
+	void account_memory(MemoryStats& stats) const override;
+	void spill() override;
+	void unspill() override;
 
 private:
 	NormalLayer* layer;
 	unique_ptr_Stroke stroke;
+	UndoSpillFile::Block spilled_stroke;
+};
+
+// Deletes strokes anywhere in the layer (stroke eraser).
+class DeleteStrokesCommand : public Command {
+public:
+	// The positions must be increasing.
+	DeleteStrokesCommand(NormalLayer* layer, std::vector<size_t> positions, QUndoCommand* parent = nullptr);
+	void redo() override;
+	void undo() override;
+	void account_memory(MemoryStats& stats) const override;
+	void spill() override;
+	void unspill() override;
+
+private:
+	NormalLayer* m_layer;
+	std::vector<size_t> m_positions;
+	std::vector<unique_ptr_Stroke> m_strokes;  // The deleted strokes while the command is done
+	UndoSpillFile::Block m_spilled_strokes;
+};
+
+// Deletes the strokes at the given positions and then inserts new strokes at the given positions (see NormalLayer::delete_strokes, NormalLayer::insert_strokes).
+class ReplaceStrokesCommand : public Command {
+public:
+	ReplaceStrokesCommand(NormalLayer* layer, std::vector<size_t> deleted, std::vector<size_t> inserted, std::vector<unique_ptr_Stroke> new_strokes, QUndoCommand* parent = nullptr);
+	void redo() override;
+	void undo() override;
+	void account_memory(MemoryStats& stats) const override;
+	void spill() override;
+	void unspill() override;
+
+private:
+	NormalLayer* m_layer;
+	std::vector<size_t> m_deleted;
+	std::vector<size_t> m_inserted;
+	std::vector<unique_ptr_Stroke> m_strokes;  // The deleted strokes while the command is done, the new strokes while it is undone
+	UndoSpillFile::Block m_spilled_strokes;
 };
 
-class AddEmbeddedPDFCommand : public QUndoCommand {
+class AddEmbeddedPDFCommand : public Command {
 public:
 	AddEmbeddedPDFCommand(Document* doc, std::unique_ptr<EmbeddedPDF> pdf, QUndoCommand* parent = nullptr);
 	void redo() override;
 	void undo() override;
+	void account_memory(MemoryStats& stats) const override;
 
 private:
 	Document* m_doc;
@@ -54,11 +120,12 @@ private:
 	std::list<std::unique_ptr<EmbeddedPDF> >::iterator m_it;
 };
 
-class GotoPDFPageCommand : public QUndoCommand {
+class GotoPDFPageCommand : public Command {
 public:
 	GotoPDFPageCommand(PDFLayer* layer, int page, QUndoCommand* parent = nullptr);
 	void redo() override;
 	void undo() override;
+	void account_memory(MemoryStats& stats) const override;
 
 private:
 	PDFLayer* m_layer;
@@ -0,0 +1,270 @@
+#include "compactor.h"
+
+#include "document.h"
+#include "renderer.h"
+#include "stroke-index.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <optional>
+
+#include <QElapsedTimer>
+
+namespace {
+
+// Long segments are tested for coverage at points this far apart (in units).
+const double SAMPLE_SPACING = 1000;
+double point_segment_distance(double px, double py, Point a, Point b) {
+	double dx = b.x - a.x, dy = b.y - a.y;
+	double d2 = dx * dx + dy * dy;
+	double rx = px - a.x, ry = py - a.y;
+	double t = d2 > 0 ? std::clamp((rx * dx + ry * dy) / d2, 0., 1.) : 0;
+	return std::hypot(rx - t * dx, ry - t * dy);
+}
+
+// The segments of the eraser strokes of a layer in a UniformGrid, to find the erasers covering a point.
+class EraserGrid {
+public:
+	void insert(const EraserStroke* stroke, size_t position) {
+		const std::vector<Point>& points = stroke->points();
+		if (points.size() == 1)
+			insert_segment(points[0], points[0], stroke->width() / 2., position);
+		for (size_t i = 0; i + 1 < points.size(); i++)
+			insert_segment(points[i], points[i + 1], stroke->width() / 2., position);
+		m_last_position = position;
+	}
+	// Whether the disk of the given radius around (px, py) lies inside an eraser stroke drawn after the given position.
+	bool covers(double px, double py, double radius, size_t after) const {
+		const std::vector<size_t>* indices = m_grid.at(std::floor(px), std::floor(py));
+		if (!indices)
+			return false;
+		for (size_t index : *indices) {
+			const Segment& s = m_segments[index];
+			if (s.position > after && point_segment_distance(px, py, s.a, s.b) + radius <= s.radius)
+				return true;
+		}
+		return false;
+	}
+	// The position of the last eraser stroke (if any)
+	std::optional<size_t> last_position() const {
+		return m_last_position;
+	}
+
+private:
+	struct Segment {
+		Point a, b;
+		double radius;
+		size_t position;  // Of the eraser stroke in the layer
+	};
+	void insert_segment(Point a, Point b, double radius, size_t position) {
+		size_t index = m_segments.size();
+		m_segments.push_back(Segment{a, b, radius, position});
+		int r = std::ceil(radius);
+		m_grid.insert(QRect(QPoint(std::min(a.x, b.x) - r, std::min(a.y, b.y) - r), QPoint(std::max(a.x, b.x) + r, std::max(a.y, b.y) + r)), index);
+	}
+
+	std::vector<Segment> m_segments;
+	UniformGrid<size_t> m_grid;
+	std::optional<size_t> m_last_position;
+};
+
+// The visible pieces of a pen stroke: Each piece is a range of consecutive points.
+// Returns an empty list if the stroke is completely covered, and a single piece with all points if no part of it is.
+std::vector<std::pair<size_t, size_t> > visible_pieces(const PenStroke* stroke, size_t position, const EraserGrid& erasers) {
+	const std::vector<Point>& points = stroke->points();
+	size_t n = points.size();
+	// Every point of a segment is at most SAMPLE_SPACING / 2 away from a tested point.
+	double radius = stroke->width() / 2. + SAMPLE_SPACING / 2 + Compactor::MARGIN;
+	std::vector<bool> covered(n);
+	for (size_t i = 0; i < n; i++)
+		covered[i] = erasers.covers(points[i].x, points[i].y, radius, position);
+	if (n == 1)
+		return covered[0] ? std::vector<std::pair<size_t, size_t> >() : std::vector<std::pair<size_t, size_t> >{{0, 1}};
+	std::vector<std::pair<size_t, size_t> > pieces;
+	std::optional<size_t> start;  // Of the current piece
+	for (size_t i = 0; i + 1 < n; i++) {
+		bool segment_covered = covered[i] && covered[i + 1];
+		if (segment_covered) {
+			double length = std::hypot(points[i + 1].x - points[i].x, points[i + 1].y - points[i].y);
+			int samples = std::ceil(length / SAMPLE_SPACING);
+			for (int k = 1; k < samples && segment_covered; k++) {
+				double t = (double)k / samples;
+				segment_covered = erasers.covers(points[i].x + t * (points[i + 1].x - points[i].x), points[i].y + t * (points[i + 1].y - points[i].y), radius, position);
+			}
+		}
+		if (!segment_covered && !start)
+			start = i;
+		if (segment_covered && start) {
+			pieces.emplace_back(*start, i + 1);
+			start.reset();
+		}
+	}
+	if (start)
+		pieces.emplace_back(*start, n);
+	return pieces;
+}
+
+}  // namespace
+
+Compactor::Changes Compactor::compact(const NormalLayer* layer, Stats& stats) {
+	TRACE_SCOPE("Compactor::compact");
+	std::vector<ptr_Stroke> strokes;
+	for (ptr_Stroke stroke : layer->strokes())
+		strokes.push_back(stroke);
+	stats.strokes_before += strokes.size();
+	for (ptr_Stroke stroke : strokes)
+		stats.points_before += convert_variant<PathStroke*>(stroke)->points().size();
+
+	EraserGrid erasers;
+	for (size_t i = 0; i < strokes.size(); i++) {
+		if (EraserStroke* const* eraser = std::get_if<EraserStroke*>(&strokes[i]))
+			erasers.insert(*eraser, i);
+	}
+
+	// The strokes of the compacted layer: Either an original stroke (by position) or a new piece.
+	struct Item {
+		size_t position;
+		std::optional<unique_ptr_Stroke> piece;
+	};
+	std::vector<Item> items;
+	for (size_t i = 0; i < strokes.size(); i++) {
+		PenStroke* const* pen = std::get_if<PenStroke*>(&strokes[i]);
+		if (!pen || !erasers.last_position() || *erasers.last_position() < i) {
+			items.push_back(Item{i, std::nullopt});
+			continue;
+		}
+		std::vector<std::pair<size_t, size_t> > pieces = visible_pieces(*pen, i, erasers);
+		if (pieces.empty()) {
+			stats.removed_pen_strokes++;
+		} else if (pieces.size() == 1 && pieces[0].first == 0 && pieces[0].second == (*pen)->points().size()) {
+			items.push_back(Item{i, std::nullopt});
+		} else if ((*pen)->color().a() < 1) {
+			// Where pieces overlap, a translucent color would become more opaque.
+			items.push_back(Item{i, std::nullopt});
+		} else {
+			stats.split_pen_strokes++;
+			for (auto [begin, end] : pieces) {
+				auto piece = std::make_unique<PenStroke>((*pen)->width(), (*pen)->color());
+				piece->reserve_points(end - begin);
+				for (size_t k = begin; k < end; k++)
+					piece->push_back((*pen)->points()[k]);
+				items.push_back(Item{i, unique_ptr_Stroke(std::move(piece))});
+			}
+		}
+	}
+
+	// Drop the eraser strokes that don't touch any remaining ink drawn before them.
+	std::vector<Item> remaining;
+	StrokeIndex ink;
+	for (Item& item : items) {
+		ptr_Stroke stroke = item.piece ? get(*item.piece) : strokes[item.position];
+		if (PenStroke* const* pen = std::get_if<PenStroke*>(&stroke)) {
+			ink.insert(*pen);
+		} else {
+			EraserStroke* eraser = std::get<EraserStroke*>(stroke);
+			const std::vector<Point>& points = eraser->points();
+			bool touches = false;
+			for (size_t k = 0; k < points.size() && !touches; k++)
+				touches = !ink.find(points[k], points[std::min(k + 1, points.size() - 1)], eraser->width() / 2. + MARGIN).empty();
+			if (!touches) {
+				stats.removed_eraser_strokes++;
+				continue;
+			}
+		}
+		remaining.push_back(std::move(item));
+	}
+
+	Changes changes;
+	std::vector<bool> kept(strokes.size());
+	for (size_t i = 0; i < remaining.size(); i++) {
+		Item& item = remaining[i];
+		stats.points_after += convert_variant<PathStroke*>(item.piece ? get(*item.piece) : strokes[item.position])->points().size();
+		if (item.piece) {
+			changes.inserted.push_back(i);
+			changes.new_strokes.push_back(std::move(*item.piece));
+		} else {
+			kept[item.position] = true;
+		}
+	}
+	for (size_t i = 0; i < strokes.size(); i++) {
+		if (!kept[i])
+			changes.deleted.push_back(i);
+	}
+	stats.strokes_after += remaining.size();
+	return changes;
+}
+
+void Compactor::check(SPage* page, const NormalLayer* layer, const Changes& changes, QSize widget_size, Stats& stats) {
+	TRACE_SCOPE("Compactor::check");
+	std::vector<ptr_Stroke> before;
+	for (ptr_Stroke stroke : layer->strokes())
+		before.push_back(stroke);
+	// Apply the changes to a copy of the list (like NormalLayer::delete_strokes and NormalLayer::insert_strokes).
+	std::vector<ptr_Stroke> after(before.size() - changes.deleted.size() + changes.inserted.size());
+	std::vector<bool> is_new(after.size(), false);
+	for (size_t i = 0; i < changes.inserted.size(); i++) {
+		after[changes.inserted[i]] = get(changes.new_strokes[i]);
+		is_new[changes.inserted[i]] = true;
+	}
+	size_t next = 0, next_deleted = 0;
+	for (size_t i = 0; i < before.size(); i++) {
+		if (next_deleted < changes.deleted.size() && changes.deleted[next_deleted] == i) {
+			next_deleted++;
+			continue;
+		}
+		while (is_new[next])
+			next++;
+		after[next++] = before[i];
+	}
+	PictureTransformation transformation(page, widget_size.width(), widget_size.height());
+	QElapsedTimer timer;
+	timer.start();
+	Renderer renderer_before(transformation);
+	renderer_before.draw_strokes(before);
+	stats.render_milliseconds_before += timer.nsecsElapsed() / 1e6;
+	timer.restart();
+	Renderer renderer_after(transformation);
+	renderer_after.draw_strokes(after);
+	stats.render_milliseconds_after += timer.nsecsElapsed() / 1e6;
+	stats.checked = true;
+	QImage a = renderer_before.img(), b = renderer_after.img();
+	for (int y = 0; y < a.height(); y++) {
+		const QRgb* la = (const QRgb*)a.constScanLine(y);
+		const QRgb* lb = (const QRgb*)b.constScanLine(y);
+		for (int x = 0; x < a.width(); x++)
+			stats.different_pixels += la[x] != lb[x];
+	}
+}
+
+Compactor::Stats Compactor::compact(Document* doc, QSize check_size) {
+	Stats stats;
+	for (SPage* page : doc->pages()) {
+		for (ptr_Layer layer : page->layers()) {
+			if (NormalLayer* const* normal_layer = std::get_if<NormalLayer*>(&layer)) {
+				Changes changes = compact(*normal_layer, stats);
+				if (changes.empty())
+					continue;
+				if (check_size.isValid())
+					check(page, *normal_layer, changes, check_size, stats);
+				(*normal_layer)->delete_strokes(changes.deleted);
+				(*normal_layer)->insert_strokes(changes.inserted, std::move(changes.new_strokes));
+			}
+		}
+	}
+	return stats;
+}
+
+QStringList Compactor::Stats::report() const {
+	QStringList res;
+	res << QString("Strokes: %1 -> %2").arg(strokes_before).arg(strokes_after);
+	res << QString("Points: %1 -> %2").arg(points_before).arg(points_after);
+	res << QString("Removed %1 erased pen strokes, split %2 partly erased pen strokes, removed %3 eraser strokes").arg(removed_pen_strokes).arg(split_pen_strokes).arg(removed_eraser_strokes);
+	if (checked) {
+		// Only the changed layers are rendered.
+		res << QString("Render time of the changed layers: %1 -> %2 ms").arg(render_milliseconds_before, 0, 'f', 1).arg(render_milliseconds_after, 0, 'f', 1);
+		if (different_pixels)
+			res << QString("Changed pixels: %1").arg(different_pixels);
+	}
+	return res;
+}
@@ -0,0 +1,58 @@
+#ifndef COMPACTOR_H
+#define COMPACTOR_H
+
+#include "all-types.h"
+
+#include <vector>
+
+#include <QSize>
+#include <QStringList>
+
+// Simplifies the strokes of a layer without changing how the layer looks:
+//  - Pen strokes that are completely covered by later eraser strokes are removed.
+//  - Opaque pen strokes that are partly covered by later eraser strokes are split into the pieces that remain visible.
+//  - Eraser strokes that don't touch any of the remaining ink drawn before them are removed.
+// This makes files smaller and drawing faster. Without eraser strokes, the PDFExporter can also use its simplistic mode.
+// Ink is only considered covered (and an eraser only considered irrelevant) with a safety margin of MARGIN units.
+// This is more than twice the diagonal of a pixel that is MARGIN / 3 units wide. So the rendered pixels stay the same (including the antialiased ones along the edges of eraser strokes) at all resolutions of at least 72 dpi.
+class Compactor {
+public:
+	static constexpr int MARGIN = 3000;
+	// The widget size for which check renders the layers (as in the GUI).
+	static QSize check_size() {
+		return QSize(1000, 1400);
+	}
+
+	// What compacting a layer does: Delete the strokes at the given positions, then insert the new strokes (see NormalLayer::delete_strokes, NormalLayer::insert_strokes).
+	struct Changes {
+		std::vector<size_t> deleted;
+		std::vector<size_t> inserted;
+		std::vector<unique_ptr_Stroke> new_strokes;
+		bool empty() const {
+			return deleted.empty() && inserted.empty();
+		}
+	};
+
+	struct Stats {
+		size_t strokes_before = 0, strokes_after = 0;
+		size_t points_before = 0, points_after = 0;
+		size_t removed_pen_strokes = 0;  // Completely erased pen strokes
+		size_t split_pen_strokes = 0;  // Partly erased pen strokes, which were replaced by their visible pieces
+		size_t removed_eraser_strokes = 0;
+		// Added by check
+		bool checked = false;
+		double render_milliseconds_before = 0, render_milliseconds_after = 0;
+		qint64 different_pixels = 0;
+		// Human-readable summary
+		QStringList report() const;
+	};
+
+	// Computes the changes for the layer (without changing it) and adds them to the statistics.
+	static Changes compact(const NormalLayer* layer, Stats& stats);
+	// Renders the layer of the page before and after the changes (without changing it), and adds the render times and the number of pixels that differ to the statistics.
+	static void check(SPage* page, const NormalLayer* layer, const Changes& changes, QSize widget_size, Stats& stats);
+	// Compacts all normal layers of the document (without undo). If the size is valid, every changed layer is checked first.
+	static Stats compact(Document* doc, QSize check_size = QSize());
+};
+
+#endif  // COMPACTOR_H
@@ -1,7 +1,10 @@
 #include "document.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
+#include <QCryptographicHash>
 #include <QTimer>
 
 // The header poppler.h defines a variable called signals, which is a qt keyword.
@@ -30,6 +33,93 @@ void FadingStroke::timeout() {
 	m_layer->delete_stroke(m_it, std::move(m_stroke));
 }
 
+// Tolerance of the first level of detail (in units) and factor between consecutive levels
+static const double LOD_BASE_TOLERANCE = 8;
+static const double LOD_TOLERANCE_FACTOR = 4;
+static const size_t LOD_MAX_LEVELS = 6;
+
+// Distance of p to the segment from a to b.
+static double distance_to_segment(Point p, Point a, Point b) {
+	double dx = b.x - a.x, dy = b.y - a.y;
+	double length2 = dx * dx + dy * dy;
+	double t = length2 > 0 ? std::clamp(((p.x - a.x) * dx + (p.y - a.y) * dy) / length2, 0., 1.) : 0;
+	return std::hypot(p.x - a.x - t * dx, p.y - a.y - t * dy);
+}
+
+// Douglas-Peucker: Keeps the first and last point and recursively the point furthest away from the simplified segment, as long as that is further away than the tolerance.
+static std::vector<Point> simplify_polyline(const std::vector<Point>& points, double tolerance) {
+	if (points.size() <= 2)
+		return points;
+	std::vector<bool> keep(points.size());
+	keep.front() = keep.back() = true;
+	std::vector<std::pair<size_t, size_t> > stack = {{0, points.size() - 1}};
+	while (!stack.empty()) {
+		auto [i, j] = stack.back();
+		stack.pop_back();
+		double max_distance = -1;
+		size_t furthest = i;
+		for (size_t k = i + 1; k < j; k++) {
+			double distance = distance_to_segment(points[k], points[i], points[j]);
+			if (distance > max_distance) {
+				max_distance = distance;
+				furthest = k;
+			}
+		}
+		if (max_distance > tolerance) {
+			keep[furthest] = true;
+			stack.push_back({i, furthest});
+			stack.push_back({furthest, j});
+		}
+	}
+	std::vector<Point> res;
+	for (size_t k = 0; k < points.size(); k++) {
+		if (keep[k])
+			res.push_back(points[k]);
+	}
+	return res;
+}
+
+double PathStroke::level_error(size_t level) {
+	// Each level is simplified from the previous one, so the errors add up: tolerance * (1 + 1/4 + 1/16 + ...) < tolerance * 4/3
+	return LOD_BASE_TOLERANCE * std::pow(LOD_TOLERANCE_FACTOR, level) * LOD_TOLERANCE_FACTOR / (LOD_TOLERANCE_FACTOR - 1);
+}
+
+std::shared_ptr<const std::vector<Point> > PathStroke::simplified_points(double max_error) const {
+	// The original points (without taking ownership)
+	std::shared_ptr<const std::vector<Point> > original(std::shared_ptr<const std::vector<Point> >(), &m_points);
+	if (max_error < level_error(0) || m_points.size() <= 2)
+		return original;
+	std::shared_ptr<const LevelsOfDetail> lod = std::atomic_load(&m_levels_of_detail);
+	if (!lod || lod->number_of_points != m_points.size()) {
+		// If two threads get here at the same time, both compute the levels, and one of the results is kept.
+		auto new_lod = std::make_shared<LevelsOfDetail>();
+		new_lod->number_of_points = m_points.size();
+		const std::vector<Point>* previous = &m_points;
+		for (size_t level = 0; level < LOD_MAX_LEVELS && previous->size() > 2; level++) {
+			new_lod->levels.push_back(simplify_polyline(*previous, LOD_BASE_TOLERANCE * std::pow(LOD_TOLERANCE_FACTOR, level)));
+			previous = &new_lod->levels.back();
+		}
+		lod = new_lod;
+		std::atomic_store(&m_levels_of_detail, lod);
+	}
+	// Use the coarsest level that is accurate enough.
+	for (size_t level = lod->levels.size(); level-- > 0;) {
+		if (level_error(level) <= max_error)
+			return std::shared_ptr<const std::vector<Point> >(lod, &lod->levels[level]);
+	}
+	return original;
+}
+
+size_t PathStroke::simplified_points_memory_usage() const {
+	std::shared_ptr<const LevelsOfDetail> lod = std::atomic_load(&m_levels_of_detail);
+	if (!lod)
+		return 0;
+	size_t res = sizeof(LevelsOfDetail);
+	for (const std::vector<Point>& level : lod->levels)
+		res += sizeof(level) + level.capacity() * sizeof(Point);
+	return res;
+}
+
 NormalLayer::NormalLayer(const NormalLayer& a) {
 	// Copy the strokes.
 	reserve_strokes(a.strokes().size());
@@ -42,6 +132,116 @@ NormalLayer::NormalLayer(const NormalLayer& a) {
 	}
 }
 
+std::vector<unique_ptr_Stroke> NormalLayer::delete_strokes(const std::vector<size_t>& positions) {
+	std::vector<unique_ptr_Stroke> deleted;
+	if (positions.empty())
+		return deleted;
+	deleted.reserve(positions.size());
+	// Move the remaining strokes forward in a single pass.
+	size_t out = positions[0], next = 0;
+	for (size_t i = positions[0]; i < m_strokes.size(); i++) {
+		if (next < positions.size() && positions[next] == i) {
+			deleted.push_back(std::move(m_strokes[i]));
+			next++;
+		} else {
+			m_strokes[out++] = std::move(m_strokes[i]);
+		}
+	}
+	assert(next == positions.size());
+	m_strokes.resize(out);
+	// The strokes after the first position have moved.
+	m_stroke_positions.clear();
+	std::vector<ptr_Stroke> ptrs;
+	ptrs.reserve(deleted.size());
+	for (const unique_ptr_Stroke& stroke : deleted) {
+		if (m_stroke_index)
+			index_stroke(get(stroke), false);
+		ptrs.push_back(get(stroke));
+	}
+	emit strokes_deleted(ptrs);
+	return deleted;
+}
+
+void NormalLayer::insert_strokes(const std::vector<size_t>& positions, std::vector<unique_ptr_Stroke> strokes) {
+	assert(positions.size() == strokes.size());
+	if (strokes.empty())
+		return;
+	std::vector<ptr_Stroke> ptrs;
+	ptrs.reserve(strokes.size());
+	for (const unique_ptr_Stroke& stroke : strokes) {
+		if (m_stroke_index)
+			index_stroke(get(stroke), true);
+		ptrs.push_back(get(stroke));
+	}
+	// Move the strokes after the first position backward in a single pass, starting at the end.
+	size_t in = m_strokes.size(), next = strokes.size();
+	m_strokes.resize(m_strokes.size() + strokes.size());
+	size_t i = m_strokes.size();
+	while (next > 0) {
+		i--;
+		if (positions[next - 1] == i)
+			m_strokes[i] = std::move(strokes[--next]);
+		else
+			m_strokes[i] = std::move(m_strokes[--in]);
+	}
+	assert(in == i);
+	m_stroke_positions.clear();
+	emit strokes_inserted(ptrs);
+}
+
+std::vector<size_t> NormalLayer::strokes_near(Point a, Point b, double distance) const {
+	if (!m_stroke_index) {
+		m_stroke_index = std::make_unique<StrokeIndex>();
+		for (const unique_ptr_Stroke& stroke : m_strokes)
+			index_stroke(get(stroke), true);
+	}
+	std::vector<const PenStroke*> found = m_stroke_index->find(a, b, distance);
+	std::vector<size_t> positions;
+	if (found.empty())
+		return positions;
+	if (m_stroke_positions.empty()) {
+		for (size_t i = 0; i < m_strokes.size(); i++) {
+			ptr_Stroke stroke = get(m_strokes[i]);
+			if (std::holds_alternative<PenStroke*>(stroke))
+				m_stroke_positions[std::get<PenStroke*>(stroke)] = i;
+		}
+	}
+	positions.reserve(found.size());
+	for (const PenStroke* stroke : found)
+		positions.push_back(m_stroke_positions.at(stroke));
+	std::sort(positions.begin(), positions.end());
+	return positions;
+}
+
+void NormalLayer::index_stroke(ptr_Stroke stroke, bool insert) const {
+	// The stroke eraser only deletes pen strokes.
+	if (PenStroke* const* pen_stroke = std::get_if<PenStroke*>(&stroke)) {
+		if (insert)
+			m_stroke_index->insert(*pen_stroke);
+		else
+			m_stroke_index->remove(*pen_stroke);
+	}
+}
+
+std::unique_ptr<ChangeNotifier> change_notifier_singleton;
+
+ChangeNotifier* ChangeNotifier::self() {
+	if (!change_notifier_singleton)
+		change_notifier_singleton.reset(new ChangeNotifier);
+	return change_notifier_singleton.get();
+}
+
+void ChangeNotifier::end() {
+	assert(m_depth > 0);
+	if (--m_depth == 0)
+		emit finished();
+}
+
+std::mutex& poppler_mutex() {
+	static std::mutex mutex;
+	return mutex;
+}
+
 template <class T>
 GObjectWrapper<T>::~GObjectWrapper<T>() {
 	if (m_value)
@@ -90,6 +290,12 @@ EmbeddedPDF::EmbeddedPDF(const QString& name, const QByteArray& contents) :
 	}
 }
 
+QByteArray EmbeddedPDF::content_hash() const {
+	if (m_content_hash.isEmpty())
+		m_content_hash = QCryptographicHash::hash(m_contents, QCryptographicHash::Sha1);
+	return m_content_hash;
+}
+
 std::vector<std::pair<int, int> > EmbeddedPDF::page_label_ranges() const {
 	std::vector<std::pair<int, int> > res;
 	char* prev_label = nullptr;
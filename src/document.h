@@ -3,15 +3,20 @@
 
 #include "util.h"
 #include "all-types.h"
+#include "stroke-index.h"
 
 #include <list>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
 #include <variant>
 #include <vector>
 
 #include <QColor>
 #include <QString>
 #include <QObject>
+#include <QRect>
 
 class QTimer;
 
@@ -69,13 +74,33 @@ public:
 	}
 	void push_back(Point point) {
 		m_points.push_back(point);
+		m_bounding_box |= QRect(point.x, point.y, 1, 1);
 	}
 	void reserve_points(size_t n) {
 		m_points.reserve(n);
 	}
+	// The smallest rectangle containing all points (in units). This is empty if there are no points.
+	QRect bounding_box() const {
+		return m_bounding_box;
+	}
+
+	// The points of a simplified path that deviates by at most max_error (in units) from the actual path (level of detail).
+	// The simplifications are computed on demand for a few fixed tolerances and then kept, so this is cheap when called again. This is thread-safe.
+	std::shared_ptr<const std::vector<Point> > simplified_points(double max_error) const;
+	// Memory (in bytes) used by the simplifications.
+	size_t simplified_points_memory_usage() const;
 
 private:
 	std::vector<Point> m_points;
+	QRect m_bounding_box;
+
+	struct LevelsOfDetail {
+		size_t number_of_points;  // The number of points of the stroke when the levels were computed
+		std::vector<std::vector<Point> > levels;  // levels[k] deviates by at most level_error(k) from the stroke.
+	};
+	static double level_error(size_t level);
+	// Only accessed with std::atomic_load/std::atomic_store, since several rendering threads may use the same stroke.
+	mutable std::shared_ptr<const LevelsOfDetail> m_levels_of_detail;
 };
 
 class PenStroke : public PathStroke {
@@ -155,20 +180,61 @@ public:
 	}
 	void add_stroke(unique_ptr_Stroke stroke) {
 		m_strokes.emplace_back(std::move(stroke));
+		if (m_stroke_index)
+			index_stroke(get(m_strokes.back()), true);
+		if (!m_stroke_positions.empty() && std::holds_alternative<PenStroke*>(get(m_strokes.back())))
+			m_stroke_positions[std::get<PenStroke*>(get(m_strokes.back()))] = m_strokes.size() - 1;
 		emit stroke_added(get(m_strokes.back()));
 	}
 	unique_ptr_Stroke delete_stroke() {
 		unique_ptr_Stroke stroke = std::move(m_strokes.back());
 		m_strokes.pop_back();
+		if (m_stroke_index)
+			index_stroke(get(stroke), false);
+		if (std::holds_alternative<PenStroke*>(get(stroke)))
+			m_stroke_positions.erase(std::get<PenStroke*>(get(stroke)));
 		emit stroke_deleted(get(stroke));
 		return stroke;
 	}
+	// Removes the strokes at the given positions (in increasing order) and returns them.
+	std::vector<unique_ptr_Stroke> delete_strokes(const std::vector<size_t>& positions);
+	// Inverse of delete_strokes: Inserts the strokes such that they end up at the given positions (in increasing order).
+	void insert_strokes(const std::vector<size_t>& positions, std::vector<unique_ptr_Stroke> strokes);
 	void reserve_strokes(size_t n) {
 		m_strokes.reserve(n);
 	}
+	// Removes and returns all strokes, or puts them back, without emitting signals.
+	// This is only meant for layers that are not shown, i.e. on pages owned by an undo command (see UndoSpillFile).
+	std::vector<unique_ptr_Stroke> take_strokes() {
+		m_stroke_index.reset();
+		m_stroke_positions.clear();
+		return std::exchange(m_strokes, {});
+	}
+	void restore_strokes(std::vector<unique_ptr_Stroke> strokes) {
+		assert(m_strokes.empty());
+		m_strokes = std::move(strokes);
+	}
+
+	// The positions (in increasing order) of the pen strokes whose line comes within the given distance (in units) of the segment from a to b.
+	// The first call builds a StrokeIndex of the layer, which is then kept up to date.
+	std::vector<size_t> strokes_near(Point a, Point b, double distance) const;
+	// Memory (in bytes) used by the StrokeIndex and the positions of the pen strokes.
+	size_t stroke_index_memory_usage() const {
+		size_t positions = m_stroke_positions.bucket_count() * sizeof(void*) + m_stroke_positions.size() * (sizeof(std::pair<const PenStroke*, size_t>) + sizeof(void*));
+		return (m_stroke_index ? m_stroke_index->memory_usage() : 0) + positions;
+	}
+signals:
+	void strokes_deleted(const std::vector<ptr_Stroke>& strokes);  // Emitted by delete_strokes after removing the strokes (which still exist).
+	void strokes_inserted(const std::vector<ptr_Stroke>& strokes);  // Emitted by insert_strokes after inserting the strokes.
 
 private:
+	void index_stroke(ptr_Stroke stroke, bool insert) const;
+
 	std::vector<unique_ptr_Stroke> m_strokes;
+	mutable std::unique_ptr<StrokeIndex> m_stroke_index;
+	// The position of every pen stroke, to turn the strokes found in the StrokeIndex into positions.
+	// Built by strokes_near when it is empty. Deleting or inserting strokes in the middle clears it.
+	mutable std::unordered_map<const PenStroke*, size_t> m_stroke_positions;
 };
 
 class TemporaryLayer : public DrawingLayer {
@@ -266,14 +332,20 @@ public:
 	}
 	// List of page ranges [x,y] that have the same page label.
 	std::vector<std::pair<int, int> > page_label_ranges() const;
+	// A hash of the contents (computed on first use).
+	QByteArray content_hash() const;
 
 private:
 	QString m_name;
 	QByteArray m_contents;
+	mutable QByteArray m_content_hash;
 	GObjectWrapper<_PopplerDocument> m_document;
 	std::vector<GObjectWrapper<_PopplerPage> > m_pages;  // Destructed before m_document
 };
 
+// Poppler documents must not be used by several threads at once. Hold this lock while rendering a poppler page (thumbnails are rendered in worker threads).
+std::mutex& poppler_mutex();
+
 class PDFLayer : public QObject {
 	Q_OBJECT
 public:
@@ -360,6 +432,42 @@ private:
 	std::unique_ptr<TemporaryLayer> m_temporary_layer;
 };
 
+// Groups changes of documents (e.g. many undo steps at once) so that views can update once at the end instead of after every change.
+// The signals of the document are still emitted for every change. Listeners that can combine their work check active() and finish it when finished() is emitted.
+class ChangeNotifier : public QObject {
+	Q_OBJECT
+public:
+	static ChangeNotifier* self();
+
+	// Whether a ChangeTransaction is in progress.
+	bool active() const {
+		return m_depth > 0;
+	}
+	void begin() {
+		m_depth++;
+	}
+	void end();
+signals:
+	// Emitted when the outermost transaction ends.
+	void finished();
+
+private:
+	int m_depth = 0;
+};
+
+// Combines all changes made during its lifetime into one transaction (see ChangeNotifier). Transactions can be nested.
+class ChangeTransaction {
+public:
+	ChangeTransaction() {
+		ChangeNotifier::self()->begin();
+	}
+	ChangeTransaction(const ChangeTransaction&) = delete;
+	ChangeTransaction& operator=(const ChangeTransaction&) = delete;
+	~ChangeTransaction() {
+		ChangeNotifier::self()->end();
+	}
+};
+
 class Document : public QObject {
 	Q_OBJECT
 public:
@@ -0,0 +1,332 @@
+#include "eraser-clip.h"
+
+#include "document.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+namespace {
+
+struct Vertex {
+	double x, y;
+};
+
+double cross(Vertex o, Vertex a, Vertex b) {
+	return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+}
+
+// The convex hull of the points (Andrew's monotone chain), with all vertices in the same orientation.
+std::vector<Vertex> convex_hull(std::vector<Vertex> points) {
+	std::sort(points.begin(), points.end(), [](Vertex a, Vertex b) {
+		return a.x < b.x || (a.x == b.x && a.y < b.y);
+	});
+	std::vector<Vertex> hull(2 * points.size());
+	size_t k = 0;
+	for (size_t i = 0; i < points.size(); i++) {
+		while (k >= 2 && cross(hull[k - 2], hull[k - 1], points[i]) <= 0)
+			k--;
+		hull[k++] = points[i];
+	}
+	for (size_t i = points.size() - 1, t = k + 1; i > 0; i--) {
+		while (k >= t && cross(hull[k - 2], hull[k - 1], points[i - 1]) <= 0)
+			k--;
+		hull[k++] = points[i - 1];
+	}
+	hull.resize(k - 1);  // The last point equals the first one.
+	return hull;
+}
+
+// A polygon containing all points within the given radius of the segment from a to b.
+// The disks around the end points are replaced by circumscribed regular polygons, whose corners are at most TOLERANCE away from the circle.
+std::vector<Vertex> capsule(Point a, Point b, double radius) {
+	int n = std::clamp((int)std::ceil(M_PI * std::sqrt(radius / (2 * EraserClip::TOLERANCE))), 8, 64);
+	double outer_radius = radius / std::cos(M_PI / n);
+	std::vector<Vertex> corners;
+	corners.reserve(2 * n);
+	for (int i = 0; i < n; i++) {
+		double angle = 2 * M_PI * i / n;
+		double dx = outer_radius * std::cos(angle), dy = outer_radius * std::sin(angle);
+		corners.push_back(Vertex{a.x + dx, a.y + dy});
+		corners.push_back(Vertex{b.x + dx, b.y + dy});
+	}
+	return convex_hull(std::move(corners));
+}
+
+struct Edge {
+	Vertex top, bottom;  // top.y < bottom.y
+	bool eraser;  // Whether this is an edge of an eraser polygon (or of the bounding box)
+	int winding;  // +1 if the edge points down, -1 if it points up
+	double x_at(double y) const {
+		return top.x + (bottom.x - top.x) * (y - top.y) / (bottom.y - top.y);
+	}
+};
+
+void add_polygon(std::vector<Edge>& edges, const std::vector<Vertex>& polygon, bool eraser) {
+	for (size_t i = 0; i < polygon.size(); i++) {
+		Vertex p = polygon[i], q = polygon[(i + 1) % polygon.size()];
+		if (p.y < q.y)
+			edges.push_back(Edge{p, q, eraser, 1});
+		else if (p.y > q.y)
+			edges.push_back(Edge{q, p, eraser, -1});
+	}
+}
+
+// The y coordinate at which the edges cross (if they do).
+std::optional<double> crossing(const Edge& e, const Edge& f) {
+	double rx = e.bottom.x - e.top.x, ry = e.bottom.y - e.top.y;
+	double sx = f.bottom.x - f.top.x, sy = f.bottom.y - f.top.y;
+	double denominator = rx * sy - ry * sx;
+	if (denominator == 0)
+		return std::nullopt;
+	double qx = f.top.x - e.top.x, qy = f.top.y - e.top.y;
+	double t = (qx * sy - qy * sx) / denominator;
+	double u = (qx * ry - qy * rx) / denominator;
+	if (t <= 0 || t >= 1 || u <= 0 || u >= 1)
+		return std::nullopt;
+	return e.top.y + t * ry;
+}
+
+// Adds the part of the rectangle [left, right] x [top, bottom] that lies outside all polygons (which must have the same orientation) to res.
+// The plane is cut into horizontal strips at all corners and crossings. Inside a strip, no edges cross, so the region is a sequence of trapezoids between consecutive edges.
+// Trapezoids between the same two edges in consecutive strips are merged.
+void sweep(double left, double top, double right, double bottom, const std::vector<const std::vector<Vertex>*>& polygons, std::vector<EraserClip::Trapezoid>& res) {
+	std::vector<Edge> edges;
+	add_polygon(edges, {{left, top}, {right, top}, {right, bottom}, {left, bottom}}, false);
+	for (const std::vector<Vertex>* polygon : polygons)
+		add_polygon(edges, *polygon, true);
+	std::sort(edges.begin(), edges.end(), [](const Edge& e, const Edge& f) {
+		return e.top.y < f.top.y;
+	});
+	std::vector<double> ys;
+	for (const Edge& e : edges) {
+		ys.push_back(e.top.y);
+		ys.push_back(e.bottom.y);
+	}
+	// Only edges in the same cell of a grid over the rectangle (with about one edge per cell) can cross, so that dense scribbles don't compare all pairs of edges.
+	// The crossing of two edges is only looked for in the first cell they share.
+	int n = std::max(1, (int)std::sqrt(edges.size()));
+	double cell_width = (right - left) / n, cell_height = (bottom - top) / n;
+	auto cell_x = [&](double x) {
+		return std::clamp(cell_width > 0 ? (int)std::floor((x - left) / cell_width) : 0, 0, n - 1);
+	};
+	auto cell_y = [&](double y) {
+		return std::clamp(cell_height > 0 ? (int)std::floor((y - top) / cell_height) : 0, 0, n - 1);
+	};
+	struct CellRange {
+		int x1, y1, x2, y2;
+	};
+	std::vector<CellRange> ranges(edges.size());
+	std::vector<std::vector<size_t> > cells(n * n);
+	for (size_t i = 0; i < edges.size(); i++) {
+		const Edge& e = edges[i];
+		CellRange& r = ranges[i];
+		r = CellRange{cell_x(std::min(e.top.x, e.bottom.x)), cell_y(e.top.y), cell_x(std::max(e.top.x, e.bottom.x)), cell_y(e.bottom.y)};
+		for (int cy = r.y1; cy <= r.y2; cy++) {
+			for (int cx = r.x1; cx <= r.x2; cx++)
+				cells[cy * n + cx].push_back(i);
+		}
+	}
+	for (int c = 0; c < n * n; c++) {
+		const std::vector<size_t>& cell = cells[c];
+		for (size_t a = 0; a < cell.size(); a++) {
+			const Edge& e = edges[cell[a]];
+			const CellRange& r = ranges[cell[a]];
+			double e_left = std::min(e.top.x, e.bottom.x), e_right = std::max(e.top.x, e.bottom.x);
+			for (size_t b = a + 1; b < cell.size(); b++) {
+				const Edge& f = edges[cell[b]];
+				const CellRange& q = ranges[cell[b]];
+				if (std::max(r.y1, q.y1) * n + std::max(r.x1, q.x1) != c)
+					continue;
+				if (f.top.y >= e.bottom.y || e.top.y >= f.bottom.y || std::max(f.top.x, f.bottom.x) < e_left || std::min(f.top.x, f.bottom.x) > e_right)
+					continue;
+				if (std::optional<double> y = crossing(e, f))
+					ys.push_back(*y);
+			}
+		}
+	}
+	ys.erase(std::remove_if(ys.begin(), ys.end(), [&](double y) {
+		         return y < top || y > bottom;
+	         }),
+	         ys.end());
+	std::sort(ys.begin(), ys.end());
+	ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+
+	// The trapezoids reaching the bottom of the previous strip, by their left and right edge
+	std::map<std::pair<size_t, size_t>, size_t> open, next_open;
+	std::vector<size_t> active;
+	size_t next_edge = 0;
+	for (size_t k = 0; k + 1 < ys.size(); k++) {
+		double y0 = ys[k], y1 = ys[k + 1];
+		double middle = (y0 + y1) / 2;
+		active.erase(std::remove_if(active.begin(), active.end(), [&](size_t i) {
+			             return edges[i].bottom.y <= middle;
+		             }),
+		             active.end());
+		for (; next_edge < edges.size() && edges[next_edge].top.y < middle; next_edge++) {
+			if (edges[next_edge].bottom.y > middle)
+				active.push_back(next_edge);
+		}
+		// The order only changes at crossings and for the new edges, so insertion sort takes about linear time.
+		for (size_t a = 1; a < active.size(); a++) {
+			size_t i = active[a];
+			double x = edges[i].x_at(middle);
+			size_t b = a;
+			for (; b > 0 && edges[active[b - 1]].x_at(middle) > x; b--)
+				active[b] = active[b - 1];
+			active[b] = i;
+		}
+		next_open.clear();
+		int box_winding = 0, eraser_winding = 0;
+		for (size_t a = 0; a + 1 < active.size(); a++) {
+			const Edge& e = edges[active[a]];
+			(e.eraser ? eraser_winding : box_winding) += e.winding;
+			if (box_winding == 0 || eraser_winding != 0)
+				continue;
+			std::pair<size_t, size_t> key(active[a], active[a + 1]);
+			const Edge& f = edges[active[a + 1]];
+			auto it = open.find(key);
+			if (it != open.end()) {
+				EraserClip::Trapezoid& t = res[it->second];
+				t.bottom = y1;
+				t.bottom_left = e.x_at(y1);
+				t.bottom_right = f.x_at(y1);
+				next_open[key] = it->second;
+			} else {
+				next_open[key] = res.size();
+				res.push_back(EraserClip::Trapezoid{y0, y1, e.x_at(y0), f.x_at(y0), e.x_at(y1), f.x_at(y1)});
+			}
+		}
+		std::swap(open, next_open);
+	}
+}
+
+struct Box {
+	double left, top, right, bottom;
+};
+
+// Whether the convex polygon (see convex_hull) contains the point.
+bool contains(const std::vector<Vertex>& polygon, Vertex p) {
+	for (size_t i = 0; i < polygon.size(); i++) {
+		if (cross(polygon[i], polygon[(i + 1) % polygon.size()], p) < 0)
+			return false;
+	}
+	return true;
+}
+
+// Whether the convex polygon (with the given bounding box) and the rectangle overlap: No side of either one separates them.
+bool overlaps(const std::vector<Vertex>& polygon, const Box& b, const Box& box) {
+	if (b.left >= box.right || b.right <= box.left || b.top >= box.bottom || b.bottom <= box.top)
+		return false;
+	for (size_t i = 0; i < polygon.size(); i++) {
+		Vertex p = polygon[i], q = polygon[(i + 1) % polygon.size()];
+		if (cross(p, q, {box.left, box.top}) <= 0 && cross(p, q, {box.right, box.top}) <= 0 && cross(p, q, {box.left, box.bottom}) <= 0 && cross(p, q, {box.right, box.bottom}) <= 0)
+			return false;
+	}
+	return true;
+}
+
+// Splits the rectangle in halves while that separates the polygons, and sweeps the parts.
+// Every strip of the sweep spans its whole rectangle, so without splitting, long or dense eraser strokes would take quadratic time.
+void split(Box box, const std::vector<std::vector<Vertex> >& polygons, const std::vector<Box>& boxes, const std::vector<size_t>& indices, int depth, std::vector<EraserClip::Trapezoid>& res) {
+	const size_t MAX_POLYGONS = 8;
+	const int MAX_DEPTH = 12;
+	for (size_t i : indices) {
+		// The polygons are convex, so this one covers the rectangle if it contains its corners.
+		const std::vector<Vertex>& polygon = polygons[i];
+		if (contains(polygon, {box.left, box.top}) && contains(polygon, {box.right, box.top}) && contains(polygon, {box.left, box.bottom}) && contains(polygon, {box.right, box.bottom}))
+			return;
+	}
+	auto sweep_box = [&]() {
+		std::vector<const std::vector<Vertex>*> part;
+		for (size_t i : indices)
+			part.push_back(&polygons[i]);
+		sweep(box.left, box.top, box.right, box.bottom, part, res);
+	};
+	if (indices.size() <= MAX_POLYGONS || depth >= MAX_DEPTH) {
+		sweep_box();
+		return;
+	}
+	Box halves[2] = {box, box};
+	if (box.right - box.left >= box.bottom - box.top)
+		halves[0].right = halves[1].left = (box.left + box.right) / 2;
+	else
+		halves[0].bottom = halves[1].top = (box.top + box.bottom) / 2;
+	std::vector<size_t> parts[2];
+	for (int h = 0; h < 2; h++) {
+		for (size_t i : indices) {
+			if (overlaps(polygons[i], boxes[i], halves[h]))
+				parts[h].push_back(i);
+		}
+	}
+	// Splitting only pays off if the halves meet fewer polygons (otherwise it only cuts the trapezoids).
+	if (parts[0].size() + parts[1].size() > indices.size() * 3 / 2) {
+		sweep_box();
+		return;
+	}
+	for (int h = 0; h < 2; h++)
+		split(halves[h], polygons, boxes, parts[h], depth + 1, res);
+}
+
+// The part of the rectangle [left, right] x [top, bottom] that lies outside all polygons (which must be convex and have the same orientation).
+std::vector<EraserClip::Trapezoid> outside(double left, double top, double right, double bottom, const std::vector<std::vector<Vertex> >& polygons) {
+	std::vector<Box> boxes;
+	std::vector<size_t> indices;
+	for (const std::vector<Vertex>& polygon : polygons) {
+		Box b{INFINITY, INFINITY, -INFINITY, -INFINITY};
+		for (Vertex v : polygon) {
+			b.left = std::min(b.left, v.x);
+			b.top = std::min(b.top, v.y);
+			b.right = std::max(b.right, v.x);
+			b.bottom = std::max(b.bottom, v.y);
+		}
+		if (b.left < right && b.right > left && b.top < bottom && b.bottom > top)
+			indices.push_back(boxes.size());
+		boxes.push_back(b);
+	}
+	std::vector<EraserClip::Trapezoid> res;
+	split(Box{left, top, right, bottom}, polygons, boxes, indices, 0, res);
+	return res;
+}
+
+}  // namespace
+
+EraserClip::EraserClip(const NormalLayer* layer) {
+	for (ptr_Stroke stroke : layer->strokes())
+		m_strokes.push_back(stroke);
+	for (size_t position = 0; position < m_strokes.size(); position++) {
+		if (!std::holds_alternative<EraserStroke*>(m_strokes[position]))
+			continue;
+		const EraserStroke* eraser = std::get<EraserStroke*>(m_strokes[position]);
+		const std::vector<Point>& points = eraser->points();
+		double radius = eraser->width() / 2.;
+		int r = std::ceil(radius + TOLERANCE);
+		for (size_t i = 0; i < points.size() && (i == 0 || i + 1 < points.size()); i++) {
+			Point a = points[i], b = points[std::min(i + 1, points.size() - 1)];
+			size_t index = m_segments.size();
+			m_segments.push_back(EraserSegment{a, b, radius, position});
+			m_grid.insert(QRect(QPoint(std::min(a.x, b.x) - r, std::min(a.y, b.y) - r), QPoint(std::max(a.x, b.x) + r, std::max(a.y, b.y) + r)), index);
+		}
+	}
+}
+
+std::optional<std::vector<EraserClip::Trapezoid> > EraserClip::visible_region(size_t position) const {
+	const PenStroke* stroke = std::get<PenStroke*>(m_strokes[position]);
+	if (m_segments.empty() || stroke->points().empty())
+		return std::nullopt;
+	TRACE_SCOPE("EraserClip::visible_region");
+	double pen_radius = stroke->width() / 2.;
+	// Everything the stroke covers, with a little room for rounding
+	int r = std::ceil(pen_radius) + 1;
+	QRect box = stroke->bounding_box().adjusted(-r, -r, r, r);
+	std::vector<std::vector<Vertex> > polygons;
+	for (size_t index : m_grid.find(box)) {
+		const EraserSegment& s = m_segments[index];
+		if (s.position > position && StrokeIndex::touches(stroke->points(), s.a, s.b, s.radius + TOLERANCE + pen_radius))
+			polygons.push_back(capsule(s.a, s.b, s.radius));
+	}
+	if (polygons.empty())
+		return std::nullopt;
+	return outside(box.left(), box.top(), box.left() + box.width(), box.top() + box.height(), polygons);
+}
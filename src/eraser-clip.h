@@ -0,0 +1,42 @@
+#ifndef ERASER_CLIP_H
+#define ERASER_CLIP_H
+
+#include "all-types.h"
+#include "stroke-index.h"
+
+#include <optional>
+#include <vector>
+
+// Erases pen strokes geometrically, so that eraser strokes can be exported to PDF as plain vector paths:
+// For each pen stroke of a layer, it computes the region around the stroke that is not covered by eraser strokes drawn after it.
+// Drawing the pen stroke clipped to this region gives the same picture as drawing it and then erasing.
+// The eraser strokes are replaced by polygons that contain them and are at most TOLERANCE units larger.
+class EraserClip {
+public:
+	static constexpr double TOLERANCE = 50;
+
+	// A trapezoid whose top and bottom sides are horizontal.
+	struct Trapezoid {
+		double top, bottom;
+		double top_left, top_right;
+		double bottom_left, bottom_right;
+	};
+
+	explicit EraserClip(const NormalLayer* layer);
+	// The region around the pen stroke at the given position in the layer that is not erased, as a union of disjoint trapezoids.
+	// This is empty if the stroke is erased completely, and std::nullopt if no eraser stroke drawn after the stroke touches it.
+	std::optional<std::vector<Trapezoid> > visible_region(size_t position) const;
+
+private:
+	struct EraserSegment {
+		Point a, b;
+		double radius;
+		size_t position;  // Of the eraser stroke in the layer
+	};
+	std::vector<ptr_Stroke> m_strokes;
+	std::vector<EraserSegment> m_segments;
+	// The indices of the eraser segments (with TOLERANCE around them)
+	UniformGrid<size_t> m_grid;
+};
+
+#endif  // ERASER_CLIP_H
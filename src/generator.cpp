@@ -0,0 +1,188 @@
+#include "generator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include <cairomm/context.h>
+#include <cairomm/surface.h>
+#include <cairo-pdf.h>
+
+const double MILLIMETER_TO_UNIT = METER_TO_UNIT / 1000;
+// Same as the eraser in the page widget
+const int ERASER_WIDTH = 1500 * 20;
+
+// Writes words of pseudo-cursive handwriting line by line, starting again at the top when the page is full.
+// Points are sampled at a (varying) constant rate along the pen trajectory, like a tablet does.
+class HandwritingGenerator {
+public:
+	HandwritingGenerator(const GeneratorOptions& options, int width, int height, std::mt19937& rng) :
+	    m_options(options),
+	    m_width(width),
+	    m_height(height),
+	    m_rng(rng),
+	    m_margin(20 * MILLIMETER_TO_UNIT),
+	    m_line_spacing(9 * MILLIMETER_TO_UNIT),
+	    m_x(m_margin),
+	    m_y(m_margin + m_line_spacing) {
+		assert(!m_options.colors.empty() && !m_options.widths.empty());
+	}
+	unique_ptr_Stroke next_stroke() {
+		int number_of_points = std::max(1, (int)std::lround(m_options.points_per_stroke * std::exp(normal(0.3))));
+		if (uniform() < m_options.eraser_ratio)
+			return eraser_stroke(number_of_points);
+		return pen_stroke(number_of_points);
+	}
+
+private:
+	double uniform() {
+		return std::uniform_real_distribution<double>(0, 1)(m_rng);
+	}
+	double uniform(double a, double b) {
+		return std::uniform_real_distribution<double>(a, b)(m_rng);
+	}
+	double normal(double stddev) {
+		return std::normal_distribution<double>(0, stddev)(m_rng);
+	}
+	// Usually keeps the current index, occasionally switches to a random one.
+	size_t sticky_choice(size_t current, size_t n) {
+		if (n > 1 && uniform() < 0.05)
+			return std::uniform_int_distribution<size_t>(0, n - 1)(m_rng);
+		return current;
+	}
+	Point to_point(double x, double y) {
+		double jitter = 0.03 * MILLIMETER_TO_UNIT;
+		x = std::clamp(x + normal(jitter), 0., (double)m_width - 1);
+		y = std::clamp(y + normal(jitter), 0., (double)m_height - 1);
+		return Point(std::lround(x), std::lround(y));
+	}
+
+	// A word consisting of letters, each of which is one turn of a (sometimes looping) cycloid-like curve.
+	unique_ptr_Stroke pen_stroke(int number_of_points) {
+		m_color_index = sticky_choice(m_color_index, m_options.colors.size());
+		m_width_index = sticky_choice(m_width_index, m_options.widths.size());
+		auto stroke = std::make_unique<PenStroke>(m_options.widths[m_width_index], m_options.colors[m_color_index]);
+		stroke->reserve_points(number_of_points);
+		const double slant = 0.2;
+		double x0 = m_x;
+		double x = x0;
+		double t = 0;  // Phase within the current letter
+		double letter_width = 0, height = 0, loop = 0;
+		double speed = 1;
+		for (int i = 0; i < number_of_points; i++) {
+			if (i == 0 || t >= 2 * M_PI) {
+				// Start a new letter.
+				x0 += letter_width;
+				t = 0;
+				letter_width = uniform(1.5, 2.5) * MILLIMETER_TO_UNIT;
+				height = (uniform() < 0.15 ? uniform(3.5, 4.5) : uniform(1.5, 2.5)) * MILLIMETER_TO_UNIT;
+				loop = uniform(0, 1.3) * letter_width / (2 * M_PI);  // The trajectory loops backwards if this exceeds letter_width / (2 pi).
+			}
+			double dy = height * (1 - std::cos(t)) / 2;  // Height above the baseline
+			x = x0 + letter_width * t / (2 * M_PI) - loop * std::sin(t) + slant * dy;
+			stroke->push_back(to_point(x, m_y - dy));
+			// The pen speed varies slowly.
+			speed = std::clamp(speed + normal(0.1), 0.6, 1.4);
+			t += speed * 2 * M_PI / 14;
+		}
+		// Move on to the next word.
+		m_x = std::max(x, x0 + letter_width) + uniform(2, 4) * MILLIMETER_TO_UNIT;
+		if (m_x > m_width - m_margin) {
+			m_x = m_margin;
+			m_y += m_line_spacing;
+			if (m_y > m_height - m_margin)
+				m_y = m_margin + m_line_spacing;
+		}
+		return stroke;
+	}
+
+	// Scribbling back and forth over a region of the page.
+	unique_ptr_Stroke eraser_stroke(int number_of_points) {
+		auto stroke = std::make_unique<EraserStroke>(ERASER_WIDTH);
+		stroke->reserve_points(number_of_points);
+		double cx = uniform(m_margin, m_width - m_margin);
+		double cy = uniform(m_margin, m_height - m_margin);
+		double region_width = uniform(20, 40) * MILLIMETER_TO_UNIT;
+		double region_height = uniform(5, 15) * MILLIMETER_TO_UNIT;
+		const int period = 16;
+		for (int i = 0; i < number_of_points; i++) {
+			double progress = number_of_points == 1 ? 0.5 : (double)i / (number_of_points - 1);
+			double x = cx + region_width / 2 * std::sin(2 * M_PI * i / period);
+			double y = cy + (progress - 0.5) * region_height;
+			stroke->push_back(to_point(x, y));
+		}
+		return stroke;
+	}
+
+	const GeneratorOptions& m_options;
+	int m_width, m_height;
+	std::mt19937& m_rng;
+	double m_margin;
+	double m_line_spacing;
+	// Start of the baseline of the next word
+	double m_x, m_y;
+	size_t m_color_index = 0;
+	size_t m_width_index = 0;
+};
+
+std::unique_ptr<Document> generate_document(const GeneratorOptions& options) {
+	std::mt19937 rng(options.seed);
+	// A4 paper
+	int width = 0.210 * METER_TO_UNIT;
+	int height = 0.297 * METER_TO_UNIT;
+	auto doc = std::make_unique<Document>();
+	EmbeddedPDF* pdf = nullptr;
+	if (options.embed_pdf && options.pages > 0)
+		pdf = doc->add_embedded_pdf(std::make_unique<EmbeddedPDF>("generated.pdf", generate_pdf(options.pages, width, height, options.seed)))->get();
+	std::vector<std::unique_ptr<SPage> > pages;
+	for (int i = 0; i < options.pages; i++) {
+		auto page = std::make_unique<SPage>(width, height);
+		if (pdf)
+			page->add_layer(0, std::make_unique<PDFLayer>(pdf, i, PDFLayer::only_one()));
+		auto layer = std::make_unique<NormalLayer>();
+		layer->reserve_strokes(options.strokes_per_page);
+		HandwritingGenerator generator(options, width, height, rng);
+		for (int j = 0; j < options.strokes_per_page; j++)
+			layer->add_stroke(generator.next_stroke());
+		page->add_layer(page->layers().size(), std::move(layer));
+		pages.push_back(std::move(page));
+	}
+	if (!pages.empty())
+		doc->add_pages(0, std::move(pages));
+	return doc;
+}
+
+cairo_status_t append_to_byte_array(void* closure, const unsigned char* data, unsigned int length) {
+	static_cast<QByteArray*>(closure)->append((const char*)data, length);
+	return CAIRO_STATUS_SUCCESS;
+}
+
+QByteArray generate_pdf(int number_of_pages, int width, int height, unsigned int seed) {
+	QByteArray res;
+	double w = width * UNIT_TO_POINT, h = height * UNIT_TO_POINT;
+	Cairo::RefPtr<Cairo::PdfSurface> surface(new Cairo::PdfSurface(cairo_pdf_surface_create_for_stream(&append_to_byte_array, &res, w, h), true));
+	Cairo::RefPtr<Cairo::Context> cr = Cairo::Context::create(surface);
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	for (int page = 0; page < number_of_pages; page++) {
+		for (int i = 0; i < 20; i++) {
+			cr->set_source_rgb(uniform(rng), uniform(rng), uniform(rng));
+			cr->rectangle(uniform(rng) * w, uniform(rng) * h, 20 + uniform(rng) * 60, 20 + uniform(rng) * 60);
+			cr->fill();
+		}
+		cr->set_source_rgb(0, 0, 0);
+		cr->select_font_face("serif", Cairo::FONT_SLANT_NORMAL, Cairo::FONT_WEIGHT_BOLD);
+		cr->set_font_size(24);
+		cr->move_to(50, 80);
+		cr->show_text("Generated slide " + std::to_string(page + 1));
+		cr->select_font_face("serif", Cairo::FONT_SLANT_NORMAL, Cairo::FONT_WEIGHT_NORMAL);
+		cr->set_font_size(11);
+		for (int line = 0; line * 16 + 120 < h - 50; line++) {
+			cr->move_to(50, 120 + 16 * line);
+			cr->show_text("The quick brown fox jumps over the lazy dog. 0123456789");
+		}
+		surface->show_page();
+	}
+	surface->finish();
+	return res;
+}
@@ -0,0 +1,29 @@
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+#include "all-types.h"
+#include "document.h"
+
+#include <QByteArray>
+
+// Generates synthetic documents that look roughly like handwritten lecture notes.
+// This is useful for benchmarking and for reproducing performance problems without sharing real documents.
+// The result only depends on the options (including the seed).
+
+struct GeneratorOptions {
+	int pages = 10;
+	int strokes_per_page = 300;
+	int points_per_stroke = 60;  // Average number of points per stroke
+	double eraser_ratio = 0.02;  // Fraction of strokes that are eraser strokes
+	std::vector<Color> colors = {Color::BLACK};  // Pen colors (the first one is used most of the time)
+	std::vector<int> widths = {1000};  // Pen widths (the first one is used most of the time)
+	bool embed_pdf = false;  // Whether to embed a generated PDF file and use one of its pages as the background of each page
+	unsigned int seed = 1;
+};
+
+std::unique_ptr<Document> generate_document(const GeneratorOptions& options);
+
+// A PDF file with the given number of pages (of the given size in our unit) containing text and vector graphics.
+QByteArray generate_pdf(int number_of_pages, int width, int height, unsigned int seed);
+
+#endif  // GENERATOR_H
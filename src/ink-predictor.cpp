@@ -0,0 +1,49 @@
+#include "ink-predictor.h"
+
+#include <cmath>
+
+// The velocity is the average over this period.
+static const InkPredictor::Clock::duration VELOCITY_WINDOW = std::chrono::milliseconds(20);
+// If the last sample is older than this, the pen is probably resting and we don't predict anything.
+static const InkPredictor::Clock::duration RESTING_TIME = std::chrono::milliseconds(30);
+
+void InkPredictor::reset() {
+	m_samples.clear();
+	m_prediction.reset();
+}
+
+std::optional<double> InkPredictor::add(Point p, Clock::time_point time) {
+	std::optional<double> error;
+	if (m_prediction && !m_samples.empty() && time >= m_prediction->time) {
+		// Interpolate linearly between the previous and the new sample.
+		const Sample& prev = m_samples.back();
+		double t = 1;
+		if (time > prev.time && m_prediction->time > prev.time)
+			t = std::chrono::duration<double>(m_prediction->time - prev.time) / std::chrono::duration<double>(time - prev.time);
+		double x = prev.x + t * (p.x - prev.x), y = prev.y + t * (p.y - prev.y);
+		error = std::hypot(x - m_prediction->x, y - m_prediction->y);
+		m_prediction.reset();
+	}
+	m_samples.push_back({(double)p.x, (double)p.y, time});
+	while (m_samples.size() > 2 && time - m_samples[1].time >= VELOCITY_WINDOW)
+		m_samples.pop_front();
+	return error;
+}
+
+std::vector<Point> InkPredictor::predict(Clock::time_point now, Clock::duration horizon) {
+	if (m_samples.size() < 2)
+		return {};
+	const Sample& first = m_samples.front();
+	const Sample& last = m_samples.back();
+	if (now - last.time > RESTING_TIME || last.time <= first.time)
+		return {};
+	// Samples often arrive in bursts, so we use the time since the first sample in the window (and not since the second to last sample).
+	double dt = std::chrono::duration<double>(last.time - first.time).count();
+	double h = std::chrono::duration<double>(horizon).count();
+	double vx = (last.x - first.x) / dt, vy = (last.y - first.y) / dt;
+	Sample prediction{last.x + vx * h, last.y + vy * h, last.time + horizon};
+	// Compare one prediction at a time to the actual position.
+	if (!m_prediction)
+		m_prediction = prediction;
+	return {Point(last.x, last.y), Point(std::lround(prediction.x), std::lround(prediction.y))};
+}
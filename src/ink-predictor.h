@@ -0,0 +1,37 @@
+#ifndef INK_PREDICTOR_H
+#define INK_PREDICTOR_H
+
+#include "all-types.h"
+#include "latency-monitor.h"
+
+#include <deque>
+#include <optional>
+#include <vector>
+
+// Guesses where the pen will be a few milliseconds from now by extrapolating its recent velocity.
+// All positions are in page coordinates.
+class InkPredictor {
+public:
+	using Clock = LatencyMonitor::Clock;
+
+	// Forgets all samples (call this when a new stroke starts).
+	void reset();
+	// Adds the next position of the pen.
+	// If this resolves an earlier prediction (i.e. we now know where the pen actually was at the predicted time), returns the distance between the predicted and the actual position.
+	std::optional<double> add(Point p, Clock::time_point time);
+	// The last known position followed by the predicted position after the given horizon.
+	// Returns an empty list if there is nothing sensible to predict (too few recent samples or the pen is resting).
+	std::vector<Point> predict(Clock::time_point now, Clock::duration horizon);
+
+private:
+	struct Sample {
+		double x, y;
+		Clock::time_point time;
+	};
+	// The samples of the last VELOCITY_WINDOW (and at least the last two).
+	std::deque<Sample> m_samples;
+	// The last prediction that hasn't been compared to the actual position yet.
+	std::optional<Sample> m_prediction;
+};
+
+#endif  // INK_PREDICTOR_H
@@ -0,0 +1,111 @@
+#include "input-recording.h"
+
+#include <QFile>
+
+const QByteArray INPUT_RECORDING_MAGIC = "sauklaue input recording\n";
+const qint32 INPUT_RECORDING_VERSION = 3;
+
+InputRecorder::InputRecorder(const QString& file_name, QSize widget_size, int page_index, const RecordedTools& tools) :
+    m_file(file_name) {
+	m_ok = m_file.open(QSaveFile::WriteOnly);
+	if (!m_ok)
+		return;
+	m_stream.setDevice(&m_file);
+	m_stream.writeRawData(INPUT_RECORDING_MAGIC.data(), INPUT_RECORDING_MAGIC.size());
+	m_stream << INPUT_RECORDING_VERSION;
+	m_stream.setVersion(QDataStream::Qt_5_6);
+	m_stream << widget_size << (qint32)page_index;
+	m_stream << tools.pen_color << (qint32)tools.pen_size << tools.erase_strokes;
+	m_timer.start();
+}
+
+void InputRecorder::record(InputEvent event) {
+	if (!m_ok)
+		return;
+	event.time = m_timer.nsecsElapsed() / 1000;
+	m_stream << (quint8)event.type;
+	if (event.type == InputEvent::PageChange)
+		m_stream << (qint32)event.page_index << event.time;
+	else
+		m_stream << (quint8)event.pointer_type << (quint32)event.button << (quint32)event.buttons << event.pos << event.time;
+}
+
+void InputRecorder::record_page_change(int page_index) {
+	InputEvent event{InputEvent::PageChange, InputEvent::Mouse, Qt::NoButton, Qt::NoButton, QPointF()};
+	event.page_index = page_index;
+	record(event);
+}
+
+bool InputRecorder::finish() {
+	if (!m_ok)
+		return false;
+	m_ok = false;
+	return m_stream.status() == QDataStream::Ok && m_file.commit();
+}
+
+bool InputRecording::load(const QString& file_name, QString& error) {
+	QFile file(file_name);
+	if (!file.open(QFile::ReadOnly)) {
+		error = file.errorString();
+		return false;
+	}
+	QDataStream stream(&file);
+	QByteArray magic(INPUT_RECORDING_MAGIC.size(), 0);
+	qint32 version;
+	if (stream.readRawData(magic.data(), magic.size()) != magic.size() || magic != INPUT_RECORDING_MAGIC) {
+		error = "Not an input recording";
+		return false;
+	}
+	stream >> version;
+	if (version < 1 || version > INPUT_RECORDING_VERSION) {
+		error = QString("Unsupported version %1").arg(version);
+		return false;
+	}
+	stream.setVersion(QDataStream::Qt_5_6);
+	qint32 page;
+	stream >> widget_size >> page;
+	page_index = page;
+	tools = RecordedTools();
+	if (version >= 2) {
+		qint32 pen_size;
+		stream >> tools.pen_color >> pen_size >> tools.erase_strokes;
+		tools.pen_size = pen_size;
+		if (stream.status() == QDataStream::Ok && pen_size <= 0) {
+			error = "Invalid pen size";
+			return false;
+		}
+	}
+	events.clear();
+	while (!stream.atEnd() && stream.status() == QDataStream::Ok) {
+		quint8 type, pointer_type;
+		quint32 button, buttons;
+		InputEvent event;
+		stream >> type;
+		if (type == InputEvent::PageChange && version >= 3) {
+			qint32 page;
+			stream >> page >> event.time;
+			event.type = InputEvent::PageChange;
+			event.pointer_type = InputEvent::Mouse;
+			event.button = Qt::NoButton;
+			event.buttons = Qt::NoButton;
+			event.page_index = page;
+			events.push_back(event);
+			continue;
+		}
+		stream >> pointer_type >> button >> buttons >> event.pos >> event.time;
+		if (type > InputEvent::Release || pointer_type > InputEvent::Eraser) {
+			error = "Invalid event";
+			return false;
+		}
+		event.type = (InputEvent::Type)type;
+		event.pointer_type = (InputEvent::PointerType)pointer_type;
+		event.button = (Qt::MouseButton)button;
+		event.buttons = Qt::MouseButtons((int)buttons);
+		events.push_back(event);
+	}
+	if (stream.status() != QDataStream::Ok) {
+		error = "Unexpected end of file";
+		return false;
+	}
+	return true;
+}
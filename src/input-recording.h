@@ -0,0 +1,79 @@
+#ifndef INPUT_RECORDING_H
+#define INPUT_RECORDING_H
+
+#include <vector>
+
+#include <QColor>
+#include <QPointF>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QSize>
+
+// A pen or mouse event as seen by the PageWidget, or a change of the page shown by the widget.
+struct InputEvent {
+	enum Type : quint8 {
+		Press,
+		Move,
+		Release,
+		PageChange  // Only in recordings (version 3 and later), never passed to PageWidget::handle_input
+	};
+	enum PointerType : quint8 {
+		Mouse,
+		Pen,
+		Eraser  // The eraser end of a tablet pen
+	};
+	Type type;
+	PointerType pointer_type;
+	Qt::MouseButton button;  // The button that caused a press or release event
+	Qt::MouseButtons buttons;  // The buttons that are held down after the event
+	QPointF pos;  // In widget coordinates
+	qint64 time = 0;  // In microseconds since the start of the recording
+	int page_index = -1;  // The new page of a PageChange event (-1 if the widget shows no page)
+};
+
+// The tools selected when a recording started (see ToolState).
+struct RecordedTools {
+	QColor pen_color = Qt::black;
+	int pen_size = 1000;
+	bool erase_strokes = false;
+};
+
+// A sequence of input events received by one PageWidget, together with the state of the widget when the recording started.
+// Replaying the events on a widget of the same size showing the same page of the same document with the same tools reproduces the same strokes.
+struct InputRecording {
+	QSize widget_size;
+	int page_index = 0;  // When the recording started. Later changes are PageChange events.
+	RecordedTools tools;  // Recordings of version 1 don't contain the tools. They get the defaults.
+	std::vector<InputEvent> events;
+
+	// Returns false and sets the error message if the file cannot be read.
+	bool load(const QString& file_name, QString& error);
+};
+
+// Writes input events to a file as they arrive.
+class InputRecorder {
+public:
+	// Starts a recording. Check ok() afterwards.
+	InputRecorder(const QString& file_name, QSize widget_size, int page_index, const RecordedTools& tools);
+	bool ok() const {
+		return m_ok;
+	}
+	QString errorString() const {
+		return m_file.errorString();
+	}
+	// The time stamp is set by the recorder.
+	void record(InputEvent event);
+	// Records that the widget now shows another page.
+	void record_page_change(int page_index);
+	// Writes the file. Returns false on failure.
+	bool finish();
+
+private:
+	QSaveFile m_file;
+	QDataStream m_stream;
+	QElapsedTimer m_timer;
+	bool m_ok;
+};
+
+#endif  // INPUT_RECORDING_H
@@ -0,0 +1,111 @@
+#include "latency-monitor.h"
+
+#include "settings.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <QTimer>
+
+void LatencyHistogram::add(Duration duration) {
+	double ms = std::chrono::duration<double, std::milli>(duration).count();
+	int bucket = std::clamp((int)std::floor(ms * BUCKETS_PER_MILLISECOND), 0, NUMBER_OF_BUCKETS - 1);
+	m_buckets[bucket]++;
+	m_count++;
+	m_max = std::max(m_max, ms);
+}
+
+void LatencyHistogram::clear() {
+	std::fill(m_buckets.begin(), m_buckets.end(), 0);
+	m_count = 0;
+	m_max = 0;
+}
+
+double LatencyHistogram::percentile(double fraction) const {
+	if (m_count == 0)
+		return 0;
+	size_t rank = std::max<size_t>(1, std::ceil(fraction * m_count));
+	size_t seen = 0;
+	for (int bucket = 0; bucket < NUMBER_OF_BUCKETS - 1; bucket++) {
+		seen += m_buckets[bucket];
+		if (seen >= rank)  // Report the upper end of the bucket (but not more than the maximum).
+			return std::min(m_max, (double)(bucket + 1) / BUCKETS_PER_MILLISECOND);
+	}
+	return m_max;
+}
+
+QString LatencyHistogram::summary() const {
+	if (m_count == 0)
+		return "no samples";
+	return QString("p50 %1 ms, p95 %2 ms, p99 %3 ms, max %4 ms (%5 samples)")
+	        .arg(percentile(0.5), 0, 'f', 1)
+	        .arg(percentile(0.95), 0, 'f', 1)
+	        .arg(percentile(0.99), 0, 'f', 1)
+	        .arg(max(), 0, 'f', 1)
+	        .arg(m_count);
+}
+
+LatencyMonitor* latency_monitor_singleton = nullptr;
+
+LatencyMonitor* LatencyMonitor::self() {
+	if (!latency_monitor_singleton)
+		latency_monitor_singleton = new LatencyMonitor;
+	return latency_monitor_singleton;
+}
+
+LatencyMonitor::LatencyMonitor() {
+	m_overlay_timer = new QTimer(this);
+	m_overlay_timer->setInterval(500);
+	connect(m_overlay_timer, &QTimer::timeout, this, &LatencyMonitor::overlay_changed);
+}
+
+void LatencyMonitor::record_input(Clock::duration input_to_paint) {
+	m_input_to_paint.add(input_to_paint);
+}
+
+void LatencyMonitor::record_frame(Clock::duration paint_duration, std::optional<Clock::duration> frame_interval) {
+	m_paint_duration.add(paint_duration);
+	if (frame_interval)
+		m_frame_interval.add(*frame_interval);
+}
+
+void LatencyMonitor::record_prediction_error(double pixels) {
+	m_prediction_count++;
+	m_prediction_error_sum += pixels;
+	m_prediction_error_max = std::max(m_prediction_error_max, pixels);
+}
+
+void LatencyMonitor::reset() {
+	m_input_to_paint.clear();
+	m_paint_duration.clear();
+	m_frame_interval.clear();
+	m_prediction_count = 0;
+	m_prediction_error_sum = 0;
+	m_prediction_error_max = 0;
+	emit overlay_changed();
+}
+
+QStringList LatencyMonitor::summary() const {
+	QString prediction = "off";
+	if (int horizon = Settings::self()->predictionHorizon()) {
+		prediction = QString("%1 ms ahead, ").arg(horizon);
+		if (m_prediction_count == 0)
+			prediction += "no samples";
+		else
+			prediction += QString("error mean %1 px, max %2 px (%3 samples)").arg(m_prediction_error_sum / m_prediction_count, 0, 'f', 1).arg(m_prediction_error_max, 0, 'f', 1).arg(m_prediction_count);
+	}
+	return {
+	        "Input to paint: " + m_input_to_paint.summary(),
+	        "Frame interval: " + m_frame_interval.summary(),
+	        "Paint duration: " + m_paint_duration.summary(),
+	        "Predicted ink: " + prediction};
+}
+
+void LatencyMonitor::setOverlayVisible(bool visible) {
+	m_overlay_visible = visible;
+	if (visible)
+		m_overlay_timer->start();
+	else
+		m_overlay_timer->stop();
+	emit overlay_changed();
+}
@@ -0,0 +1,98 @@
+#ifndef LATENCY_MONITOR_H
+#define LATENCY_MONITOR_H
+
+#include <chrono>
+#include <optional>
+#include <vector>
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+
+class QTimer;
+
+// A histogram of durations with a resolution of 0.1 milliseconds.
+class LatencyHistogram {
+public:
+	using Duration = std::chrono::steady_clock::duration;
+
+	void add(Duration duration);
+	void clear();
+	size_t count() const {
+		return m_count;
+	}
+	// The duration (in milliseconds) that the given fraction of all samples doesn't exceed.
+	double percentile(double fraction) const;
+	// The longest duration (in milliseconds).
+	double max() const {
+		return m_max;
+	}
+	// Percentiles p50, p95, p99 and the maximum.
+	QString summary() const;
+
+private:
+	static const int BUCKETS_PER_MILLISECOND = 10;
+	// Durations of one second or longer all go into the last bucket.
+	static const int NUMBER_OF_BUCKETS = 1000 * BUCKETS_PER_MILLISECOND + 1;
+	std::vector<size_t> m_buckets = std::vector<size_t>(NUMBER_OF_BUCKETS);
+	size_t m_count = 0;
+	double m_max = 0;
+};
+
+// Collects statistics about how long it takes until the effect of an input event (tablet or mouse) is painted.
+// The latency is measured from the moment the event reaches the page widget until the end of the paintEvent that shows its ink.
+// (The time the compositor and the screen need after that is not included.)
+class LatencyMonitor : public QObject {
+	Q_OBJECT
+public:
+	using Clock = std::chrono::steady_clock;
+
+	static LatencyMonitor* self();
+
+private:
+	LatencyMonitor();
+
+public:
+	void record_input(Clock::duration input_to_paint);
+	// Records a paintEvent that painted new ink. The interval to the previous such paintEvent is only given while drawing continuously.
+	void record_frame(Clock::duration paint_duration, std::optional<Clock::duration> frame_interval);
+	// Records the distance (in pixels) between a predicted pen position (see InkPredictor) and the actual one.
+	void record_prediction_error(double pixels);
+
+	const LatencyHistogram& input_to_paint() const {
+		return m_input_to_paint;
+	}
+	const LatencyHistogram& paint_duration() const {
+		return m_paint_duration;
+	}
+	const LatencyHistogram& frame_interval() const {
+		return m_frame_interval;
+	}
+	void reset();
+
+	// One line per histogram.
+	QStringList summary() const;
+
+public:
+	// Whether the statistics should be shown on top of the pages.
+	bool overlayVisible() const {
+		return m_overlay_visible;
+	}
+	void setOverlayVisible(bool visible);
+signals:
+	// Notification that the overlay needs to be re-drawn. This is emitted periodically while the overlay is visible.
+	void overlay_changed();
+
+private:
+	LatencyHistogram m_input_to_paint;
+	LatencyHistogram m_paint_duration;
+	LatencyHistogram m_frame_interval;
+	size_t m_prediction_count = 0;
+	double m_prediction_error_sum = 0;
+	double m_prediction_error_max = 0;
+
+	bool m_overlay_visible = false;
+	QTimer* m_overlay_timer;
+};
+
+#endif  // LATENCY_MONITOR_H
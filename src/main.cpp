@@ -4,13 +4,25 @@
 #include "settings.h"
 #include "renderer.h"
 #include "document.h"
+#include "generator.h"
+#include "trace.h"
+#include "latency-monitor.h"
+#include "input-recording.h"
+#include "pagewidget.h"
+#include "tool-state.h"
+#include "memory-stats.h"
+#include "compactor.h"
 
 #include <iostream>
 
 #include <QApplication>
 #include <QCommandLineParser>
+#include <QDebug>
+#include <QElapsedTimer>
 #include <QFileInfo>
+#include <QPaintEvent>
 #include <QSaveFile>
+#include <QThread>
 
 std::unique_ptr<Document> read_document(QString infile) {
 	QFile file(infile);
@@ -44,7 +56,12 @@ int gui_command(int argc, char** argv) {
 	w.show();
 	if (files.size() == 1)
 		w.loadFile(files[0]);
-	return app.exec();
+	int res = app.exec();
+	if (LatencyMonitor::self()->input_to_paint().count() > 0) {
+		for (const QString& line : LatencyMonitor::self()->summary())
+			qDebug().noquote() << line;
+	}
+	return res;
 }
 
 int export_command(int argc, char** argv) {
@@ -55,6 +72,8 @@ int export_command(int argc, char** argv) {
 	parser.addHelpOption();
 	parser.addPositionalArgument("source", "Input (sau) file");
 	parser.addPositionalArgument("destination", "Output (pdf) file", "[destination]");
+	QCommandLineOption eraserGroupsOption("eraser-groups", "Erase by drawing the layers below again (inside transparency groups) instead of clipping the pen strokes");
+	parser.addOption(eraserGroupsOption);
 	parser.process(app);
 	QStringList files = parser.positionalArguments();
 	if (files.size() != 1 && files.size() != 2)
@@ -73,7 +92,7 @@ int export_command(int argc, char** argv) {
 	}
 	qDebug() << "Exporting" << infile << "to" << outfile;
 	std::unique_ptr<Document> doc = read_document(infile);
-	PDFExporter::save(doc.get(), outfile.toStdString());
+	PDFExporter::save(doc.get(), outfile.toStdString(), parser.isSet(eraserGroupsOption) ? PDFExporter::EraserMode::Groups : PDFExporter::EraserMode::Clip);
 	return 0;
 }
 
@@ -149,9 +168,245 @@ int save_command(int argc, char** argv) {
 	return 0;
 }
 
+int compact_command(int argc, char** argv) {
+	QCoreApplication app(argc, argv);
+	Settings::self()->load();
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Remove erased ink: Pen strokes that are covered by eraser strokes are removed or cut into their visible pieces, and eraser strokes that no longer erase anything are removed. The document looks the same afterwards.");
+	parser.addHelpOption();
+	parser.addPositionalArgument("source", "Input (sau) file");
+	parser.addPositionalArgument("destination", "Output (sau) file (by default, the input file is overwritten)", "[destination]");
+	parser.process(app);
+	QStringList files = parser.positionalArguments();
+	if (files.size() != 1 && files.size() != 2)
+		parser.showHelp(1);
+	QString infile = files[0];
+	QString outfile = files.size() == 2 ? files[1] : infile;
+	std::unique_ptr<Document> doc = read_document(infile);
+	qint64 size_before = Serializer::saved_size(doc.get());
+	// Check that the document looks the same afterwards.
+	Compactor::Stats stats = Compactor::compact(doc.get(), Compactor::check_size());
+	qint64 size_after = Serializer::saved_size(doc.get());
+	for (const QString& line : stats.report())
+		std::cout << line.toStdString() << "\n";
+	std::cout << "File size: " << size_before << " -> " << size_after << " bytes\n";
+	if (stats.different_pixels) {
+		std::cerr << "Error: Compacting changed " << stats.different_pixels << " pixels. The file was not written." << std::endl;
+		return 1;
+	}
+	QSaveFile file(outfile);
+	if (!file.open(QSaveFile::WriteOnly)) {
+		std::cerr << "Cannot open file " << outfile.toStdString() << " for writing: " << file.errorString().toStdString() << std::endl;
+		return 1;
+	}
+	QDataStream out(&file);
+	Serializer::save(doc.get(), out);
+	if (!file.commit()) {
+		std::cerr << "Cannot write file " << outfile.toStdString() << ": " << file.errorString().toStdString() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int generate_command(int argc, char** argv) {
+	QCoreApplication app(argc, argv);
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Generate a synthetic document with random handwriting. This is useful for benchmarking.");
+	parser.addHelpOption();
+	parser.addPositionalArgument("destination", "Output (sau) file");
+	GeneratorOptions options;
+	QCommandLineOption pagesOption("pages", "Number of pages", "number", QString::number(options.pages));
+	parser.addOption(pagesOption);
+	QCommandLineOption strokesOption("strokes", "Number of strokes per page", "number", QString::number(options.strokes_per_page));
+	parser.addOption(strokesOption);
+	QCommandLineOption pointsOption("points", "Average number of points per stroke", "number", QString::number(options.points_per_stroke));
+	parser.addOption(pointsOption);
+	QCommandLineOption eraserOption("eraser-ratio", "Fraction of eraser strokes (between 0 and 1)", "ratio", QString::number(options.eraser_ratio));
+	parser.addOption(eraserOption);
+	QCommandLineOption colorsOption("colors", "Comma-separated list of pen colors (the first one is the most common)", "colors", "#000000");
+	parser.addOption(colorsOption);
+	QCommandLineOption widthsOption("widths", "Comma-separated list of pen widths (the first one is the most common)", "widths", "1000");
+	parser.addOption(widthsOption);
+	QCommandLineOption pdfOption("pdf", "Embed a generated PDF file as the background of the pages");
+	parser.addOption(pdfOption);
+	QCommandLineOption seedOption("seed", "Random seed", "number", QString::number(options.seed));
+	parser.addOption(seedOption);
+	parser.process(app);
+	QStringList files = parser.positionalArguments();
+	if (files.size() != 1)
+		parser.showHelp(1);
+	bool ok_pages, ok_strokes, ok_points, ok_eraser, ok_seed;
+	options.pages = parser.value(pagesOption).toInt(&ok_pages);
+	options.strokes_per_page = parser.value(strokesOption).toInt(&ok_strokes);
+	options.points_per_stroke = parser.value(pointsOption).toInt(&ok_points);
+	options.eraser_ratio = parser.value(eraserOption).toDouble(&ok_eraser);
+	options.seed = parser.value(seedOption).toUInt(&ok_seed);
+	if (!ok_pages || !ok_strokes || !ok_points || !ok_eraser || !ok_seed || options.pages < 0 || options.strokes_per_page < 0 || options.points_per_stroke < 1 || options.eraser_ratio < 0 || options.eraser_ratio > 1) {
+		std::cerr << "Error: Invalid number" << std::endl;
+		return 1;
+	}
+	options.colors.clear();
+	for (const QString& name : parser.value(colorsOption).split(',', QString::SkipEmptyParts)) {
+		QColor color(name.trimmed());
+		if (!color.isValid()) {
+			std::cerr << "Error: Invalid color " << name.toStdString() << std::endl;
+			return 1;
+		}
+		options.colors.push_back(color);
+	}
+	options.widths.clear();
+	for (const QString& name : parser.value(widthsOption).split(',', QString::SkipEmptyParts)) {
+		bool ok;
+		int width = name.trimmed().toInt(&ok);
+		if (!ok || width <= 0) {
+			std::cerr << "Error: Invalid width " << name.toStdString() << std::endl;
+			return 1;
+		}
+		options.widths.push_back(width);
+	}
+	if (options.colors.empty() || options.widths.empty()) {
+		std::cerr << "Error: At least one color and one width are required" << std::endl;
+		return 1;
+	}
+	options.embed_pdf = parser.isSet(pdfOption);
+	QString outfile = files[0];
+	qDebug() << "Generating" << outfile;
+	std::unique_ptr<Document> doc = generate_document(options);
+	QSaveFile file(outfile);
+	if (!file.open(QSaveFile::WriteOnly)) {
+		std::cerr << "Cannot open file " << outfile.toStdString() << " for writing: " << file.errorString().toStdString() << std::endl;
+		return 1;
+	}
+	QDataStream out(&file);
+	Serializer::save(doc.get(), out);
+	if (!file.commit()) {
+		std::cerr << "Cannot write file " << outfile.toStdString() << ": " << file.errorString().toStdString() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int stats_command(int argc, char** argv) {
+	QCoreApplication app(argc, argv);
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Show how much memory a document uses once it is loaded");
+	parser.addHelpOption();
+	parser.addPositionalArgument("source", "Input (sau) file");
+	parser.process(app);
+	QStringList files = parser.positionalArguments();
+	if (files.size() != 1)
+		parser.showHelp(1);
+	std::unique_ptr<Document> doc = read_document(files[0]);
+	MemoryStats stats;
+	stats.account_document(doc.get());
+	for (const QString& line : stats.report())
+		std::cout << line.toStdString() << "\n";
+	return 0;
+}
+
+// Adds up the area of all paint events of a widget.
+class PaintAreaCounter : public QObject {
+public:
+	bool eventFilter(QObject*, QEvent* event) override {
+		if (event->type() == QEvent::Paint) {
+			for (const QRect& rect : static_cast<QPaintEvent*>(event)->region())
+				area += (qint64)rect.width() * rect.height();
+		}
+		return false;
+	}
+	qint64 area = 0;
+};
+
+int replay_command(int argc, char** argv) {
+	// Don't show any windows unless another platform was explicitly requested.
+	if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+		qputenv("QT_QPA_PLATFORM", "offscreen");
+	QApplication app(argc, argv);
+	Settings::self()->load();
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Replay recorded input events (Debug > Record Input in the GUI) on a document and measure how long it takes to process them. The document is not modified.");
+	parser.addHelpOption();
+	parser.addPositionalArgument("document", "Input (sau) file");
+	parser.addPositionalArgument("recording", "Recorded input events");
+	QCommandLineOption maxSpeedOption("max-speed", "Replay the events as fast as possible instead of at the recorded speed");
+	parser.addOption(maxSpeedOption);
+	parser.process(app);
+	QStringList files = parser.positionalArguments();
+	if (files.size() != 2)
+		parser.showHelp(1);
+	std::unique_ptr<Document> doc = read_document(files[0]);
+	InputRecording recording;
+	QString error;
+	if (!recording.load(files[1], error)) {
+		std::cerr << "Error: Cannot read recording " << files[1].toStdString() << ": " << error.toStdString() << std::endl;
+		return 1;
+	}
+	if (recording.page_index < 0 || recording.page_index >= (int)doc->pages().size()) {
+		std::cerr << "Error: The recording was made on page " << recording.page_index + 1 << ", but the document only has " << doc->pages().size() << " pages" << std::endl;
+		return 1;
+	}
+	ToolState tool_state;
+	tool_state.setPenColor(recording.tools.pen_color);
+	tool_state.setPenSize(recording.tools.pen_size);
+	tool_state.setEraseStrokes(recording.tools.erase_strokes);
+	PageWidget widget(&tool_state);
+	widget.resize(recording.widget_size);
+	widget.setPage(doc->pages()[recording.page_index]);
+	widget.show();
+	QCoreApplication::processEvents();  // Initial paint
+	PaintAreaCounter paint_area;
+	widget.installEventFilter(&paint_area);
+	LatencyMonitor::self()->reset();
+	LatencyHistogram event_cost;
+	bool max_speed = parser.isSet(maxSpeedOption);
+	// Like the GUI, draw the collected pen positions once per frame (here: at 60 Hz in recording time), so that the replay is deterministic.
+	const qint64 FRAME_INTERVAL = 1000000 / 60;
+	qint64 next_frame = FRAME_INTERVAL;
+	QElapsedTimer timer;
+	timer.start();
+	for (const InputEvent& event : recording.events) {
+		if (!max_speed) {
+			qint64 wait = event.time - timer.nsecsElapsed() / 1000;
+			if (wait > 0)
+				QThread::usleep(wait);
+		}
+		LatencyMonitor::Clock::time_point start = LatencyMonitor::Clock::now();
+		if (event.time >= next_frame) {
+			widget.flush_input();
+			next_frame = (event.time / FRAME_INTERVAL + 1) * FRAME_INTERVAL;
+		}
+		if (event.type == InputEvent::PageChange) {
+			if (event.page_index >= (int)doc->pages().size()) {
+				std::cerr << "Error: The recording switches to page " << event.page_index + 1 << ", but the document only has " << doc->pages().size() << " pages" << std::endl;
+				return 1;
+			}
+			widget.setPage(event.page_index >= 0 ? doc->pages()[event.page_index] : nullptr);
+		} else {
+			widget.handle_input(event);
+		}
+		QCoreApplication::processEvents();  // Paint
+		event_cost.add(LatencyMonitor::Clock::now() - start);
+	}
+	widget.flush_input();
+	QCoreApplication::processEvents();
+	double total = timer.nsecsElapsed() / 1e6;
+	size_t n = recording.events.size();
+	std::cout << "Events: " << n << "\n"
+	          << "Total time: " << total << " ms\n"
+	          << "Cost per event: " << event_cost.summary().toStdString() << "\n"
+	          << "Repainted area: " << paint_area.area << " px (" << (n ? paint_area.area / n : 0) << " px per event)\n";
+	for (const QString& line : LatencyMonitor::self()->summary())
+		std::cout << line.toStdString() << "\n";
+	return 0;
+}
+
 int main(int argc, char** argv) {
 	QCoreApplication::setApplicationName("sauklaue");
 	QCoreApplication::setOrganizationName("sauklaue");
+	// Record a performance trace of the whole run.
+	QString trace_file = qEnvironmentVariable("SAUKLAUE_TRACE");
+	if (!trace_file.isEmpty())
+		Trace::start(trace_file);
 	int res;
 	if (argc >= 2) {
 		// Remove argv[1].
@@ -169,18 +424,31 @@ int main(int argc, char** argv) {
 		} */
 		else if (!strcmp(argv[1], "save")) {
 			res = save_command(argcs, argvs);
+		} else if (!strcmp(argv[1], "generate")) {
+			res = generate_command(argcs, argvs);
+		} else if (!strcmp(argv[1], "replay")) {
+			res = replay_command(argcs, argvs);
+		} else if (!strcmp(argv[1], "stats")) {
+			res = stats_command(argcs, argvs);
+		} else if (!strcmp(argv[1], "compact")) {
+			res = compact_command(argcs, argvs);
 		} else {
 			std::cerr << "Available commands:\n"
 			          << "    " << argv[0] << " gui\n"
 			          << "    " << argv[0] << " export\n"
 			          // 				<< "    " << argv[0] << " concatenate\n"
-			          << "    " << argv[0] << " save\n";
+			          << "    " << argv[0] << " save\n"
+			          << "    " << argv[0] << " generate\n"
+			          << "    " << argv[0] << " replay\n"
+			          << "    " << argv[0] << " stats\n"
+			          << "    " << argv[0] << " compact\n";
 			res = 1;
 		}
 		delete[] argvs;
 	} else {
 		res = gui_command(argc, argv);
 	}
+	Trace::stop();
 
 	return res;
 }
@@ -11,6 +11,16 @@
 #include "document.h"
 #include "renderer.h"
 #include "tool-state.h"
+#include "trace.h"
+#include "latency-monitor.h"
+#include "input-recording.h"
+#include "memory-stats.h"
+#include "raw-pen-capture.h"
+#include "page-overview.h"
+#include "thumbnail-cache.h"
+#include "raster-cache.h"
+#include "undo-spill.h"
+#include "compactor.h"
 
 #include <QHBoxLayout>
 #include <QStatusBar>
@@ -24,11 +34,19 @@
 #include <QToolBar>
 #include <QAction>
 #include <QDebug>
+#include <QDialog>
+#include <QLocale>
+#include <QDialogButtonBox>
+#include <QDockWidget>
+#include <QPushButton>
+#include <QUndoStack>
+#include <QUndoView>
+#include <QVBoxLayout>
 #include <QSaveFile>
-#include <QElapsedTimer>
 #include <QScreen>
 #include <QSessionManager>
 #include <QSpinBox>
+#include <QStandardPaths>
 #include <QLabel>
 #include <QPainter>
 #include <QInputDialog>
@@ -143,6 +161,83 @@ private:
 	double m_size;
 };
 
+// Loads the commands that are undone or redone when the stack goes to the given index (see load_spilled_commands), and shows a warning about the commands that are dropped because their data cannot be read.
+static void load_spilled_commands(QWidget* parent, const QUndoStack* stack, int index) {
+	QString error;
+	if (!load_spilled_commands(stack, index, error))
+		QMessageBox::warning(parent, MainWindow::tr("Application"), MainWindow::tr("Cannot read the undo history. The affected steps are removed from it:\n%1").arg(error));
+}
+
+// Jumping to an entry undoes or redoes all commands in between (QUndoStack::setIndex). This happens in one ChangeTransaction, so that the views are updated only once.
+class UndoHistoryView : public QUndoView {
+public:
+	using QUndoView::QUndoView;
+
+protected:
+	void mousePressEvent(QMouseEvent* event) override {
+		load_clicked_commands(event);
+		ChangeTransaction transaction;
+		QUndoView::mousePressEvent(event);
+	}
+	void mouseMoveEvent(QMouseEvent* event) override {
+		load_clicked_commands(event);
+		ChangeTransaction transaction;
+		QUndoView::mouseMoveEvent(event);
+	}
+	void keyPressEvent(QKeyEvent* event) override {
+		ChangeTransaction transaction;
+		QUndoView::keyPressEvent(event);
+	}
+	// Called by keyPressEvent to find the entry that becomes current.
+	QModelIndex moveCursor(CursorAction action, Qt::KeyboardModifiers modifiers) override {
+		QModelIndex index = QUndoView::moveCursor(action, modifiers);
+		// Row 0 is the empty state, so the row is the index of the stack.
+		if (index.isValid())
+			load_spilled_commands(this, stack(), index.row());
+		return index;
+	}
+
+private:
+	void load_clicked_commands(QMouseEvent* event) {
+		if (event->buttons() == Qt::NoButton)
+			return;  // Hovering doesn't select anything.
+		QModelIndex index = indexAt(event->pos());
+		if (index.isValid())
+			load_spilled_commands(this, stack(), index.row());
+	}
+};
+
+// Like QUndoStack::createUndoAction and QUndoStack::createRedoAction, but the command is undone or redone in one ChangeTransaction, so that the views are updated only once even for macros (such as all strokes deleted by one stroke of the stroke eraser).
+static QAction* create_undo_action(QUndoStack* stack, bool redo, QObject* parent) {
+	QString prefix = redo ? MainWindow::tr("&Redo") : MainWindow::tr("&Undo");
+	QAction* action = new QAction(prefix, parent);
+	auto update_text = [action, prefix](const QString& text) {
+		action->setText(text.isEmpty() ? prefix : QString("%1 %2").arg(prefix, text));
+	};
+	if (redo) {
+		action->setEnabled(stack->canRedo());
+		update_text(stack->redoText());
+		QObject::connect(stack, &QUndoStack::canRedoChanged, action, &QAction::setEnabled);
+		QObject::connect(stack, &QUndoStack::redoTextChanged, action, update_text);
+	} else {
+		action->setEnabled(stack->canUndo());
+		update_text(stack->undoText());
+		QObject::connect(stack, &QUndoStack::canUndoChanged, action, &QAction::setEnabled);
+		QObject::connect(stack, &QUndoStack::undoTextChanged, action, update_text);
+	}
+	QObject::connect(action, &QAction::triggered, stack, [stack, redo, parent]() {
+		if ((redo && !stack->canRedo()) || (!redo && !stack->canUndo()))
+			return;
+		load_spilled_commands(qobject_cast<QWidget*>(parent), stack, stack->index() + (redo ? 1 : -1));
+		ChangeTransaction transaction;
+		if (redo)
+			stack->redo();
+		else
+			stack->undo();
+	});
+	return action;
+}
+
 MainWindow::MainWindow(QWidget* parent) :
     QMainWindow(parent),
     m_tool_state(new ToolState(this)) {
@@ -158,12 +253,27 @@ MainWindow::MainWindow(QWidget* parent) :
 		layout->addWidget(pagewidgets[i]);
 	}
 
+	m_page_overview = new PageOverview();
+	connect(m_page_overview, &PageOverview::pageActivated, this, &MainWindow::gotoPage);
+	pageOverviewDock = new QDockWidget(tr("Page Overview"), this);
+	pageOverviewDock->setObjectName("pageOverview");
+	pageOverviewDock->setWidget(m_page_overview);
+	addDockWidget(Qt::LeftDockWidgetArea, pageOverviewDock);
+	pageOverviewDock->hide();
+
+	undoHistoryDock = new QDockWidget(tr("Undo History"), this);
+	undoHistoryDock->setObjectName("undoHistory");
+	undoHistoryDock->setWidget(new UndoHistoryView(m_tool_state->undoStack()));
+	addDockWidget(Qt::RightDockWidgetArea, undoHistoryDock);
+	undoHistoryDock->hide();
+
 	createActions();
 	statusBar()->show();
 	setUnifiedTitleAndToolBarOnMac(true);
 	readGeometrySettings();
 
 	connect(m_tool_state->undoStack(), &QUndoStack::cleanChanged, this, &MainWindow::documentWasModified);
+	connect(ChangeNotifier::self(), &ChangeNotifier::finished, this, &MainWindow::finishChanges);
 
 	setDocument(std::make_unique<Document>());
 	setCurrentFile(QString());
@@ -177,6 +287,24 @@ MainWindow::MainWindow(QWidget* parent) :
 		autoSaveTimer->start(std::min(autoSaveTimer->remainingTime(), std::max(1, Settings::self()->autoSaveInterval()) * 1000));
 	});
 
+	RawPenCapture::self()->update_from_settings();
+
+	auto configureRasterCache = []() {
+		RasterCache::self()->configure(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/sauklaue", (qint64)Settings::self()->rasterCacheSize() * 1024 * 1024);
+	};
+	configureRasterCache();
+	connect(Settings::self(), &Settings::configChanged, this, configureRasterCache);
+
+	// Once the user pauses, move old undo history beyond the budget to disk.
+	QTimer* undoSpillTimer = new QTimer(this);
+	undoSpillTimer->setSingleShot(true);
+	undoSpillTimer->setInterval(2000);
+	connect(undoSpillTimer, &QTimer::timeout, this, [this]() {
+		if (Settings::self()->undoMemoryBudget() > 0)
+			spill_undo_history(m_tool_state->undoStack(), (size_t)Settings::self()->undoMemoryBudget() * 1024 * 1024);
+	});
+	connect(m_tool_state->undoStack(), &QUndoStack::indexChanged, undoSpillTimer, qOverload<>(&QTimer::start));
+
 	QGuiApplication::setFallbackSessionManagementEnabled(false);
 	connect(qApp, &QGuiApplication::commitDataRequest, this, &MainWindow::commitData);
 }
@@ -249,18 +377,25 @@ void MainWindow::createActions() {
 	}
 	QMenu* editMenu = menuBar()->addMenu(tr("&Edit"));
 	{
-		QAction* action = m_tool_state->undoStack()->createUndoAction(this, tr("&Undo"));
+		QAction* action = create_undo_action(m_tool_state->undoStack(), false, this);
 		action->setIcon(QIcon::fromTheme("edit-undo"));
 		action->setShortcuts(QKeySequence::Undo);
 		editMenu->addAction(action);
 	}
 	{
-		QAction* action = m_tool_state->undoStack()->createRedoAction(this, tr("&Redo"));
+		QAction* action = create_undo_action(m_tool_state->undoStack(), true, this);
 		action->setIcon(QIcon::fromTheme("edit-redo"));
 		action->setShortcuts(QKeySequence::Redo);
 		editMenu->addAction(action);
 	}
 	editMenu->addSeparator();
+	{
+		QAction* action = new QAction(tr("&Compact Document"));
+		action->setStatusTip(tr("Remove erased ink from all pages, which makes the file smaller and drawing faster"));
+		connect(action, &QAction::triggered, this, &MainWindow::compactDocument);
+		editMenu->addAction(action);
+	}
+	editMenu->addSeparator();
 	{
 		QAction* action = new QAction(QIcon::fromTheme("configure"), tr("&Preferences"));
 		connect(action, &QAction::triggered, this, &MainWindow::showSettings);
@@ -406,6 +541,54 @@ void MainWindow::createActions() {
 		viewsMenu->addAction(action);
 		otherViewAction = action;
 	}
+	{
+		QAction* action = pageOverviewDock->toggleViewAction();
+		action->setIcon(QIcon::fromTheme("view-preview"));
+		action->setStatusTip(tr("Show thumbnails of all pages"));
+		viewsMenu->addAction(action);
+	}
+	{
+		QAction* action = undoHistoryDock->toggleViewAction();
+		action->setIcon(QIcon::fromTheme("view-history"));
+		action->setStatusTip(tr("Show the list of changes, to go back to any earlier state"));
+		viewsMenu->addAction(action);
+	}
+	QMenu* debugMenu = menuBar()->addMenu(tr("&Debug"));
+	{
+		QAction* action = new QAction(QIcon::fromTheme("media-record"), tr("&Record Performance Trace"), this);
+		action->setCheckable(true);
+		action->setChecked(Trace::enabled());
+		action->setStatusTip(tr("Record where time is spent and write it to a trace file (Chrome trace format)"));
+		connect(action, &QAction::triggered, this, &MainWindow::recordTrace);
+		debugMenu->addAction(action);
+		recordTraceAction = action;
+	}
+	{
+		QAction* action = new QAction(QIcon::fromTheme("media-record"), tr("Record &Input"), this);
+		action->setCheckable(true);
+		action->setStatusTip(tr("Record the pen and mouse input on the focused page, which can later be replayed using 'sauklaue replay'"));
+		connect(action, &QAction::triggered, this, &MainWindow::recordInput);
+		debugMenu->addAction(action);
+		recordInputAction = action;
+	}
+	{
+		QAction* action = new QAction(QIcon::fromTheme("speedometer"), tr("Show &Latency Overlay"), this);
+		action->setCheckable(true);
+		action->setStatusTip(tr("Show how long it takes until new ink is painted"));
+		connect(action, &QAction::triggered, LatencyMonitor::self(), &LatencyMonitor::setOverlayVisible);
+		debugMenu->addAction(action);
+	}
+	{
+		QAction* action = new QAction(QIcon::fromTheme("edit-clear-history"), tr("Reset Latency &Statistics"), this);
+		connect(action, &QAction::triggered, LatencyMonitor::self(), &LatencyMonitor::reset);
+		debugMenu->addAction(action);
+	}
+	{
+		QAction* action = new QAction(QIcon::fromTheme("memory"), tr("&Memory Usage..."), this);
+		action->setStatusTip(tr("Show how much memory the document, the page pictures and the undo history use"));
+		connect(action, &QAction::triggered, this, &MainWindow::showMemoryStats);
+		debugMenu->addAction(action);
+	}
 	for (QToolBar* tb : toolbars)
 		tb->addSeparator();
 	{
@@ -456,6 +639,14 @@ void MainWindow::createActions() {
 		}
 		group->actions()[1]->trigger();
 	}
+	{
+		QAction* action = new QAction(QIcon::fromTheme("draw-eraser"), tr("Erase whole strokes"), this);
+		action->setCheckable(true);
+		action->setStatusTip(tr("Let the eraser delete every stroke it touches instead of erasing parts of strokes"));
+		connect(action, &QAction::triggered, m_tool_state, &ToolState::setEraseStrokes);
+		for (QToolBar* tb : toolbars)
+			tb->addAction(action);
+	}
 	for (QToolBar* tb : toolbars)
 		tb->addSeparator();
 	{
@@ -532,6 +723,7 @@ void MainWindow::documentWasModified() {
 }
 
 void MainWindow::loadFile(const QString& fileName) {
+	TRACE_SCOPE("MainWindow::loadFile");
 	QFile file(fileName);
 	if (!file.open(QFile::ReadOnly)) {
 		QMessageBox::warning(this, tr("Application"), tr("Cannot read file %1:\n%2.").arg(QDir::toNativeSeparators(fileName), file.errorString()));
@@ -570,8 +762,13 @@ void MainWindow::setCurrentFile(const QString& fileName) {
 }
 
 void MainWindow::setDocument(std::unique_ptr<Document> _doc) {
-	if (doc)
+	if (doc) {
 		disconnect(doc.get(), 0, this, 0);
+		// Release the page pictures while their pages still exist, so that they can be stored in the raster cache.
+		for (PageWidget* pagewidget : pagewidgets)
+			pagewidget->setPage(nullptr);
+	}
+	m_page_overview->setDocument(_doc.get());  // Before the old document is deleted
 	doc = std::move(_doc);
 	assert(doc);
 	m_tool_state->undoStack()->clear();
@@ -617,22 +814,20 @@ bool MainWindow::maybeSave() {
 }
 
 bool MainWindow::saveFile(const QString& fileName) {
+	TRACE_SCOPE("MainWindow::saveFile");
 	QSaveFile file(fileName);
 	if (file.open(QFile::WriteOnly)) {
 		SimpleCursorSaver cursor(Qt::WaitCursor);
 		QDataStream out(&file);
-		QElapsedTimer save_timer;
-		save_timer.start();
 		Serializer::save(doc.get(), out);
-		qDebug() << "Serializer::save(doc, out)" << save_timer.elapsed();
-		QElapsedTimer commit_timer;
-		commit_timer.start();
-		if (!file.commit()) {
+		uint64_t commit_start = Trace::now();
+		bool committed = file.commit();
+		Trace::span("QSaveFile::commit", commit_start, Trace::now() - commit_start);
+		if (!committed) {
 			QMessageBox::warning(
 			        this, tr("Application"), tr("Cannot write file %1:\n%2.").arg(QDir::toNativeSeparators(fileName), file.errorString()));
 			return false;
 		}
-		qDebug() << "file.commit()" << commit_timer.elapsed();
 	} else {
 		QMessageBox::warning(
 		        this, tr("Application"), tr("Cannot open file %1 for writing:\n%2.").arg(QDir::toNativeSeparators(fileName), file.errorString()));
@@ -663,10 +858,93 @@ bool MainWindow::saveAs() {
 	return saveFile(dialog.selectedFiles().first());
 }
 
+void MainWindow::recordTrace(bool on) {
+	if (on) {
+		QString fileName = QFileDialog::getSaveFileName(this, tr("Record Performance Trace"), QString(), tr("Chrome trace (*.json)"));
+		if (fileName.isEmpty()) {
+			recordTraceAction->setChecked(false);
+			return;
+		}
+		Trace::start(fileName);
+		statusBar()->showMessage(tr("Recording performance trace"));
+	} else {
+		if (Trace::stop())
+			statusBar()->showMessage(tr("Performance trace written"), 2000);
+		else
+			QMessageBox::warning(this, tr("Application"), tr("Cannot write the performance trace."));
+	}
+}
+
+void MainWindow::recordInput(bool on) {
+	if (on) {
+		if (focused_view == -1) {
+			recordInputAction->setChecked(false);
+			return;
+		}
+		QString fileName = QFileDialog::getSaveFileName(this, tr("Record Input"), QString(), tr("Input recording (*.sauinput)"));
+		if (fileName.isEmpty()) {
+			recordInputAction->setChecked(false);
+			return;
+		}
+		PageWidget* pagewidget = pagewidgets[focused_view];
+		RecordedTools tools{m_tool_state->penColor(), m_tool_state->penSize(), m_tool_state->eraseStrokes()};
+		m_input_recorder = std::make_unique<InputRecorder>(fileName, pagewidget->size(), page_numbers[focused_view], tools);
+		if (!m_input_recorder->ok()) {
+			QMessageBox::warning(this, tr("Application"), tr("Cannot write file %1:\n%2.").arg(QDir::toNativeSeparators(fileName), m_input_recorder->errorString()));
+			m_input_recorder.reset();
+			recordInputAction->setChecked(false);
+			return;
+		}
+		pagewidget->setInputRecorder(m_input_recorder.get());
+		m_recorded_view = focused_view;
+		statusBar()->showMessage(tr("Recording input"));
+	} else {
+		if (!m_input_recorder)
+			return;
+		for (PageWidget* pagewidget : pagewidgets)
+			pagewidget->setInputRecorder(nullptr);
+		if (m_input_recorder->finish())
+			statusBar()->showMessage(tr("Input recording written"), 2000);
+		else
+			QMessageBox::warning(this, tr("Application"), tr("Cannot write the input recording."));
+		m_input_recorder.reset();
+		m_recorded_view = -1;
+	}
+}
+
+void MainWindow::showMemoryStats() {
+	QDialog* dialog = new QDialog(this);
+	dialog->setAttribute(Qt::WA_DeleteOnClose);
+	dialog->setWindowTitle(tr("Memory Usage"));
+	QVBoxLayout* layout = new QVBoxLayout(dialog);
+	QLabel* label = new QLabel(dialog);
+	label->setTextInteractionFlags(Qt::TextSelectableByMouse);
+	layout->addWidget(label);
+	QDialogButtonBox* buttons = new QDialogButtonBox(QDialogButtonBox::Close, dialog);
+	QPushButton* refresh = buttons->addButton(tr("&Refresh"), QDialogButtonBox::ActionRole);
+	layout->addWidget(buttons);
+	auto update = [this, label]() {
+		MemoryStats stats;
+		stats.account_document(doc.get());
+		for (PageWidget* pagewidget : pagewidgets) {
+			if (pagewidget->pagePicture())
+				stats.account_page_picture(pagewidget->pagePicture());
+		}
+		stats.add(MemoryStats::Surfaces, m_page_overview->thumbnails()->memory_usage());
+		stats.account_undo_stack(m_tool_state->undoStack());
+		label->setText(stats.report().join('\n'));
+	};
+	update();
+	connect(refresh, &QPushButton::clicked, dialog, update);
+	connect(buttons, &QDialogButtonBox::rejected, dialog, &QDialog::close);
+	dialog->show();
+}
+
 // TODO Do autosaving in a different thread to avoid interruptions?
 // Question: Is copying a Document fast enough to make a separate copy for the autosave thread?
 // Otherwise, we could perhaps always keep two copies of the Document, one for the view, one for the autosave thread. While the autosave thread is saving, its Document doesn't update but instead keeps track of the edits it's currently missing. The edits are applied as soon as the autosave is complete.
 void MainWindow::autoSave() {
+	TRACE_SCOPE("MainWindow::autoSave");
 	if (!curFile.isEmpty()) {
 		qDebug() << "Autosaving...";
 		save();
@@ -689,6 +967,10 @@ void MainWindow::exportPDF() {
 void MainWindow::closeEvent(QCloseEvent* event) {
 	if (maybeSave()) {
 		writeGeometrySettings();
+		if (m_input_recorder)
+			recordInput(false);
+		for (PageWidget* pagewidget : pagewidgets)
+			pagewidget->setPage(nullptr);  // Stores the page pictures in the raster cache
 		event->accept();
 	} else {
 		event->ignore();
@@ -735,6 +1017,8 @@ void MainWindow::showPages(std::array<int, 2> new_page_numbers, int new_focused_
 		pagewidgets[focused_view]->unfocusPage();
 	}
 	for (int i = 0; i < (int)pagewidgets.size(); i++) {
+		if (m_input_recorder && i == m_recorded_view && new_page_numbers[i] != page_numbers[i])
+			m_input_recorder->record_page_change(new_page_numbers[i]);
 		page_numbers[i] = new_page_numbers[i];
 		if (page_numbers[i] != -1) {
 			assert(0 <= page_numbers[i] && page_numbers[i] < (int)doc->pages().size());
@@ -751,6 +1035,7 @@ void MainWindow::showPages(std::array<int, 2> new_page_numbers, int new_focused_
 		}
 		updateTabletMap();
 	}
+	m_page_overview->setCurrentPages(page_numbers);
 	updatePageNavigation();
 }
 
@@ -859,6 +1144,45 @@ void MainWindow::insertSauklaue() {
 	statusBar()->showMessage(tr("Inserted %1 pages").arg(pages.size()), 2000);
 }
 
+void MainWindow::compactDocument() {
+	SimpleCursorSaver cursor(Qt::WaitCursor);
+	QUndoCommand* cmd = new QUndoCommand(tr("Compact document"));
+	Compactor::Stats stats;
+	for (SPage* page : doc->pages()) {
+		for (ptr_Layer layer : page->layers()) {
+			if (!std::holds_alternative<NormalLayer*>(layer))
+				continue;
+			NormalLayer* normal_layer = std::get<NormalLayer*>(layer);
+			Compactor::Changes changes = Compactor::compact(normal_layer, stats);
+			if (changes.empty())
+				continue;
+			// Check that the layer looks the same afterwards (like the compact command).
+			Compactor::check(page, normal_layer, changes, Compactor::check_size(), stats);
+			new ReplaceStrokesCommand(normal_layer, std::move(changes.deleted), std::move(changes.inserted), std::move(changes.new_strokes), cmd);
+		}
+	}
+	if (!cmd->childCount()) {
+		delete cmd;
+		statusBar()->showMessage(tr("There is no erased ink to remove"), 2000);
+		return;
+	}
+	if (stats.different_pixels) {
+		delete cmd;
+		QMessageBox::warning(this, tr("Compact Document"), tr("Compacting would change %1 pixels. The document was not changed.").arg(stats.different_pixels));
+		return;
+	}
+	qint64 size_before = Serializer::saved_size(doc.get());
+	{
+		// Update the views once.
+		ChangeTransaction transaction;
+		m_tool_state->undoStack()->push(cmd);
+	}
+	qint64 size_after = Serializer::saved_size(doc.get());
+	QStringList report = stats.report();
+	report << tr("File size: %1 -> %2").arg(QLocale().formattedDataSize(size_before), QLocale().formattedDataSize(size_after));
+	QMessageBox::information(this, tr("Compact Document"), report.join('\n'));
+}
+
 void MainWindow::insertPDF(insertPDFMode mode) {
 	QStringList mimeTypeFilters({"application/pdf", "application/octet-stream"});
 	QFileDialog dialog(this, tr("Import PDF file"));
@@ -1017,11 +1341,26 @@ void MainWindow::commitData(QSessionManager& manager) {
 }
 
 void MainWindow::pages_added(int first_page, int number_of_pages) {
-	gotoPage(first_page + number_of_pages - 1);
+	gotoPageAfterChanges(first_page + number_of_pages - 1);
 }
 
 void MainWindow::pages_deleted(int first_page, [[maybe_unused]] int number_of_pages) {
-	gotoPage(first_page);
+	gotoPageAfterChanges(first_page);
+}
+
+void MainWindow::gotoPageAfterChanges(int index) {
+	if (ChangeNotifier::self()->active())
+		m_pending_page = index;  // Only the last one counts (see finishChanges).
+	else
+		gotoPage(index);
+}
+
+void MainWindow::finishChanges() {
+	if (m_pending_page) {
+		int index = m_pending_page.value();
+		m_pending_page.reset();
+		gotoPage(index);
+	}
 }
 
 void MainWindow::updateTabletMap() {
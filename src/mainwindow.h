@@ -3,13 +3,18 @@
 
 #include "all-types.h"
 
+#include <optional>
+
 #include <QMainWindow>
 class KRecentFilesAction;
+class QDockWidget;
 class QSpinBox;
 class QLabel;
 class QSessionManager;
 class QUndoStack;
 class ToolState;
+class InputRecorder;
+class PageOverview;
 
 class MainWindow : public QMainWindow {
 	Q_OBJECT
@@ -69,6 +74,8 @@ private:
 	void lastPage();
 	void actionGotoPage();
 	void insertSauklaue();
+	// Removes erased ink from all pages (see Compactor).
+	void compactDocument();
 	enum insertPDFMode { normal,
 		             by_label,
 		             all_in_one };
@@ -99,6 +106,20 @@ private:
 	void otherView();
 
 	QAction* otherViewAction;
+	QDockWidget* pageOverviewDock;
+	PageOverview* m_page_overview;  // owned by pageOverviewDock
+	QDockWidget* undoHistoryDock;
+
+	/* Debugging */
+private:
+	void recordTrace(bool on);
+	void recordInput(bool on);
+	void showMemoryStats();
+
+	QAction* recordTraceAction;
+	QAction* recordInputAction;
+	std::unique_ptr<InputRecorder> m_input_recorder;
+	int m_recorded_view = -1;  // The view whose input is being recorded
 
 	/* Settings */
 private:
@@ -108,6 +129,10 @@ private:
 
 	void pages_added(int first_page, int number_of_pages);
 	void pages_deleted(int first_page, int number_of_pages);
+	// Shows the page now or, during a ChangeTransaction, at its end.
+	void gotoPageAfterChanges(int index);
+	void finishChanges();
+	std::optional<int> m_pending_page;
 
 	/* Tablet */
 	void updateTabletMap();
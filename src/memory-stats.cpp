@@ -0,0 +1,125 @@
+#include "memory-stats.h"
+
+#include "commands.h"
+#include "document.h"
+#include "renderer.h"
+
+#include <numeric>
+
+#include <QFile>
+#include <QLocale>
+#include <QUndoStack>
+
+QString MemoryStats::category_name(Category category) {
+	switch (category) {
+	case Points:
+		return "Stroke points";
+	case Strokes:
+		return "Strokes and layers";
+	case PDFFiles:
+		return "Embedded PDF files";
+	case Poppler:
+		return "Poppler (copy of PDF files)";
+	case Surfaces:
+		return "Page picture surfaces";
+	case UndoHistory:
+		return "Undo history";
+	default:
+		return "Unknown";
+	}
+}
+
+size_t MemoryStats::total() const {
+	return std::accumulate(m_bytes.begin(), m_bytes.end(), (size_t)0);
+}
+
+void MemoryStats::account_document(const Document* doc) {
+	for (SPage* page : doc->pages())
+		account_page(page);
+	for (EmbeddedPDF* pdf : doc->embedded_pdfs())
+		account_embedded_pdf(pdf);
+}
+
+void MemoryStats::account_page(const SPage* page, std::optional<Category> category) {
+	if (!category)
+		m_number_of_pages++;
+	add(category.value_or(Strokes), sizeof(SPage));
+	for (ptr_Layer layer : page->layers()) {
+		std::visit(overloaded{[&](NormalLayer* layer) {
+			                      add(category.value_or(Strokes), sizeof(NormalLayer) + layer->strokes().size() * sizeof(unique_ptr_Stroke) + layer->stroke_index_memory_usage());
+			                      for (ptr_Stroke stroke : layer->strokes())
+				                      account_stroke(stroke, category);
+		                      },
+		                      [&](PDFLayer*) {
+			                      add(category.value_or(Strokes), sizeof(PDFLayer));
+		                      }},
+		           layer);
+	}
+}
+
+void MemoryStats::account_stroke(ptr_Stroke stroke, std::optional<Category> category) {
+	const PathStroke* path = convert_variant<PathStroke*>(stroke);
+	if (!category) {
+		m_number_of_strokes++;
+		m_number_of_points += path->points().size();
+	}
+	add(category.value_or(Strokes), std::visit([](auto* s) { return sizeof(*s); }, stroke));
+	add(category.value_or(Points), path->points().capacity() * sizeof(Point) + path->simplified_points_memory_usage());
+}
+
+void MemoryStats::account_embedded_pdf(const EmbeddedPDF* pdf, std::optional<Category> category) {
+	add(category.value_or(PDFFiles), pdf->contents().size());
+	// Poppler keeps its own copy of the file (see the EmbeddedPDF constructor).
+	add(category.value_or(Poppler), pdf->contents().size());
+}
+
+void MemoryStats::account_page_picture(const PagePicture* picture) {
+	for (ptr_LayerPicture layer_picture : picture->layers()) {
+		add(Surfaces, convert_variant<LayerPicture*>(layer_picture)->memory_usage());
+		m_number_of_surfaces++;
+	}
+	add(Surfaces, picture->temporary_layer()->memory_usage());
+	m_number_of_surfaces++;
+}
+
+void MemoryStats::account_undo_stack(const QUndoStack* stack) {
+	for (int i = 0; i < stack->count(); i++)
+		account_command(stack->command(i));
+}
+
+void MemoryStats::account_command(const QUndoCommand* command) {
+	m_number_of_commands++;
+	add(UndoHistory, sizeof(QUndoCommand) + command->text().size() * sizeof(QChar));
+	if (const Command* c = dynamic_cast<const Command*>(command))
+		c->account_memory(*this);
+	for (int i = 0; i < command->childCount(); i++)
+		account_command(command->child(i));
+}
+
+QStringList MemoryStats::report() const {
+	QLocale locale;
+	QStringList res;
+	for (int category = 0; category < NUMBER_OF_CATEGORIES; category++)
+		res << QString("%1: %2").arg(category_name((Category)category), locale.formattedDataSize(m_bytes[category]));
+	res << QString("Total: %1").arg(locale.formattedDataSize(total()));
+	res << QString("(%1 pages, %2 strokes, %3 points, %4 surfaces, %5 undo commands)").arg(m_number_of_pages).arg(m_number_of_strokes).arg(m_number_of_points).arg(m_number_of_surfaces).arg(m_number_of_commands);
+	if (size_t rss = process_resident_memory())
+		res << QString("Resident memory of the process: %1").arg(locale.formattedDataSize(rss));
+	return res;
+}
+
+size_t process_resident_memory() {
+	// Only available on Linux.
+	QFile file("/proc/self/status");
+	if (!file.open(QFile::ReadOnly))
+		return 0;
+	for (const QByteArray& line : file.readAll().split('\n')) {
+		// Example: "VmRSS:	  123456 kB"
+		if (line.startsWith("VmRSS:")) {
+			QList<QByteArray> parts = line.mid(6).simplified().split(' ');
+			if (!parts.empty())
+				return parts[0].toULongLong() * 1024;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef MEMORY_STATS_H
+#define MEMORY_STATS_H
+
+#include "all-types.h"
+
+#include <array>
+#include <optional>
+
+#include <QStringList>
+
+class QUndoCommand;
+class QUndoStack;
+
+// Estimates how much memory the different parts of a document and its views use.
+// Only the large allocations are counted (point arrays, image surfaces, PDF files), so the numbers are lower bounds.
+class MemoryStats {
+public:
+	enum Category {
+		Points,  // Point arrays of the strokes in the document
+		Strokes,  // Stroke and layer objects of the document (without their points), and the stroke eraser's StrokeIndex
+		PDFFiles,  // Contents of the embedded PDF files
+		Poppler,  // Poppler's copy of the embedded PDF files (its other internal data is not counted)
+		Surfaces,  // Image surfaces of the page pictures and the page thumbnails
+		UndoHistory,  // Data only referenced by the undo stack (e.g. undone strokes, deleted pages)
+		NUMBER_OF_CATEGORIES
+	};
+	static QString category_name(Category category);
+
+	void add(Category category, size_t bytes) {
+		m_bytes[category] += bytes;
+	}
+	size_t bytes(Category category) const {
+		return m_bytes[category];
+	}
+	size_t total() const;
+
+	void account_document(const Document* doc);
+	void account_page_picture(const PagePicture* picture);
+	void account_undo_stack(const QUndoStack* stack);
+
+	// Used by undo commands to account the data they own.
+	// The data is counted in the given category instead of the usual one.
+	void account_page(const SPage* page, std::optional<Category> category = std::nullopt);
+	void account_stroke(ptr_Stroke stroke, std::optional<Category> category = std::nullopt);
+	void account_embedded_pdf(const EmbeddedPDF* pdf, std::optional<Category> category = std::nullopt);
+
+	// Human-readable report with one line per category.
+	QStringList report() const;
+
+private:
+	void account_command(const QUndoCommand* command);
+
+	std::array<size_t, NUMBER_OF_CATEGORIES> m_bytes = {};
+	size_t m_number_of_pages = 0;
+	size_t m_number_of_strokes = 0;
+	size_t m_number_of_points = 0;
+	size_t m_number_of_surfaces = 0;
+	size_t m_number_of_commands = 0;
+};
+
+// Resident memory of the whole process (in bytes) or 0 if unknown.
+size_t process_resident_memory();
+
+#endif  // MEMORY_STATS_H
@@ -0,0 +1,132 @@
+#include "page-overview.h"
+
+#include "document.h"
+#include "thumbnail-cache.h"
+
+#include <QBrush>
+#include <QFont>
+#include <QPalette>
+#include <QPixmap>
+
+PageOverviewModel::PageOverviewModel(QObject* parent) :
+    QAbstractListModel(parent),
+    m_thumbnails(new ThumbnailCache(this)) {
+	connect(m_thumbnails, &ThumbnailCache::thumbnail_changed, this, &PageOverviewModel::thumbnail_changed);
+}
+
+void PageOverviewModel::setDocument(Document* doc) {
+	beginResetModel();
+	if (m_doc)
+		disconnect(m_doc, nullptr, this, nullptr);
+	m_doc = doc;
+	m_thumbnails->setDocument(doc);
+	m_current_pages = {-1, -1};
+	if (m_doc) {
+		// The signals are emitted after the pages were added or deleted, which is too late for beginInsertRows/beginRemoveRows.
+		connect(m_doc, &Document::pages_added, this, &PageOverviewModel::pages_changed);
+		connect(m_doc, &Document::pages_deleted, this, &PageOverviewModel::pages_changed);
+	}
+	endResetModel();
+}
+
+void PageOverviewModel::pages_changed() {
+	beginResetModel();
+	endResetModel();
+}
+
+void PageOverviewModel::setCurrentPages(std::array<int, 2> page_numbers) {
+	std::array<int, 2> old_pages = m_current_pages;
+	m_current_pages = page_numbers;
+	for (int page_number : old_pages) {
+		if (page_number != -1 && page_number < rowCount())
+			emit dataChanged(index(page_number), index(page_number), {Qt::FontRole, Qt::BackgroundRole});
+	}
+	for (int page_number : m_current_pages) {
+		if (page_number != -1 && page_number < rowCount())
+			emit dataChanged(index(page_number), index(page_number), {Qt::FontRole, Qt::BackgroundRole});
+	}
+}
+
+int PageOverviewModel::rowCount(const QModelIndex& parent) const {
+	if (parent.isValid() || !m_doc)
+		return 0;
+	return m_doc->pages().size();
+}
+
+QVariant PageOverviewModel::data(const QModelIndex& index, int role) const {
+	if (!index.isValid() || !m_doc || index.row() >= rowCount())
+		return QVariant();
+	int page_number = index.row();
+	bool current = page_number == m_current_pages[0] || page_number == m_current_pages[1];
+	switch (role) {
+	case Qt::DisplayRole:
+		return QString::number(page_number + 1);
+	case Qt::DecorationRole: {
+		// The view only asks for the decoration of visible items.
+		QImage image = m_thumbnails->thumbnail(m_doc->pages()[page_number]);
+		if (image.isNull()) {
+			// Reserve the space until the thumbnail is ready.
+			QPixmap placeholder(ThumbnailCache::box_size());
+			placeholder.fill(Qt::transparent);
+			return placeholder;
+		}
+		return QPixmap::fromImage(image);
+	}
+	case Qt::FontRole:
+		if (current) {
+			QFont font;
+			font.setBold(true);
+			return font;
+		}
+		return QVariant();
+	case Qt::BackgroundRole:
+		if (current)
+			return QPalette().brush(QPalette::Highlight);
+		return QVariant();
+	case Qt::ToolTipRole:
+		return tr("Page %1").arg(page_number + 1);
+	}
+	return QVariant();
+}
+
+void PageOverviewModel::thumbnail_changed(SPage* page) {
+	if (!m_doc)
+		return;
+	const auto& pages = m_doc->pages();
+	for (int i = 0; i < (int)pages.size(); i++) {
+		if (pages[i] == page) {
+			emit dataChanged(index(i), index(i), {Qt::DecorationRole});
+			return;
+		}
+	}
+}
+
+PageOverview::PageOverview(QWidget* parent) :
+    QListView(parent),
+    m_model(new PageOverviewModel(this)) {
+	setModel(m_model);
+	setViewMode(QListView::IconMode);
+	setIconSize(ThumbnailCache::box_size());
+	setResizeMode(QListView::Adjust);
+	setMovement(QListView::Static);
+	setUniformItemSizes(true);
+	setSelectionMode(QAbstractItemView::NoSelection);
+	setSpacing(4);
+	connect(this, &QListView::clicked, this, [this](const QModelIndex& index) {
+		emit pageActivated(index.row());
+	});
+}
+
+void PageOverview::setDocument(Document* doc) {
+	m_model->setDocument(doc);
+}
+
+void PageOverview::setCurrentPages(std::array<int, 2> page_numbers) {
+	m_model->setCurrentPages(page_numbers);
+	for (int page_number : page_numbers) {
+		if (page_number != -1) {
+			scrollTo(m_model->index(page_number));
+			break;
+		}
+	}
+}
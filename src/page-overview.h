@@ -0,0 +1,58 @@
+#ifndef PAGE_OVERVIEW_H
+#define PAGE_OVERVIEW_H
+
+#include "all-types.h"
+
+#include <array>
+
+#include <QAbstractListModel>
+#include <QListView>
+
+class ThumbnailCache;
+
+// One item per page of the document. The decoration is the page's thumbnail.
+class PageOverviewModel : public QAbstractListModel {
+	Q_OBJECT
+public:
+	explicit PageOverviewModel(QObject* parent = nullptr);
+
+	void setDocument(Document* doc);
+	// The pages shown in the views (-1 if there is none). They are highlighted.
+	void setCurrentPages(std::array<int, 2> page_numbers);
+	ThumbnailCache* thumbnails() const {
+		return m_thumbnails;
+	}
+
+	int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+	QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const override;
+
+private:
+	void pages_changed();
+	void thumbnail_changed(SPage* page);
+
+	Document* m_doc = nullptr;
+	ThumbnailCache* m_thumbnails;
+	std::array<int, 2> m_current_pages = {-1, -1};
+};
+
+// A grid of page thumbnails. Clicking a thumbnail shows its page.
+// Only the visible thumbnails are requested (when they are painted), so they are rendered first.
+class PageOverview : public QListView {
+	Q_OBJECT
+public:
+	explicit PageOverview(QWidget* parent = nullptr);
+
+	void setDocument(Document* doc);
+	void setCurrentPages(std::array<int, 2> page_numbers);
+	ThumbnailCache* thumbnails() const {
+		return m_model->thumbnails();
+	}
+
+signals:
+	void pageActivated(int index);
+
+private:
+	PageOverviewModel* m_model;
+};
+
+#endif  // PAGE_OVERVIEW_H
@@ -5,15 +5,27 @@
 #include "document.h"
 #include "renderer.h"
 #include "tool-state.h"
+#include "trace.h"
+#include "input-recording.h"
+#include "raw-pen-capture.h"
+#include "settings.h"
 
+#include <algorithm>
+
+#include <QGuiApplication>
 #include <QScreen>
+#include <QTimer>
+#include <QWindow>
 #include <QPaintEvent>
 #include <QPainter>
 #include <QPen>
 #include <QDebug>
+#include <QUndoStack>
 
 // const int DEFAULT_LINE_WIDTH = 1500;
 const int DEFAULT_ERASER_WIDTH = 1500 * 20;
+// Paints that are further apart than this are not considered consecutive frames of continuous drawing.
+const LatencyMonitor::Clock::duration CONTINUOUS_DRAWING_GAP = std::chrono::milliseconds(250);
 
 StrokeCreator::StrokeCreator(unique_ptr_Stroke stroke, std::function<void(unique_ptr_Stroke)> committer, DrawingLayerPicture* pic) :
     m_stroke(std::move(stroke)), m_committer(committer), m_pic(pic) {
@@ -31,14 +43,50 @@ void StrokeCreator::commit() {
 	m_pic = nullptr;
 }
 
-void StrokeCreator::add_point(Point p) {
+void StrokeCreator::add_points(const std::vector<Point>& points) {
+	if (points.empty())
+		return;
 	PathStroke* pst = convert_variant<PathStroke*>(get(m_stroke));
-	Point old = pst->points().empty() ? p : pst->points().back();
-	pst->push_back(p);
+	std::vector<Point> polyline;
+	polyline.reserve(points.size() + 1);
+	polyline.push_back(pst->points().empty() ? points.front() : pst->points().back());
+	for (Point p : points) {
+		pst->push_back(p);
+		polyline.push_back(p);
+	}
 	// TODO This doesn't work properly with transparency because the old stroke is partially covered by the new line, making some parts more opaque than they should be.
 	// Really, when using transparency, I guess we should clip to the region of the new line segment and then redraw the entire layer on that clipping region.
 	// Even when the line is completely opaque, this is probably technically wrong because of antialiasing (which makes the line somewhat transparent near the boundary).
-	m_pic->draw_line(old, p, get(m_stroke));
+	m_pic->draw_polyline(polyline, get(m_stroke));
+}
+
+StrokeEraser::StrokeEraser(NormalLayer* layer, DrawingLayerPicture* pic, int width, QUndoStack* undo_stack, Point start) :
+    m_layer(layer), m_pic(pic), m_width(width), m_undo_stack(undo_stack), m_last(start) {
+	add_points({start});
+}
+
+StrokeEraser::~StrokeEraser() {
+	if (m_in_macro)
+		m_undo_stack->endMacro();
+}
+
+void StrokeEraser::add_points(const std::vector<Point>& points) {
+	TRACE_SCOPE("StrokeEraser::add_points");
+	std::vector<size_t> positions;
+	for (Point p : points) {
+		std::vector<size_t> near = m_layer->strokes_near(m_last, p, m_width / 2.);
+		positions.insert(positions.end(), near.begin(), near.end());
+		m_last = p;
+	}
+	if (positions.empty())
+		return;
+	std::sort(positions.begin(), positions.end());
+	positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+	if (!m_in_macro) {
+		m_undo_stack->beginMacro(QObject::tr("Erase strokes"));
+		m_in_macro = true;
+	}
+	m_undo_stack->push(new DeleteStrokesCommand(m_layer, std::move(positions)));
 }
 
 double EraserCursor::radius() const {
@@ -66,6 +114,12 @@ PageWidget::PageWidget(ToolState* toolState) :
     QWidget(nullptr),
     m_tool_state(toolState) {
 	setMinimumSize(20, 20);
+	m_frame_timer = new QTimer(this);
+	m_frame_timer->setTimerType(Qt::PreciseTimer);
+	connect(m_frame_timer, &QTimer::timeout, this, &PageWidget::frame);
+	connect(LatencyMonitor::self(), &LatencyMonitor::overlay_changed, this, [this]() {
+		update(latency_overlay_rect());
+	});
 }
 
 void PageWidget::setPage(SPage* page) {
@@ -73,10 +127,13 @@ void PageWidget::setPage(SPage* page) {
 		return;  // Do nothing. In particular, don't clear m_current_stroke.
 	m_page = page;
 	m_current_stroke.reset();
+	m_stroke_eraser.reset();
 	setupPicture();
 }
 
 void PageWidget::setupPicture() {
+	if (m_page_picture)
+		m_page_picture->store_in_raster_cache();
 	if (m_page) {
 		set_tool_cursor(nullptr);
 		m_page_picture = std::make_unique<PagePicture>(m_page, width(), height());
@@ -88,14 +145,23 @@ void PageWidget::setupPicture() {
 	update();
 }
 
+void PageWidget::setInputRecorder(InputRecorder* recorder) {
+	m_input_recorder = recorder;
+}
+
 void PageWidget::update_page(const QRect& rect) {
 	update(rect.translated(m_page_picture->transformation().topLeft));
+	// Remember that the current input event will be visible after the next paint.
+	if (m_input_time && (m_unpainted_inputs.empty() || m_unpainted_inputs.back() != *m_input_time))
+		m_unpainted_inputs.push_back(*m_input_time);
 }
 
 void PageWidget::removing_layer_picture(ptr_LayerPicture layer_picture) {
 	std::visit(overloaded{[&](DrawingLayerPicture* layer_picture) {
-		                      if (layer_picture == m_current_stroke->pic())  // Removing the layer we're currently drawing on. => Stop drawing.
+		                      if (m_current_stroke && layer_picture == m_current_stroke->pic())  // Removing the layer we're currently drawing on. => Stop drawing.
 			                      m_current_stroke.reset();
+		                      if (m_stroke_eraser && layer_picture == m_stroke_eraser->pic())
+			                      m_stroke_eraser.reset();
 	                      },
 	                      [&](PDFLayerPicture*) {
 	                      }},
@@ -119,6 +185,8 @@ void PageWidget::unfocusPage() {
 }
 
 void PageWidget::paintEvent([[maybe_unused]] QPaintEvent* event) {
+	TRACE_SCOPE("PageWidget::paintEvent");
+	LatencyMonitor::Clock::time_point paint_start = LatencyMonitor::Clock::now();
 	// 	qDebug() << "paint" << event->region();
 	QPainter painter(this);
 	painter.setRenderHint(QPainter::Antialiasing, false);
@@ -151,6 +219,37 @@ void PageWidget::paintEvent([[maybe_unused]] QPaintEvent* event) {
 		painter.drawRect(m_page_picture->transformation().image_rect);
 		painter.restore();
 	}
+	if (LatencyMonitor::self()->overlayVisible())
+		paint_latency_overlay(painter);
+	if (!m_unpainted_inputs.empty()) {
+		LatencyMonitor::Clock::time_point paint_end = LatencyMonitor::Clock::now();
+		for (LatencyMonitor::Clock::time_point input_time : m_unpainted_inputs)
+			LatencyMonitor::self()->record_input(paint_end - input_time);
+		std::optional<LatencyMonitor::Clock::duration> frame_interval;
+		if (m_last_ink_paint && paint_end - *m_last_ink_paint < CONTINUOUS_DRAWING_GAP)
+			frame_interval = paint_end - *m_last_ink_paint;
+		LatencyMonitor::self()->record_frame(paint_end - paint_start, frame_interval);
+		m_last_ink_paint = paint_end;
+		m_unpainted_inputs.clear();
+	}
+}
+
+QRect PageWidget::latency_overlay_rect() const {
+	const int MARGIN = 4;
+	QFontMetrics metrics = fontMetrics();
+	int text_width = metrics.horizontalAdvance("Input to paint: p50 000.0 ms, p95 000.0 ms, p99 000.0 ms, max 0000.0 ms (0000000 samples)");
+	int text_height = LatencyMonitor::self()->summary().size() * metrics.lineSpacing();
+	return QRect(0, 0, text_width + 2 * MARGIN, text_height + 2 * MARGIN);
+}
+
+void PageWidget::paint_latency_overlay(QPainter& painter) const {
+	const int MARGIN = 4;
+	QRect rect = latency_overlay_rect();
+	painter.save();
+	painter.fillRect(rect, QColor(0, 0, 0, 160));
+	painter.setPen(Qt::white);
+	painter.drawText(rect.adjusted(MARGIN, MARGIN, -MARGIN, -MARGIN), Qt::AlignLeft | Qt::AlignTop, LatencyMonitor::self()->summary().join('\n'));
+	painter.restore();
 }
 
 void PageWidget::resizeEvent(QResizeEvent*) {
@@ -163,64 +262,164 @@ void PageWidget::moveEvent(QMoveEvent*) {
 }
 
 void PageWidget::mousePressEvent(QMouseEvent* event) {
-	if (event->button() == Qt::LeftButton)
-		start_path(event->pos(), StrokeType::Pen);
-	else if (event->button() == Qt::RightButton) {
-		start_path(event->pos(), StrokeType::Eraser);
-		if (m_page)
-			set_tool_cursor(std::make_unique<EraserCursor>(event->pos(), &m_page_picture->transformation(), DEFAULT_ERASER_WIDTH));
-	} else if (event->button() == Qt::MiddleButton)
-		start_path(event->pos(), StrokeType::LaserPointer);
-	if (m_page)
-		emit focus();
+	handle_input({InputEvent::Press, InputEvent::Mouse, event->button(), event->buttons(), event->localPos()});
 }
 
 void PageWidget::mouseMoveEvent(QMouseEvent* event) {
-	move_tool_cursor(event->pos());
-	continue_path(event->pos());
+	handle_input({InputEvent::Move, InputEvent::Mouse, event->button(), event->buttons(), event->localPos()});
 }
 
-void PageWidget::mouseReleaseEvent(QMouseEvent*) {
-	set_tool_cursor(nullptr);
-	finish_path();
+void PageWidget::mouseReleaseEvent(QMouseEvent* event) {
+	handle_input({InputEvent::Release, InputEvent::Mouse, event->button(), event->buttons(), event->localPos()});
 }
 
 void PageWidget::tabletEvent(QTabletEvent* event) {
-	if (event->pointerType() == QTabletEvent::Pen || event->pointerType() == QTabletEvent::Eraser) {
-		if (event->type() == QEvent::TabletPress) {
-			// If we push the right button while touching the surface, the left button is automatically pushed as well.
-			if (event->button() == Qt::LeftButton) {  // Do not draw if we only press the right button while hovering.
-				StrokeType type = StrokeType::Pen;
-				if (event->pointerType() == QTabletEvent::Eraser || (event->buttons() & Qt::RightButton))
-					type = StrokeType::Eraser;
-				start_path(event->posF(), type);
-				event->accept();
-			} else if (event->button() == Qt::RightButton) {
-				if (m_page)
-					set_tool_cursor(std::make_unique<EraserCursor>(event->posF(), &m_page_picture->transformation(), DEFAULT_ERASER_WIDTH));
-				event->accept();
-			} else if (event->button() == Qt::MiddleButton) {
-				start_path(event->posF(), StrokeType::LaserPointer);
-				event->accept();
-			}
-		} else if (event->type() == QEvent::TabletMove) {
-			move_tool_cursor(event->posF());
-			continue_path(event->posF());
-			event->accept();
-		} else if (event->type() == QEvent::TabletRelease) {
-			finish_path();
-			if (!(event->buttons() & Qt::RightButton))
-				set_tool_cursor(nullptr);
-			event->accept();
+	if (event->pointerType() != QTabletEvent::Pen && event->pointerType() != QTabletEvent::Eraser)
+		return;
+	InputEvent::PointerType pointer_type = event->pointerType() == QTabletEvent::Eraser ? InputEvent::Eraser : InputEvent::Pen;
+	InputEvent::Type type;
+	if (event->type() == QEvent::TabletPress)
+		type = InputEvent::Press;
+	else if (event->type() == QEvent::TabletMove)
+		type = InputEvent::Move;
+	else if (event->type() == QEvent::TabletRelease)
+		type = InputEvent::Release;
+	else
+		return;
+	if (m_raw_stroke && type == InputEvent::Move) {
+		// The positions are taken from the raw samples instead.
+		move_tool_cursor(event->posF());
+		if (!m_raw_confirmed)
+			m_raw_fallback_moves.emplace_back(InputEvent{type, pointer_type, event->button(), event->buttons(), event->posF()}, LatencyMonitor::Clock::now());
+		event->accept();
+		return;
+	}
+	if (m_raw_stroke && type == InputEvent::Release)
+		finish_raw_stroke();
+	bool had_stroke = m_current_stroke.has_value();
+	if (handle_input({type, pointer_type, event->button(), event->buttons(), event->posF()}))
+		event->accept();
+	if (type == InputEvent::Press && !had_stroke && m_current_stroke && RawPenCapture::self()->active()) {
+		start_raw_stroke(event->timestamp());
+		start_frame_timer();
+	}
+}
+
+void PageWidget::start_raw_stroke(unsigned long time) {
+	m_raw_stroke = true;
+	m_raw_stroke_start = time;
+	// The capture thread usually sees the press before Qt does. Otherwise, the first raw samples confirm it (see frame).
+	m_raw_confirmed = RawPenCapture::self()->captured_press_since(time);
+	m_raw_fallback_moves.clear();
+	take_raw_samples();
+}
+
+void PageWidget::take_raw_samples() {
+	if (!m_current_stroke)
+		return;
+	std::vector<PenSample> samples;
+	RawPenCapture::self()->take_samples(samples);
+	for (const PenSample& sample : samples) {
+		if (sample.time < m_raw_stroke_start)
+			continue;  // From an earlier stroke
+		if (!m_raw_confirmed) {
+			m_raw_confirmed = true;
+			m_raw_fallback_moves.clear();
 		}
+		handle_input({InputEvent::Move, InputEvent::Pen, Qt::NoButton, Qt::LeftButton, native_screen_to_widget(sample.pos)}, sample.received);
+	}
+}
+
+void PageWidget::finish_raw_stroke() {
+	take_raw_samples();
+	if (!m_raw_confirmed)
+		cancel_raw_stroke();
+	m_raw_stroke = false;
+}
+
+void PageWidget::cancel_raw_stroke() {
+	m_raw_stroke = false;
+	std::vector<std::pair<InputEvent, LatencyMonitor::Clock::time_point> > moves;
+	std::swap(moves, m_raw_fallback_moves);
+	for (const auto& [event, arrival] : moves)
+		handle_input(event, arrival);
+}
+
+QPointF PageWidget::native_screen_to_widget(QPointF pos) const {
+	// The X server uses native pixels, Qt uses device-independent pixels.
+	return pos / devicePixelRatioF() - QPointF(mapToGlobal(QPoint(0, 0)));
+}
+
+bool PageWidget::handle_input(const InputEvent& event, std::optional<LatencyMonitor::Clock::time_point> arrival) {
+	m_input_time = arrival.value_or(LatencyMonitor::Clock::now());
+	if (m_input_recorder)
+		m_input_recorder->record(event);
+	bool handled = event.pointer_type == InputEvent::Mouse ? handle_mouse_input(event) : handle_tablet_input(event);
+	m_input_time.reset();
+	return handled;
+}
+
+bool PageWidget::handle_mouse_input(const InputEvent& event) {
+	if (event.type == InputEvent::Press) {
+		if (event.button == Qt::LeftButton)
+			start_path(event.pos, StrokeType::Pen);
+		else if (event.button == Qt::RightButton) {
+			start_path(event.pos, StrokeType::Eraser);
+			if (m_page)
+				set_tool_cursor(std::make_unique<EraserCursor>(event.pos, &m_page_picture->transformation(), DEFAULT_ERASER_WIDTH));
+		} else if (event.button == Qt::MiddleButton)
+			start_path(event.pos, StrokeType::LaserPointer);
+		if (m_page)
+			emit focus();
+	} else if (event.type == InputEvent::Move) {
+		move_tool_cursor(event.pos);
+		continue_path(event.pos);
+	} else if (event.type == InputEvent::Release) {
+		set_tool_cursor(nullptr);
+		finish_path();
+	}
+	return true;
+}
+
+bool PageWidget::handle_tablet_input(const InputEvent& event) {
+	if (event.type == InputEvent::Press) {
+		// If we push the right button while touching the surface, the left button is automatically pushed as well.
+		if (event.button == Qt::LeftButton) {  // Do not draw if we only press the right button while hovering.
+			StrokeType type = StrokeType::Pen;
+			if (event.pointer_type == InputEvent::Eraser || (event.buttons & Qt::RightButton))
+				type = StrokeType::Eraser;
+			start_path(event.pos, type);
+			return true;
+		} else if (event.button == Qt::RightButton) {
+			if (m_page)
+				set_tool_cursor(std::make_unique<EraserCursor>(event.pos, &m_page_picture->transformation(), DEFAULT_ERASER_WIDTH));
+			return true;
+		} else if (event.button == Qt::MiddleButton) {
+			start_path(event.pos, StrokeType::LaserPointer);
+			return true;
+		}
+		return false;
+	} else if (event.type == InputEvent::Move) {
+		move_tool_cursor(event.pos);
+		continue_path(event.pos);
+		return true;
+	} else {
+		finish_path();
+		if (!(event.buttons & Qt::RightButton))
+			set_tool_cursor(nullptr);
+		return true;
 	}
 }
 
 void PageWidget::start_path(QPointF pp, StrokeType type) {
 	if (!m_page)
 		return;
-	if (!m_current_stroke) {
+	if (!m_current_stroke && !m_stroke_eraser) {
 		Point p = m_page_picture->transformation().widget2page(pp);
+		if (type == StrokeType::Eraser && m_tool_state->eraseStrokes()) {
+			start_stroke_eraser(p);
+			return;
+		}
 		unique_ptr_Stroke stroke;
 		int timeout;
 		if (type == StrokeType::Pen) {
@@ -238,6 +437,8 @@ void PageWidget::start_path(QPointF pp, StrokeType type) {
 			std::abort();
 		}
 		convert_variant<PathStroke*>(get(stroke))->push_back(p);
+		m_predictor.reset();
+		m_predictor.add(p, m_input_time.value_or(LatencyMonitor::Clock::now()));
 		if (timeout == -1) {
 			int layer_index = -1;
 			for (size_t i = 0; i < m_page->layers().size(); i++) {
@@ -267,20 +468,101 @@ void PageWidget::start_path(QPointF pp, StrokeType type) {
 	}
 }
 
+void PageWidget::start_stroke_eraser(Point p) {
+	for (size_t i = 0; i < m_page->layers().size(); i++) {
+		if (std::holds_alternative<NormalLayer*>(m_page->layers()[i])) {
+			auto layer_picture = std::get<DrawingLayerPicture*>(m_page_picture->layers()[i]);
+			auto layer = std::get<NormalLayer*>(m_page->layers()[i]);
+			m_predictor.reset();
+			m_stroke_eraser.emplace(layer, layer_picture, DEFAULT_ERASER_WIDTH, m_tool_state->undoStack(), p);
+			return;
+		}
+	}
+}
+
 void PageWidget::continue_path(QPointF pp) {
-	if (!m_current_stroke)
+	if (!m_current_stroke && !m_stroke_eraser)
 		return;
+	// Only collect the point here. It is drawn together with all other points of this frame.
 	Point p = m_page_picture->transformation().widget2page(pp);
-	m_current_stroke->add_point(p);
+	m_pending_points.push_back(p);
+	LatencyMonitor::Clock::time_point time = m_input_time.value_or(LatencyMonitor::Clock::now());
+	m_pending_inputs.push_back(time);
+	if (std::optional<double> error = m_predictor.add(p, time))
+		LatencyMonitor::self()->record_prediction_error(*error * m_page_picture->transformation().unit2pixel);
+	if (!m_frame_timer->isActive())
+		start_frame_timer();
 }
 
 void PageWidget::finish_path() {
+	if (m_stroke_eraser) {
+		flush_input();
+		m_stroke_eraser.reset();
+		return;
+	}
 	if (!m_current_stroke)
 		return;
+	flush_input();
 	m_current_stroke->commit();
 	m_current_stroke.reset();
 }
 
+void PageWidget::flush_input() {
+	if (m_stroke_eraser) {
+		m_stroke_eraser->add_points(m_pending_points);
+		m_pending_points.clear();
+		m_pending_inputs.clear();
+		return;
+	}
+	if (!m_current_stroke) {
+		// The stroke was aborted (e.g. by switching pages).
+		m_pending_points.clear();
+		m_pending_inputs.clear();
+		return;
+	}
+	if (!m_pending_points.empty()) {
+		TRACE_SCOPE("PageWidget::flush_input");
+		m_current_stroke->add_points(m_pending_points);
+		m_pending_points.clear();
+		// The collected input events will be visible after the next paint.
+		m_unpainted_inputs.insert(m_unpainted_inputs.end(), m_pending_inputs.begin(), m_pending_inputs.end());
+		m_pending_inputs.clear();
+	}
+	update_predicted_tip();
+}
+
+void PageWidget::frame() {
+	if (m_raw_stroke) {
+		take_raw_samples();
+		// Qt reported movement, but a whole frame passed without raw samples: The capture thread is not listening to this pen.
+		if (!m_raw_confirmed && !m_raw_fallback_moves.empty())
+			cancel_raw_stroke();
+	}
+	flush_input();
+	if (!m_current_stroke && !m_stroke_eraser) {
+		m_raw_stroke = false;
+		m_frame_timer->stop();
+	}
+}
+
+void PageWidget::update_predicted_tip() {
+	if (!m_current_stroke)
+		return;
+	int horizon = Settings::self()->predictionHorizon();
+	std::vector<Point> tip;
+	if (horizon > 0)
+		tip = m_predictor.predict(LatencyMonitor::Clock::now(), std::chrono::milliseconds(horizon));
+	m_current_stroke->pic()->set_predicted_tip(tip);
+}
+
+void PageWidget::start_frame_timer() {
+	QWindow* window_handle = window()->windowHandle();
+	QScreen* screen = window_handle ? window_handle->screen() : QGuiApplication::primaryScreen();
+	// Some virtual or headless screens report a refresh rate of 0.
+	qreal refresh_rate = screen && screen->refreshRate() > 0 ? screen->refreshRate() : 60;
+	m_frame_timer->start(std::max(1, qRound(1000 / refresh_rate)));
+}
+
 void PageWidget::set_tool_cursor(std::unique_ptr<ToolCursor> tool_cursor) {
 	m_tool_cursor = std::move(tool_cursor);
 	if (m_tool_cursor) {
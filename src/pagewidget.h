@@ -2,6 +2,9 @@
 #define PAGEWIDGET_H
 
 #include "all-types.h"
+#include "ink-predictor.h"
+#include "latency-monitor.h"
+#include "input-recording.h"
 
 #include <functional>
 #include <optional>
@@ -10,13 +13,17 @@
 
 class ToolState;
 class PictureTransformation;
+class InputRecorder;
+class QTimer;
+class QUndoStack;
 
 class StrokeCreator {
 public:
 	StrokeCreator(unique_ptr_Stroke stroke, std::function<void(unique_ptr_Stroke)> committer, DrawingLayerPicture* pic);
 	~StrokeCreator();  // Resets (deletes) the current_stroke in pic (which has to equal m_stroke).
 	void commit();  // Commits the stroke using the given committer. (This should add the stroke to the picture.)
-	void add_point(Point p);
+	// Appends the points to the stroke and redraws the new part of the stroke at once.
+	void add_points(const std::vector<Point>& points);
 	DrawingLayerPicture* pic() const {
 		return m_pic;
 	}
@@ -27,6 +34,27 @@ private:
 	DrawingLayerPicture* m_pic;
 };
 
+// Deletes the strokes of a layer that the eraser touches (when erasing whole strokes).
+// Strokes disappear as soon as they are touched. All strokes deleted by one eraser stroke form a single undo step.
+class StrokeEraser {
+public:
+	StrokeEraser(NormalLayer* layer, DrawingLayerPicture* pic, int width, QUndoStack* undo_stack, Point start);
+	~StrokeEraser();  // Finishes the undo step.
+	// Moves the eraser along the points and deletes the strokes it touches.
+	void add_points(const std::vector<Point>& points);
+	DrawingLayerPicture* pic() const {
+		return m_pic;
+	}
+
+private:
+	NormalLayer* m_layer;
+	DrawingLayerPicture* m_pic;
+	int m_width;
+	QUndoStack* m_undo_stack;
+	Point m_last;  // The last position of the eraser
+	bool m_in_macro = false;  // Whether the undo step has been started (on the first deleted stroke)
+};
+
 class ToolCursor : public QObject {
 	Q_OBJECT
 public:
@@ -102,6 +130,10 @@ public:
 	explicit PageWidget(ToolState* toolState);
 
 	void setPage(SPage* page);
+	// The picture of the current page (nullptr if there is no page).
+	const PagePicture* pagePicture() const {
+		return m_page_picture.get();
+	}
 
 public:
 	// The rectangle encompassing this page in global screen coordinates. This is used for tablet mapping.
@@ -128,6 +160,31 @@ protected:
 
 	void tabletEvent(QTabletEvent* event) override;
 
+public:
+	// Handles a pen or mouse event. All input passes through here, so that it can be recorded and replayed.
+	// Returns whether the event was used.
+	// The arrival time defaults to now. (It is used for latency measurements.)
+	bool handle_input(const InputEvent& event, std::optional<LatencyMonitor::Clock::time_point> arrival = std::nullopt);
+	// Draws the pen positions that were collected since the last frame and updates the predicted tip. This normally happens once per frame (see m_frame_timer).
+	void flush_input();
+	// Records all following input events. The recorder must outlive the widget or be removed again (by passing nullptr).
+	void setInputRecorder(InputRecorder* recorder);
+
+private:
+	bool handle_mouse_input(const InputEvent& event);
+	bool handle_tablet_input(const InputEvent& event);
+
+	// Raw pen input (see RawPenCapture)
+	// Starts taking the positions of the current stroke from the raw samples that arrived after the given time (X server time).
+	void start_raw_stroke(unsigned long time);
+	// Handles the raw samples that arrived since the last call.
+	void take_raw_samples();
+	void finish_raw_stroke();
+	// Takes the positions of the current stroke from Qt's tablet events again (starting with m_raw_fallback_moves).
+	void cancel_raw_stroke();
+	// Converts a position on the screen in native pixels to widget coordinates.
+	QPointF native_screen_to_widget(QPointF pos) const;
+
 private:
 	void update_page(const QRect& rect);
 	void removing_layer_picture(ptr_LayerPicture layer_picture);
@@ -140,12 +197,22 @@ private:
 		LaserPointer
 	};
 	void start_path(QPointF p, StrokeType type);
+	void start_stroke_eraser(Point p);
 	void continue_path(QPointF p);
 	void finish_path();
 
+	// Called once per display frame while drawing.
+	void frame();
+	// Replaces the predicted tip of the current stroke (if enabled in the settings).
+	void update_predicted_tip();
+	void start_frame_timer();
+
 	void set_tool_cursor(std::unique_ptr<ToolCursor> tool_cursor);
 	void move_tool_cursor(QPointF pos);
 
+	QRect latency_overlay_rect() const;
+	void paint_latency_overlay(QPainter& painter) const;
+
 private:
 	ToolState* m_tool_state;
 	// The following are equivalent:
@@ -155,11 +222,38 @@ private:
 	//  c) !has_focus
 	//  d) !m_current_stroke
 	//  e) !m_tool_cursor
+	//  f) !m_stroke_eraser
 	SPage* m_page = nullptr;
 	std::unique_ptr<PagePicture> m_page_picture;
 	bool has_focus = false;
 	std::optional<StrokeCreator> m_current_stroke;
+	std::optional<StrokeEraser> m_stroke_eraser;  // Used instead of m_current_stroke when erasing whole strokes
 	std::unique_ptr<ToolCursor> m_tool_cursor;
+
+	// Latency measurement
+	// The time at which the input event that is currently being handled arrived.
+	std::optional<LatencyMonitor::Clock::time_point> m_input_time;
+	// Arrival times of input events whose ink has not been painted yet.
+	std::vector<LatencyMonitor::Clock::time_point> m_unpainted_inputs;
+	// The end of the last paintEvent that painted new ink.
+	std::optional<LatencyMonitor::Clock::time_point> m_last_ink_paint;
+
+	InputRecorder* m_input_recorder = nullptr;
+
+	// Whether the current stroke is fed from raw samples instead of Qt's tablet events.
+	bool m_raw_stroke = false;
+	unsigned long m_raw_stroke_start = 0;
+	// Whether raw samples of the current stroke have arrived. Until then, Qt's move events are kept in m_raw_fallback_moves, in case the pen is not one of the captured devices.
+	bool m_raw_confirmed = false;
+	std::vector<std::pair<InputEvent, LatencyMonitor::Clock::time_point> > m_raw_fallback_moves;
+	// Points of the current stroke (in page coordinates) that have not been drawn yet.
+	std::vector<Point> m_pending_points;
+	// Arrival times of the input events that produced m_pending_points.
+	std::vector<LatencyMonitor::Clock::time_point> m_pending_inputs;
+	// Predicts the continuation of the current stroke.
+	InkPredictor m_predictor;
+	// Draws the pending points (and takes the raw samples) once per frame while drawing.
+	QTimer* m_frame_timer;
 };
 
 #endif  // PAGEWIDGET_H
@@ -0,0 +1,107 @@
+#include "pdf-page-stacker.h"
+
+#include "trace.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+
+#include <QString>
+
+#include <qpdf/QPDFPageDocumentHelper.hh>
+#include <qpdf/QPDFWriter.hh>
+
+PDFPageStacker::PDFPageStacker() {
+	m_out.emptyPDF();
+}
+
+int PDFPageStacker::add_source(const QByteArray& contents, const std::string& description) {
+	TRACE_SCOPE("PDFPageStacker::add_source");
+	// The data of a QByteArray stays in place when the QByteArray is moved, so qpdf may keep reading it.
+	m_source_contents.push_back(contents);
+	auto source = std::make_unique<QPDF>();
+	source->processMemoryFile(description.c_str(), m_source_contents.back().constData(), m_source_contents.back().size());
+	m_source_pages.push_back(QPDFPageDocumentHelper(*source).getAllPages());
+	m_sources.push_back(std::move(source));
+	return m_sources.size() - 1;
+}
+
+void PDFPageStacker::add_page(double width, double height) {
+	finish_page();
+	QPDFObjectHandle resources = QPDFObjectHandle::newDictionary();
+	resources.replaceKey("/XObject", QPDFObjectHandle::newDictionary());
+	QPDFObjectHandle page = QPDFObjectHandle::newDictionary();
+	page.replaceKey("/Type", QPDFObjectHandle::newName("/Page"));
+	page.replaceKey("/MediaBox", QPDFObjectHandle::newArray(QPDFObjectHandle::Rectangle(0, 0, width, height)));
+	page.replaceKey("/Resources", resources);
+	m_page = m_out.makeIndirectObject(page);
+	m_page_height = height;
+	m_content.clear();
+	m_number_of_forms = 0;
+}
+
+void PDFPageStacker::stack_page(int source, int page_number, double width, double height) {
+	assert(m_page);
+	auto it = m_forms.find({source, page_number});
+	if (it == m_forms.end()) {
+		const std::vector<QPDFPageObjectHelper>& pages = m_source_pages[source];
+		if (page_number < 0 || page_number >= (int)pages.size())
+			throw std::runtime_error("page " + std::to_string(page_number + 1) + " does not exist");
+		QPDFPageObjectHelper page = pages[page_number];
+		QPDFObjectHandle source_form = page.getFormXObjectForPage();
+		// The bounding box of the form is the TrimBox, but poppler (and thus the GUI) shows the CropBox (by default the MediaBox).
+		QPDFObjectHandle box = page.getAttribute("/CropBox", false);
+		if (!box.isRectangle())
+			box = page.getMediaBox();
+		if (box.isRectangle())
+			source_form.replaceKey("/BBox", QPDFObjectHandle::newArray(box.getArrayAsRectangle()));
+		// Copying objects from another file copies everything they refer to (once per file).
+		QPDFObjectHandle form = m_out.copyForeignObject(source_form);
+		it = m_forms.emplace(std::make_pair(source, page_number), form).first;
+	}
+	QPDFObjectHandle form = it->second;
+	std::string name = "/Fx" + std::to_string(m_number_of_forms++);
+	m_page->getKey("/Resources").getKey("/XObject").replaceKey(name, form);
+	// The form draws its bounding box, transformed by its matrix (which takes care of rotated pages).
+	double bbox[4], matrix[6] = {1, 0, 0, 1, 0, 0};
+	for (int i = 0; i < 4; i++)
+		bbox[i] = form.getKey("/BBox").getArrayItem(i).getNumericValue();
+	if (form.getKey("/Matrix").isArray()) {
+		for (int i = 0; i < 6; i++)
+			matrix[i] = form.getKey("/Matrix").getArrayItem(i).getNumericValue();
+	}
+	double left = INFINITY, bottom = INFINITY, right = -INFINITY, top = -INFINITY;
+	for (double x : {bbox[0], bbox[2]}) {
+		for (double y : {bbox[1], bbox[3]}) {
+			double tx = matrix[0] * x + matrix[2] * y + matrix[4];
+			double ty = matrix[1] * x + matrix[3] * y + matrix[5];
+			left = std::min(left, tx);
+			right = std::max(right, tx);
+			bottom = std::min(bottom, ty);
+			top = std::max(top, ty);
+		}
+	}
+	if (right <= left || top <= bottom)
+		throw std::runtime_error("page " + std::to_string(page_number + 1) + " is empty");
+	// Map that rectangle to the top left corner of the page (in PDF coordinates, y points up).
+	double sx = width / (right - left), sy = height / (top - bottom);
+	double dx = -sx * left, dy = m_page_height - height - sy * bottom;
+	m_content += QString("q\n%1 0 0 %2 %3 %4 cm\n%5 Do\nQ\n").arg(sx, 0, 'f', 6).arg(sy, 0, 'f', 6).arg(dx, 0, 'f', 4).arg(dy, 0, 'f', 4).arg(QString::fromStdString(name)).toStdString();
+}
+
+void PDFPageStacker::finish_page() {
+	if (!m_page)
+		return;
+	m_page->replaceKey("/Contents", QPDFObjectHandle::newStream(&m_out, m_content));
+	QPDFPageDocumentHelper(m_out).addPage(QPDFPageObjectHelper(*m_page), false);
+	m_page.reset();
+}
+
+void PDFPageStacker::write(const std::string& file_name) {
+	TRACE_SCOPE("PDFPageStacker::write");
+	finish_page();
+	QPDFWriter writer(m_out, file_name.c_str());
+	writer.setObjectStreamMode(qpdf_o_generate);
+	writer.write();
+}
@@ -0,0 +1,47 @@
+#ifndef PDF_PAGE_STACKER_H
+#define PDF_PAGE_STACKER_H
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <QByteArray>
+
+#include <qpdf/QPDF.hh>
+#include <qpdf/QPDFObjectHandle.hh>
+#include <qpdf/QPDFPageObjectHelper.hh>
+
+// Writes a PDF file whose pages are stacks of pages of other PDF files (using qpdf).
+// The pages are copied as they are (as form XObjects), so nothing is re-encoded, and resources shared by several pages of a file (like fonts and images) are written only once.
+// All functions throw an exception (derived from std::exception) if qpdf cannot read or write a file.
+class PDFPageStacker {
+public:
+	PDFPageStacker();
+	// Makes the PDF file available as a source of pages and returns its index.
+	int add_source(const QByteArray& contents, const std::string& description);
+	// Starts a new page of the given size (in points).
+	void add_page(double width, double height);
+	// Draws a page of a source on top of the current page. It is scaled to the given size (in points) and placed at the top left corner.
+	void stack_page(int source, int page_number, double width, double height);
+	void write(const std::string& file_name);
+
+private:
+	void finish_page();
+
+	QPDF m_out;
+	std::vector<std::unique_ptr<QPDF> > m_sources;
+	std::vector<QByteArray> m_source_contents;  // The buffers read by m_sources
+	std::vector<std::vector<QPDFPageObjectHelper> > m_source_pages;
+	// The pages of the sources that have already been copied to m_out, by source and page number
+	std::map<std::pair<int, int>, QPDFObjectHandle> m_forms;
+
+	// The current page
+	std::optional<QPDFObjectHandle> m_page;
+	double m_page_height = 0;
+	std::string m_content;
+	int m_number_of_forms = 0;  // On the current page
+};
+
+#endif  // PDF_PAGE_STACKER_H
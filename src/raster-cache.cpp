@@ -0,0 +1,175 @@
+#include "raster-cache.h"
+
+#include "document.h"
+#include "trace.h"
+
+#include <utime.h>
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+
+namespace {
+
+// Increase this whenever the rendering changes, so that old images are not used anymore.
+const int FORMAT_VERSION = 1;
+// Images waiting to be written. If the writer falls behind (e.g. while resizing the window), further images are not stored.
+const size_t MAX_QUEUED_IMAGES = 8;
+
+void add_int(QCryptographicHash& hash, qint64 value) {
+	hash.addData((const char*)&value, sizeof(value));
+}
+
+void add_parameters(QCryptographicHash& hash, char kind, QSize image_size, double unit2pixel) {
+	add_int(hash, FORMAT_VERSION);
+	hash.addData(&kind, 1);
+	add_int(hash, image_size.width());
+	add_int(hash, image_size.height());
+	hash.addData((const char*)&unit2pixel, sizeof(unit2pixel));
+}
+
+}  // namespace
+
+std::unique_ptr<RasterCache> raster_cache_singleton;
+
+RasterCache* RasterCache::self() {
+	if (!raster_cache_singleton)
+		raster_cache_singleton.reset(new RasterCache);
+	return raster_cache_singleton.get();
+}
+
+RasterCache::RasterCache() :
+    m_thread(&RasterCache::run, this) {
+}
+
+RasterCache::~RasterCache() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_condition.notify_one();
+	m_thread.join();  // Writes the queued images first.
+}
+
+void RasterCache::configure(const QString& directory, qint64 max_size) {
+	if (max_size > 0 && !QDir().mkpath(directory)) {
+		qDebug() << "Cannot create the raster cache directory" << directory;
+		max_size = 0;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_directory = directory;
+		m_max_size = max_size;
+		m_queue.emplace_back();  // Without an image: Only prune (the size may have decreased).
+	}
+	m_condition.notify_one();
+}
+
+bool RasterCache::enabled() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_max_size > 0;
+}
+
+QByteArray RasterCache::key(const NormalLayer* layer, QSize image_size, double unit2pixel, Renderer::Backend backend) {
+	TRACE_SCOPE("RasterCache::key");
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+	add_parameters(hash, 'N', image_size, unit2pixel);
+	add_int(hash, (int)backend);
+	add_int(hash, layer->strokes().size());
+	for (ptr_Stroke stroke : layer->strokes()) {
+		std::visit(overloaded{[&](PenStroke* st) {
+			                      hash.addData("P", 1);
+			                      add_int(hash, st->width());
+			                      add_int(hash, st->color().x);
+		                      },
+		                      [&](EraserStroke* st) {
+			                      hash.addData("E", 1);
+			                      add_int(hash, st->width());
+		                      }},
+		           stroke);
+		const std::vector<Point>& points = convert_variant<PathStroke*>(stroke)->points();
+		add_int(hash, points.size());
+		static_assert(sizeof(Point) == 2 * sizeof(int));
+		hash.addData((const char*)points.data(), points.size() * sizeof(Point));
+	}
+	return hash.result();
+}
+
+QByteArray RasterCache::key(const PDFLayer* layer, QSize image_size, double unit2pixel) {
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+	add_parameters(hash, 'D', image_size, unit2pixel);
+	hash.addData(layer->pdf()->content_hash());
+	add_int(hash, layer->page_number());
+	return hash.result();
+}
+
+QString RasterCache::file_name(const QString& directory, const QByteArray& key) const {
+	return directory + "/" + QString::fromLatin1(key.toHex()) + ".png";
+}
+
+QImage RasterCache::load(const QByteArray& key, QSize image_size) {
+	QString directory;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_max_size <= 0)
+			return QImage();
+		directory = m_directory;
+	}
+	TRACE_SCOPE("RasterCache::load");
+	QString name = file_name(directory, key);
+	QImage image;
+	if (!image.load(name, "PNG") || image.size() != image_size)
+		return QImage();
+	// Mark the file as recently used.
+	utime(QFile::encodeName(name).constData(), nullptr);
+	return image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+}
+
+void RasterCache::store(const QByteArray& key, const QImage& image) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_max_size <= 0 || m_queue.size() >= MAX_QUEUED_IMAGES)
+			return;
+		// The image may share its pixels with a surface that is going to change.
+		m_queue.push_back(Job{key, image.copy()});
+	}
+	m_condition.notify_one();
+}
+
+void RasterCache::run() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_condition.wait(lock, [this]() { return m_quit || !m_queue.empty(); });
+		if (m_queue.empty())
+			return;  // m_quit
+		Job job = std::move(m_queue.front());
+		m_queue.pop_front();
+		QString directory = m_directory;
+		qint64 max_size = m_max_size;
+		lock.unlock();
+		if (max_size > 0) {
+			if (!job.image.isNull()) {
+				TRACE_SCOPE("RasterCache::store");
+				// Write to a temporary file first, so that a concurrent load never sees a partial file.
+				QSaveFile file(file_name(directory, job.key));
+				if (!file.open(QIODevice::WriteOnly) || !job.image.save(&file, "PNG") || !file.commit())
+					qDebug() << "Cannot write" << file.fileName() << ":" << file.errorString();
+			}
+			prune(directory, max_size);
+		}
+		lock.lock();
+	}
+}
+
+void RasterCache::prune(const QString& directory, qint64 max_size) {
+	// Newest first
+	QFileInfoList files = QDir(directory).entryInfoList({"*.png"}, QDir::Files, QDir::Time);
+	qint64 total = 0;
+	for (const QFileInfo& info : files) {
+		total += info.size();
+		if (total > max_size)
+			QFile::remove(info.filePath());
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef RASTER_CACHE_H
+#define RASTER_CACHE_H
+
+#include "all-types.h"
+#include "renderer.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <QByteArray>
+#include <QImage>
+#include <QString>
+
+// Rendered layer images on disk, so that reopening a document (or switching back to a page) does not need to rasterize the strokes or the PDF page again.
+// An image is identified by a hash of everything that determines its pixels: the contents of the layer and the scale. So an entry never becomes wrong; it just isn't used anymore once the layer changes.
+// The total size of the files is bounded. When it is exceeded, the least recently used files are deleted.
+// Files are written (and the cache is pruned) in a separate thread.
+class RasterCache {
+public:
+	static RasterCache* self();
+
+private:
+	RasterCache();
+
+public:
+	~RasterCache();
+
+	// Uses the given directory with the given maximal size (in bytes). A size of 0 disables the cache.
+	void configure(const QString& directory, qint64 max_size);
+	bool enabled() const;
+
+	// Keys of layer images of the given size in pixels (image_size = unit2pixel * page size). The renderer backend is included because the backends differ slightly.
+	static QByteArray key(const NormalLayer* layer, QSize image_size, double unit2pixel, Renderer::Backend backend);
+	static QByteArray key(const PDFLayer* layer, QSize image_size, double unit2pixel);
+
+	// The stored image (in Format_ARGB32_Premultiplied) or a null image if there is none of the given size.
+	QImage load(const QByteArray& key, QSize image_size);
+	// Stores a copy of the image in the background.
+	void store(const QByteArray& key, const QImage& image);
+
+private:
+	QString file_name(const QString& directory, const QByteArray& key) const;
+	void run();
+	void prune(const QString& directory, qint64 max_size);
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_condition;
+	QString m_directory;
+	qint64 m_max_size = 0;
+	struct Job {
+		QByteArray key;
+		QImage image;
+	};
+	std::deque<Job> m_queue;
+	bool m_quit = false;
+	std::thread m_thread;
+};
+
+#endif  // RASTER_CACHE_H
@@ -0,0 +1,249 @@
+#include "raw-pen-capture.h"
+
+#include "settings.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <QDebug>
+#include <X11/extensions/XInput2.h>
+
+namespace {
+
+// What we need to know about a tablet to turn its raw coordinates into screen coordinates.
+struct RawDevice {
+	double min[2] = {0, 0};
+	double max[2] = {1, 1};
+	float matrix[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};  // Coordinate transformation matrix (row-major)
+	double value[2] = {0, 0};  // The last raw coordinates
+	bool pressed = false;  // Whether the pen touches the tablet (button 1)
+};
+
+void read_matrix(Display* display, int device_id, Atom matrix_atom, Atom float_atom, RawDevice& device) {
+	Atom type;
+	int format;
+	unsigned long nitems, bytes_after;
+	unsigned char* data = nullptr;
+	if (XIGetProperty(display, device_id, matrix_atom, 0, 9, False, float_atom, &type, &format, &nitems, &bytes_after, &data) == Success) {
+		if (type == float_atom && format == 32 && nitems == 9) {
+			static_assert(sizeof(float) == 4);
+			std::copy((float*)data, (float*)data + 9, device.matrix);
+		}
+		XFree(data);
+	}
+}
+
+std::map<int, RawDevice> query_devices(Display* display, const std::set<QString>& names, Atom matrix_atom, Atom float_atom) {
+	std::map<int, RawDevice> devices;
+	int ndevices;
+	XIDeviceInfo* info = XIQueryDevice(display, XIAllDevices, &ndevices);
+	for (int i = 0; i < ndevices; i++) {
+		XIDeviceInfo* device = &info[i];
+		if (device->use != XISlavePointer || !names.count(device->name))
+			continue;
+		RawDevice& raw_device = devices[device->deviceid];
+		for (int j = 0; j < device->num_classes; j++) {
+			if (device->classes[j]->type != XIValuatorClass)
+				continue;
+			XIValuatorClassInfo* valuator = (XIValuatorClassInfo*)device->classes[j];
+			if (valuator->number < 2 && valuator->max > valuator->min) {
+				raw_device.min[valuator->number] = valuator->min;
+				raw_device.max[valuator->number] = valuator->max;
+			}
+		}
+		read_matrix(display, device->deviceid, matrix_atom, float_atom, raw_device);
+	}
+	XIFreeDeviceInfo(info);
+	return devices;
+}
+
+// Does what the X server does with the coordinates of an absolute device: Normalize to [0,1], apply the transformation matrix, scale to the screen.
+QPointF screen_position(const RawDevice& device, int screen_width, int screen_height) {
+	double x = (device.value[0] - device.min[0]) / (device.max[0] - device.min[0]);
+	double y = (device.value[1] - device.min[1]) / (device.max[1] - device.min[1]);
+	const float* m = device.matrix;
+	double w = m[6] * x + m[7] * y + m[8];
+	return QPointF((m[0] * x + m[1] * y + m[2]) / w * screen_width, (m[3] * x + m[4] * y + m[5]) / w * screen_height);
+}
+
+}  // namespace
+
+std::unique_ptr<RawPenCapture> raw_pen_capture_singleton;
+
+RawPenCapture* RawPenCapture::self() {
+	if (!raw_pen_capture_singleton)
+		raw_pen_capture_singleton.reset(new RawPenCapture);
+	return raw_pen_capture_singleton.get();
+}
+
+RawPenCapture::RawPenCapture() {
+	connect(Settings::self(), &Settings::configChanged, this, &RawPenCapture::update_from_settings);
+}
+
+RawPenCapture::~RawPenCapture() {
+	stop();
+}
+
+void RawPenCapture::update_from_settings() {
+	auto names = std::make_unique<std::set<QString> >();
+	for (const TabletSettings& tablet : Settings::self()->tablets()) {
+		if (tablet.enabled)
+			names->insert(tablet.name);
+	}
+	m_device_names.publish(std::move(names));
+	if (Settings::self()->rawPenInput())
+		start();
+	else
+		stop();
+	wake();
+}
+
+void RawPenCapture::take_samples(std::vector<PenSample>& samples) {
+	PenSample sample;
+	while (m_samples.pop(sample))
+		samples.push_back(sample);
+}
+
+void RawPenCapture::start() {
+	if (m_thread.joinable())
+		return;
+	m_quit = false;
+	m_wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (m_wake_fd == -1) {
+		// Without a way to wake the thread, stop() could never join it.
+		qDebug() << "Cannot create an eventfd:" << strerror(errno) << "Not capturing raw pen input.";
+		return;
+	}
+	m_thread = std::thread(&RawPenCapture::run, this);
+}
+
+void RawPenCapture::stop() {
+	if (!m_thread.joinable())
+		return;
+	m_quit = true;
+	wake();
+	m_thread.join();
+	close(m_wake_fd);
+	m_wake_fd = -1;
+}
+
+void RawPenCapture::wake() {
+	if (m_wake_fd == -1)
+		return;
+	uint64_t one = 1;
+	if (write(m_wake_fd, &one, sizeof(one)) != sizeof(one))
+		qDebug() << "Cannot wake up the pen capture thread.";
+}
+
+void RawPenCapture::run() {
+	Display* display = XOpenDisplay(nullptr);
+	if (!display) {
+		qDebug() << "No X11 display!";
+		return;
+	}
+	int xi_opcode, event, error;
+	int major = 2, minor = 2;
+	// Since XInput 2.1, raw events are delivered to the root window even while another client (Qt) has grabbed the device.
+	if (!XQueryExtension(display, "XInputExtension", &xi_opcode, &event, &error) || XIQueryVersion(display, &major, &minor) != Success || major * 100 + minor < 202) {
+		qDebug() << "X Input extension 2.2 not available. Not capturing raw pen input.";
+		XCloseDisplay(display);
+		return;
+	}
+	Atom matrix_atom = XInternAtom(display, "Coordinate Transformation Matrix", False);
+	Atom float_atom = XInternAtom(display, "FLOAT", False);
+	unsigned char mask_bits[XIMaskLen(XI_LASTEVENT)] = {};
+	XISetMask(mask_bits, XI_RawMotion);
+	XISetMask(mask_bits, XI_RawButtonPress);
+	XISetMask(mask_bits, XI_RawButtonRelease);
+	XISetMask(mask_bits, XI_HierarchyChanged);
+	XISetMask(mask_bits, XI_PropertyEvent);
+	XIEventMask mask;
+	mask.deviceid = XIAllDevices;
+	mask.mask_len = sizeof(mask_bits);
+	mask.mask = mask_bits;
+	XISelectEvents(display, DefaultRootWindow(display), &mask, 1);
+
+	std::set<QString> names;
+	std::map<int, RawDevice> devices;
+	bool devices_valid = false;
+	int screen_width = 1, screen_height = 1;
+	size_t dropped = 0;
+	m_active.store(true, std::memory_order_release);
+	while (!m_quit) {
+		if (std::unique_ptr<std::set<QString> > new_names = m_device_names.take()) {
+			names = std::move(*new_names);
+			devices_valid = false;
+		}
+		if (!devices_valid) {
+			devices = query_devices(display, names, matrix_atom, float_atom);
+			screen_width = DisplayWidth(display, DefaultScreen(display));
+			screen_height = DisplayHeight(display, DefaultScreen(display));
+			devices_valid = true;
+		}
+		while (XPending(display)) {
+			XEvent event;
+			XNextEvent(display, &event);
+			XGenericEventCookie* cookie = &event.xcookie;
+			if (cookie->type != GenericEvent || cookie->extension != xi_opcode || !XGetEventData(display, cookie))
+				continue;
+			if (cookie->evtype == XI_RawMotion || cookie->evtype == XI_RawButtonPress || cookie->evtype == XI_RawButtonRelease) {
+				XIRawEvent* raw = (XIRawEvent*)cookie->data;
+				auto it = devices.find(raw->deviceid);
+				if (it != devices.end()) {
+					RawDevice& device = it->second;
+					const double* value = raw->raw_values;
+					for (int i = 0; i < raw->valuators.mask_len * 8; i++) {
+						if (XIMaskIsSet(raw->valuators.mask, i)) {
+							if (i < 2)
+								device.value[i] = *value;
+							value++;
+						}
+					}
+					if (cookie->evtype == XI_RawButtonPress && raw->detail == 1) {
+						device.pressed = true;
+						m_last_press_time.store(raw->time, std::memory_order_release);
+						m_pressed.store(true, std::memory_order_release);
+					}
+					if (device.pressed) {
+						PenSample sample{screen_position(device, screen_width, screen_height), raw->time, LatencyMonitor::Clock::now()};
+						if (!m_samples.push(sample) && ++dropped % 1000 == 1)
+							qDebug() << "Raw pen sample queue is full. Dropped" << dropped << "samples.";
+					}
+					if (cookie->evtype == XI_RawButtonRelease && raw->detail == 1) {
+						device.pressed = false;
+						m_pressed.store(std::any_of(devices.begin(), devices.end(), [](const auto& d) {
+							                return d.second.pressed;
+						                }),
+						                std::memory_order_release);
+					}
+				}
+			} else if (cookie->evtype == XI_HierarchyChanged) {
+				devices_valid = false;
+			} else if (cookie->evtype == XI_PropertyEvent) {
+				XIPropertyEvent* property = (XIPropertyEvent*)cookie->data;
+				auto it = devices.find(property->deviceid);
+				if (property->property == matrix_atom && it != devices.end())
+					read_matrix(display, property->deviceid, matrix_atom, float_atom, it->second);
+			}
+			XFreeEventData(display, cookie);
+		}
+		if (!devices_valid)
+			continue;
+		XFlush(display);
+		pollfd fds[2] = {{m_wake_fd, POLLIN, 0}, {ConnectionNumber(display), POLLIN, 0}};
+		poll(fds, 2, -1);
+		if (fds[0].revents & POLLIN) {
+			uint64_t count;
+			if (read(m_wake_fd, &count, sizeof(count)) != sizeof(count))
+				qDebug() << "Cannot read from the pen capture thread's eventfd.";
+		}
+	}
+	m_active.store(false, std::memory_order_release);
+	XCloseDisplay(display);
+}
@@ -0,0 +1,101 @@
+#ifndef RAW_PEN_CAPTURE_H
+#define RAW_PEN_CAPTURE_H
+
+#include "latency-monitor.h"
+#include "util.h"
+
+#include <array>
+#include <atomic>
+#include <set>
+#include <thread>
+
+#include <QObject>
+#include <QPointF>
+
+// A pen position reported by the X server while the pen touches the tablet.
+struct PenSample {
+	QPointF pos;  // Position on the screen in (native) pixels
+	unsigned long time;  // X server time in milliseconds (comparable to QTabletEvent::timestamp())
+	LatencyMonitor::Clock::time_point received;  // When we received the sample
+};
+
+// A lock-free queue with one producer thread and one consumer thread.
+// If the queue is full, new elements are dropped.
+template <class T, size_t CAPACITY>
+class SPSCRing {
+	static_assert((CAPACITY & (CAPACITY - 1)) == 0, "The capacity must be a power of two.");
+
+public:
+	// Returns false if the queue is full.
+	bool push(const T& value) {
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if (head - m_tail.load(std::memory_order_acquire) == CAPACITY)
+			return false;
+		m_buffer[head & (CAPACITY - 1)] = value;
+		m_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+	// Returns false if the queue is empty.
+	bool pop(T& value) {
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail == m_head.load(std::memory_order_acquire))
+			return false;
+		value = m_buffer[tail & (CAPACITY - 1)];
+		m_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::array<T, CAPACITY> m_buffer;
+	alignas(64) std::atomic<size_t> m_head{0};  // Written by the producer
+	alignas(64) std::atomic<size_t> m_tail{0};  // Written by the consumer
+};
+
+// Reads the raw motion events of the configured tablets directly from the X server in a separate thread (if enabled in the settings).
+// Qt delivers tablet events on the GUI thread, where they wait behind painting and may be compressed. This thread never waits for the GUI, so no samples are lost.
+// The samples are queued until the page widget takes them (once per frame).
+class RawPenCapture : public QObject {
+	Q_OBJECT
+public:
+	static RawPenCapture* self();
+
+private:
+	RawPenCapture();
+
+public:
+	~RawPenCapture();
+
+	// Starts or stops the thread and updates the list of devices according to the settings.
+	void update_from_settings();
+	// Whether samples are being captured.
+	bool active() const {
+		return m_active.load(std::memory_order_acquire);
+	}
+	// Whether the pen of one of the captured devices was pressed at or after the given X server time.
+	// Pens of other devices (which are not enabled in the settings or whose names don't match) are only seen through Qt's events.
+	bool captured_press_since(unsigned long time) const {
+		return m_pressed.load(std::memory_order_acquire) && m_last_press_time.load(std::memory_order_acquire) >= time;
+	}
+	// Appends all queued samples.
+	void take_samples(std::vector<PenSample>& samples);
+
+private:
+	void start();
+	void stop();
+	void wake();
+	void run();
+
+	std::thread m_thread;
+	int m_wake_fd = -1;
+	std::atomic<bool> m_quit{false};
+	std::atomic<bool> m_active{false};
+	// Whether the pen of a captured device is pressed, and the X server time of the last press
+	std::atomic<bool> m_pressed{false};
+	std::atomic<unsigned long> m_last_press_time{0};
+	// Names of the devices whose samples we capture.
+	LatestValueSlot<std::set<QString> > m_device_names;
+	// About 8 seconds at 1000 samples per second
+	SPSCRing<PenSample, 8192> m_samples;
+};
+
+#endif  // RAW_PEN_CAPTURE_H
@@ -3,8 +3,24 @@
 #include "cairo-helpers.h"
 #include "all-types.h"
 #include "document.h"
+#include "eraser-clip.h"
+#include "pdf-page-stacker.h"
+#include "raster-cache.h"
+#include "scanline-rasterizer.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <stdexcept>
 
 #include <QDebug>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QTemporaryFile>
+#include <QThread>
+#include <QThreadPool>
 
 // The header poppler.h defines a variable called signals, which is a qt keyword.
 #undef signals
@@ -36,8 +52,71 @@ void construct_path(Cairo::RefPtr<Cairo::Context> cr, const std::vector<Point>&
 	}
 }
 
-Renderer::Renderer(const PictureTransformation& transformation) :
-    m_transformation(transformation) {
+// Same as construct_path, but with points that are already in pixel coordinates.
+static void construct_device_path(Cairo::RefPtr<Cairo::Context> cr, const std::vector<QPointF>& points) {
+	assert(!points.empty());
+	cr->move_to(points[0].x(), points[0].y());
+	if (points.size() == 1) {
+		cr->line_to(points[0].x(), points[0].y());
+	} else {
+		for (size_t i = 1; i < points.size(); i++)
+			cr->line_to(points[i].x(), points[i].y());
+	}
+}
+
+// Simplifying the path by less than this (in pixels) makes no visible difference.
+static const double MAX_PIXEL_ERROR = 0.25;
+
+std::shared_ptr<const std::vector<QPointF> > DevicePathCache::get(const PathStroke* stroke) {
+	size_t number_of_points = stroke->points().size();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_entries.find(stroke);
+		if (it != m_entries.end() && it->second.number_of_points == number_of_points)
+			return it->second.points;
+	}
+	// Compute the points without holding the lock, so that other threads can continue.
+	// When the page is drawn small, many points fall onto the same pixel. A simplified path (level of detail) looks the same.
+	std::shared_ptr<const std::vector<Point> > source = stroke->simplified_points(MAX_PIXEL_ERROR / m_unit2pixel);
+	auto points = std::make_shared<std::vector<QPointF> >();
+	points->reserve(source->size());
+	for (Point p : *source) {
+		QPointF q(p.x * m_unit2pixel, p.y * m_unit2pixel);
+		if (points->empty() || points->back() != q)  // Consecutive equal points don't change the path.
+			points->push_back(q);
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Entry& entry = m_entries[stroke];
+	if (entry.points)
+		m_bytes -= entry.points->capacity() * sizeof(QPointF);
+	entry.number_of_points = number_of_points;
+	entry.points = points;
+	m_bytes += points->capacity() * sizeof(QPointF);
+	return points;
+}
+
+void DevicePathCache::remove(const PathStroke* stroke) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_entries.find(stroke);
+	if (it == m_entries.end())
+		return;
+	m_bytes -= it->second.points->capacity() * sizeof(QPointF);
+	m_entries.erase(it);
+}
+
+size_t DevicePathCache::memory_usage() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_bytes + m_entries.size() * (sizeof(const PathStroke*) + sizeof(Entry));
+}
+
+Renderer::Backend Renderer::default_backend() {
+	static const Backend backend = qgetenv("SAUKLAUE_RASTERIZER") == "scanline" ? Backend::Scanline : Backend::Cairo;
+	return backend;
+}
+
+Renderer::Renderer(const PictureTransformation& transformation, Backend backend) :
+    m_transformation(transformation),
+    m_backend(backend) {
 	cairo_surface = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, transformation.image_size.width(), transformation.image_size.height());
 	cr = Cairo::Context::create(cairo_surface);
 	// 	cr->set_antialias(Cairo::ANTIALIAS_GRAY);
@@ -46,6 +125,19 @@ Renderer::Renderer(const PictureTransformation& transformation) :
 	set_transparent();
 }
 
+Renderer::Renderer(Renderer& full, int top, int bottom) :
+    m_transformation(full.m_transformation),
+    m_backend(full.m_backend),
+    m_top(top) {
+	int stride = full.cairo_surface->get_stride();
+	cairo_surface = Cairo::ImageSurface::create(full.cairo_surface->get_data() + (size_t)top * stride, Cairo::FORMAT_ARGB32, full.cairo_surface->get_width(), bottom - top, stride);
+	cr = Cairo::Context::create(cairo_surface);
+	cr->set_line_cap(Cairo::LINE_CAP_ROUND);
+	cr->set_line_join(Cairo::LINE_JOIN_ROUND);
+	// A pure translation doesn't disturb stroke extents (see construct_path).
+	cr->translate(0, -top);
+}
+
 void Renderer::set_transparent(std::optional<QRect> rect) {
 	CairoGroup cg(cr);
 	if (rect) {
@@ -62,6 +154,28 @@ QImage Renderer::img() const {
 	return QImage((const uchar*)cairo_surface->get_data(), cairo_surface->get_width(), cairo_surface->get_height(), QImage::Format_ARGB32_Premultiplied);
 }
 
+// Replaces the pixels of the surface in the rectangle at the given position by those of an image in Format_ARGB32_Premultiplied (which has the same memory layout as cairo's FORMAT_ARGB32).
+static void copy_image_to_surface(const QImage& image, Cairo::RefPtr<Cairo::ImageSurface> surface, QPoint position = QPoint(0, 0)) {
+	assert(image.format() == QImage::Format_ARGB32_Premultiplied);
+	assert(surface->get_format() == Cairo::FORMAT_ARGB32);
+	assert(QRect(0, 0, surface->get_width(), surface->get_height()).contains(QRect(position, image.size())));
+	surface->flush();
+	unsigned char* data = surface->get_data();
+	int stride = surface->get_stride();
+	for (int y = 0; y < image.height(); y++)
+		memcpy(data + (size_t)(position.y() + y) * stride + 4 * (size_t)position.x(), image.constScanLine(y), 4 * (size_t)image.width());
+	surface->mark_dirty(position.x(), position.y(), image.width(), image.height());
+}
+
+void Renderer::load_image(const QImage& image, QPoint position) {
+	copy_image_to_surface(image, cairo_surface, position);
+}
+
+QImage Renderer::copy_rect(const QRect& rect) const {
+	assert(QRect(0, 0, cairo_surface->get_width(), cairo_surface->get_height()).contains(rect));
+	return img().copy(rect);
+}
+
 void Renderer::copy_from(const Renderer& other_renderer, std::optional<QRect> rect) {
 	Cairo::RefPtr<Cairo::ImageSurface> other_surface = other_renderer.cairo_surface;
 	assert(cairo_surface->get_format() == Cairo::FORMAT_ARGB32);
@@ -89,6 +203,9 @@ void Renderer::copy_from(const Renderer& other_renderer, std::optional<QRect> re
 }
 
 QRect Renderer::draw_stroke(ptr_Stroke stroke, std::optional<QRect> clip_rect) {
+	TRACE_SCOPE("Renderer::draw_stroke");
+	if (m_backend == Backend::Scanline)
+		return draw_stroke_scanline(stroke, clip_rect);
 	CairoGroup cg(cr);
 	if (clip_rect) {
 		cr->rectangle(clip_rect->left(), clip_rect->top(), clip_rect->width(), clip_rect->height());
@@ -100,7 +217,163 @@ QRect Renderer::draw_stroke(ptr_Stroke stroke, std::optional<QRect> clip_rect) {
 	return rect;
 }
 
+QRect Renderer::draw_stroke_scanline(ptr_Stroke stroke, std::optional<QRect> clip_rect) {
+	const PathStroke* path = convert_variant<PathStroke*>(stroke);
+	double width = std::visit([](auto* st) { return st->width(); }, stroke) * m_transformation.unit2pixel;
+	std::optional<Color> color;
+	if (const PenStroke* const* pen = std::get_if<PenStroke*>(&stroke))
+		color = (*pen)->color();
+	cairo_surface->flush();
+	ScanlineRasterizer::Image image{cairo_surface->get_data(), cairo_surface->get_width(), cairo_surface->get_height(), cairo_surface->get_stride(), m_top};
+	ScanlineRasterizer::draw(image, path->points(), m_transformation.unit2pixel, width, color, clip_rect);
+	QRect rect = ScanlineRasterizer::extents(path->points(), m_transformation.unit2pixel, width);
+	QRect dirty = rect & QRect(0, m_top, image.width, image.height);
+	if (clip_rect)
+		dirty &= *clip_rect;
+	if (!dirty.isEmpty())
+		cairo_surface->mark_dirty(dirty.left(), dirty.top() - m_top, dirty.width(), dirty.height());
+	return rect;
+}
+
+void Renderer::draw_strokes(const std::vector<ptr_Stroke>& all_strokes, std::optional<QRect> clip_rect, DevicePathCache* cache) {
+	TRACE_SCOPE("Renderer::draw_strokes");
+	// Skip the strokes that cannot touch the clip rectangle. (Leaving them out doesn't change the order of the remaining strokes.)
+	std::vector<ptr_Stroke> clipped_strokes;
+	if (clip_rect) {
+		for (ptr_Stroke stroke : all_strokes) {
+			if (pixel_bounds(stroke).intersects(*clip_rect))
+				clipped_strokes.push_back(stroke);
+		}
+	}
+	const std::vector<ptr_Stroke>& strokes = clip_rect ? clipped_strokes : all_strokes;
+	if (m_backend == Backend::Scanline) {
+		// There is no per-call overhead worth batching.
+		for (ptr_Stroke stroke : strokes)
+			draw_stroke_scanline(stroke, clip_rect);
+		return;
+	}
+	CairoGroup cg(cr);
+	if (clip_rect) {
+		cr->rectangle(clip_rect->left(), clip_rect->top(), clip_rect->width(), clip_rect->height());
+		cr->clip();
+	}
+	// Each stroke of a batch is compared with the previous ones, so batches are kept short.
+	const size_t MAX_BATCH = 32;
+	std::vector<QRect> batch_bounds;
+	size_t i = 0;
+	while (i < strokes.size()) {
+		CairoGroup cg2(cr);
+		setup_stroke(strokes[i], cache);
+		batch_bounds.assign(1, pixel_bounds(strokes[i]));
+		size_t j = i + 1;
+		for (; j < strokes.size() && j - i < MAX_BATCH && can_draw_together(strokes[i], strokes[j]); j++) {
+			QRect bounds = pixel_bounds(strokes[j]);
+			if (std::any_of(batch_bounds.begin(), batch_bounds.end(), [&](const QRect& b) { return b.intersects(bounds); }))
+				break;
+			batch_bounds.push_back(bounds);
+			append_path(strokes[j], cache);
+		}
+		cr->stroke();
+		i = j;
+	}
+}
+
+namespace {
+
+class BandJob : public QRunnable {
+public:
+	explicit BandJob(std::function<void()> fn) :
+	    m_fn(std::move(fn)) {}
+	void run() override {
+		m_fn();
+	}
+
+private:
+	std::function<void()> m_fn;
+};
+
+// Persistent threads for draw_strokes_parallel, so that a redraw doesn't pay for starting threads.
+QThreadPool& band_pool() {
+	// Never destroyed, so that it doesn't outlive the QCoreApplication during static destruction.
+	static QThreadPool* pool = [] {
+		QThreadPool* p = new QThreadPool;
+		// The calling thread draws as well.
+		p->setMaxThreadCount(std::max(1, QThread::idealThreadCount() - 1));
+		return p;
+	}();
+	return *pool;
+}
+
+}  // namespace
+
+void Renderer::draw_strokes_parallel(const std::vector<ptr_Stroke>& strokes, std::optional<QRect> clip_rect, DevicePathCache* cache) {
+	TRACE_SCOPE("Renderer::draw_strokes_parallel");
+	// Below these sizes, handing the bands to other threads costs more than it saves.
+	const size_t MIN_STROKES = 64;
+	const int MIN_BAND_HEIGHT = 32;
+	// More bands than threads, so that a band with many strokes doesn't keep the other threads waiting.
+	const int BANDS_PER_THREAD = 4;
+	QRect area(0, 0, cairo_surface->get_width(), cairo_surface->get_height());
+	if (clip_rect)
+		area &= *clip_rect;
+	int threads = QThread::idealThreadCount();
+	int bands = std::min(threads * BANDS_PER_THREAD, area.height() / MIN_BAND_HEIGHT);
+	if (threads <= 1 || bands <= 1 || strokes.size() < MIN_STROKES || m_top != 0) {
+		draw_strokes(strokes, clip_rect, cache);
+		return;
+	}
+	cairo_surface->flush();
+	std::atomic<int> next_band(0);
+	auto worker = [&]() {
+		for (int band = next_band++; band < bands; band = next_band++) {
+			TRACE_SCOPE("Renderer::draw_strokes_parallel band");
+			int top = area.top() + area.height() * band / bands;
+			int bottom = area.top() + area.height() * (band + 1) / bands;
+			Renderer band_renderer(*this, top, bottom);
+			band_renderer.draw_strokes(strokes, QRect(area.left(), top, area.width(), bottom - top), cache);
+			band_renderer.cairo_surface->flush();
+		}
+	};
+	// The calling thread draws bands as well, and waits until every helper has finished.
+	int helpers = std::min(threads, bands) - 1;
+	QSemaphore finished;
+	for (int i = 0; i < helpers; i++)
+		band_pool().start(new BandJob([&]() {
+			worker();
+			finished.release();
+		}));
+	worker();
+	finished.acquire(helpers);
+	cairo_surface->mark_dirty(area.left(), area.top(), area.width(), area.height());
+}
+
+QRect Renderer::pixel_bounds(ptr_Stroke stroke) const {
+	QRect box = convert_variant<PathStroke*>(stroke)->bounding_box();
+	double unit2pixel = m_transformation.unit2pixel;
+	double r = std::visit([](auto* st) { return st->width(); }, stroke) * unit2pixel / 2;
+	// The same margin as current_stroke_extents
+	return QRect(QPoint((int)(box.left() * unit2pixel - r) - 1, (int)(box.top() * unit2pixel - r) - 1), QPoint((int)(box.right() * unit2pixel + r) + 2, (int)(box.bottom() * unit2pixel + r) + 2));
+}
+
+bool Renderer::can_draw_together(ptr_Stroke a, ptr_Stroke b) {
+	return std::visit(overloaded{[](const PenStroke* a, const PenStroke* b) {
+		                             return a->width() == b->width() && a->color().x == b->color().x && a->color().a() == 1;
+	                             },
+	                             [](const EraserStroke* a, const EraserStroke* b) {
+		                             return a->width() == b->width();
+	                             },
+	                             [](const auto*, const auto*) {
+		                             return false;
+	                             }},
+	                  a, b);
+}
+
 QRect Renderer::stroke_extents(ptr_Stroke stroke) {
+	if (m_backend == Backend::Scanline) {
+		const PathStroke* path = convert_variant<PathStroke*>(stroke);
+		double width = std::visit([](auto* st) { return st->width(); }, stroke) * m_transformation.unit2pixel;
+		return ScanlineRasterizer::extents(path->points(), m_transformation.unit2pixel, width);
+	}
 	CairoGroup cg(cr);
 	setup_stroke(stroke);
 	QRect rect = current_stroke_extents();
@@ -108,7 +381,7 @@ QRect Renderer::stroke_extents(ptr_Stroke stroke) {
 	return rect;
 }
 
-void Renderer::setup_stroke(ptr_Stroke stroke) {
+void Renderer::setup_stroke(ptr_Stroke stroke, DevicePathCache* cache) {
 	double unit2pixel = m_transformation.unit2pixel;
 	std::visit(overloaded{[&](const PenStroke* st) {
 		                      cr->set_line_width(st->width() * unit2pixel);
@@ -122,8 +395,15 @@ void Renderer::setup_stroke(ptr_Stroke stroke) {
 		                      cr->set_operator(Cairo::OPERATOR_SOURCE);
 	                      }},
 	           stroke);
+	append_path(stroke, cache);
+}
+
+void Renderer::append_path(ptr_Stroke stroke, DevicePathCache* cache) {
 	PathStroke* path_stroke = convert_variant<PathStroke*>(stroke);
-	construct_path(cr, path_stroke->points(), unit2pixel);
+	if (cache)
+		construct_device_path(cr, *cache->get(path_stroke));
+	else
+		construct_path(cr, path_stroke->points(), m_transformation.unit2pixel);
 }
 
 QRect Renderer::current_stroke_extents() {
@@ -136,17 +416,58 @@ DrawingLayerPicture::DrawingLayerPicture(std::variant<NormalLayer*, TemporaryLay
     LayerPicture(transformation),
     committed_strokes(transformation),
     all_strokes(transformation),
+    m_path_cache(transformation.unit2pixel),
     m_layer(layer) {
 	connect(convert_variant<DrawingLayer*>(layer), &DrawingLayer::stroke_added, this, &DrawingLayerPicture::stroke_added);
 	connect(convert_variant<DrawingLayer*>(layer), &DrawingLayer::stroke_deleted, this, &DrawingLayerPicture::stroke_deleted);
+	if (NormalLayer* const* normal_layer = std::get_if<NormalLayer*>(&layer)) {
+		connect(*normal_layer, &NormalLayer::strokes_deleted, this, &DrawingLayerPicture::strokes_deleted);
+		connect(*normal_layer, &NormalLayer::strokes_inserted, this, &DrawingLayerPicture::redraw_strokes);
+	}
+	connect(ChangeNotifier::self(), &ChangeNotifier::finished, this, &DrawingLayerPicture::finish_changes);
 
 	committed_strokes.set_transparent();
-	redraw();
+	if (!load_from_raster_cache())
+		redraw();
+}
+
+bool DrawingLayerPicture::load_from_raster_cache() {
+	NormalLayer* const* layer = std::get_if<NormalLayer*>(&m_layer);
+	if (!layer || !RasterCache::self()->enabled())
+		return false;
+	m_raster_cache_key = RasterCache::key(*layer, transformation().image_size, transformation().unit2pixel, Renderer::default_backend());
+	QImage image = RasterCache::self()->load(m_raster_cache_key, transformation().image_size);
+	if (image.isNull())
+		return false;
+	committed_strokes.load_image(image);
+	redraw_current();
+	m_in_raster_cache = true;
+	return true;
+}
+
+void DrawingLayerPicture::store_in_raster_cache() {
+	NormalLayer* const* layer = std::get_if<NormalLayer*>(&m_layer);
+	if (!layer || m_in_raster_cache || !RasterCache::self()->enabled())
+		return;
+	// During a ChangeTransaction (e.g. when it switches pages before the layer pictures are notified of its end), the committed strokes may not be redrawn yet.
+	if (!m_pending_redraw.isEmpty())
+		return;
+	if (m_raster_cache_key.isEmpty())
+		m_raster_cache_key = RasterCache::key(*layer, transformation().image_size, transformation().unit2pixel, Renderer::default_backend());
+	RasterCache::self()->store(m_raster_cache_key, committed_strokes.img());
+	m_in_raster_cache = true;
+}
+
+void DrawingLayerPicture::layer_changed() {
+	m_raster_cache_key.clear();
+	m_in_raster_cache = false;
 }
 
 void DrawingLayerPicture::set_current_stroke(ptr_Stroke current_stroke) {
 	if (m_current_stroke != current_stroke) {
 		m_current_stroke = current_stroke;
+		m_predicted_tip.reset();
+		m_predicted_tip_rect = QRect();
 		redraw_current();
 	}
 }
@@ -154,17 +475,24 @@ void DrawingLayerPicture::set_current_stroke(ptr_Stroke current_stroke) {
 void DrawingLayerPicture::reset_current_stroke() {
 	if (m_current_stroke) {
 		m_current_stroke.reset();
+		m_predicted_tip.reset();
+		m_predicted_tip_rect = QRect();
 		redraw_current();
 	}
 }
 
 void DrawingLayerPicture::redraw(std::optional<QRect> rect) {
+	TRACE_SCOPE("DrawingLayerPicture::redraw");
 	committed_strokes.set_transparent(rect);
+	std::vector<ptr_Stroke> strokes;
 	std::visit([&](auto layer) {
 		for (ptr_Stroke stroke : layer->strokes())
-			committed_strokes.draw_stroke(stroke, rect);
+			strokes.push_back(stroke);
 	},
 	           m_layer);
+	// Temporary strokes (which fade out after a few seconds) live too briefly for their cached paths to pay off.
+	DevicePathCache* cache = std::holds_alternative<NormalLayer*>(m_layer) ? &m_path_cache : nullptr;
+	committed_strokes.draw_strokes_parallel(strokes, rect, cache);
 	redraw_current(rect);
 }
 
@@ -172,39 +500,143 @@ void DrawingLayerPicture::redraw_current(std::optional<QRect> rect) {
 	all_strokes.copy_from(committed_strokes, rect);
 	if (m_current_stroke)
 		all_strokes.draw_stroke(m_current_stroke.value(), rect);
+	if (m_predicted_tip)
+		all_strokes.draw_stroke(get(*m_predicted_tip), rect);
 }
 
 void DrawingLayerPicture::stroke_added(ptr_Stroke stroke) {
 	if (m_current_stroke && m_current_stroke.value() == stroke)
 		reset_current_stroke();
+	layer_changed();
+	add_checkpoint(stroke);
 	QRect rect = committed_strokes.draw_stroke(stroke);
-	all_strokes.copy_from(committed_strokes, rect);
-	if (m_current_stroke)
-		all_strokes.draw_stroke(m_current_stroke.value(), rect);
+	if (ChangeNotifier::self()->active()) {
+		m_pending_update |= rect;
+		return;
+	}
+	redraw_current(rect);
 	emit update(rect);
 }
 
 void DrawingLayerPicture::stroke_deleted(ptr_Stroke stroke) {
+	layer_changed();
 	QRect rect = committed_strokes.stroke_extents(stroke);
+	m_path_cache.remove(convert_variant<PathStroke*>(stroke));
+	if (!m_checkpoints.empty() && m_checkpoints.back().stroke == convert_variant<PathStroke*>(stroke)) {
+		// The stroke was the last one drawn (undo), so the pixels from before it was drawn are still right.
+		TRACE_SCOPE("DrawingLayerPicture::restore_checkpoint");
+		Checkpoint& checkpoint = m_checkpoints.back();
+		if (!checkpoint.pixels.isNull())
+			committed_strokes.load_image(checkpoint.pixels, checkpoint.rect.topLeft());
+		m_checkpoint_bytes -= checkpoint.pixels.sizeInBytes();
+		m_checkpoints.pop_back();
+		if (ChangeNotifier::self()->active()) {
+			m_pending_update |= rect;
+			return;
+		}
+		redraw_current(rect);
+	} else {
+		// The checkpoints are only valid while strokes are deleted in the reverse order of drawing them.
+		m_checkpoints.clear();
+		m_checkpoint_bytes = 0;
+		if (ChangeNotifier::self()->active()) {
+			// Redraw the union of all such rectangles once at the end of the transaction.
+			m_pending_redraw |= rect;
+			return;
+		}
+		redraw(rect);
+	}
+	emit update(rect);
+}
+
+void DrawingLayerPicture::strokes_deleted(const std::vector<ptr_Stroke>& strokes) {
+	redraw_strokes(strokes);
+	for (ptr_Stroke stroke : strokes)
+		m_path_cache.remove(convert_variant<PathStroke*>(stroke));
+}
+
+void DrawingLayerPicture::redraw_strokes(const std::vector<ptr_Stroke>& strokes) {
+	layer_changed();
+	// The pixels of the checkpoints include (or lack) these strokes.
+	m_checkpoints.clear();
+	m_checkpoint_bytes = 0;
+	QRect rect;
+	for (ptr_Stroke stroke : strokes)
+		rect |= committed_strokes.stroke_extents(stroke);
+	if (ChangeNotifier::self()->active()) {
+		m_pending_redraw |= rect;
+		return;
+	}
 	redraw(rect);
 	emit update(rect);
 }
 
-void DrawingLayerPicture::draw_line(Point a, Point b, ptr_Stroke stroke) {
-	ptr_Stroke final_line = std::visit(overloaded{[&](const PenStroke* st) -> ptr_Stroke {
-		                                              PenStroke* n = new PenStroke(st->width(), st->color());
-		                                              n->push_back(a);
-		                                              n->push_back(b);
-		                                              return n;
-	                                              },
-	                                              [&](const EraserStroke* st) -> ptr_Stroke {
-		                                              EraserStroke* n = new EraserStroke(st->width());
-		                                              n->push_back(a);
-		                                              n->push_back(b);
-		                                              return n;
-	                                              }},
-	                                   stroke);
-	QRect rect = all_strokes.stroke_extents(final_line);
+void DrawingLayerPicture::finish_changes() {
+	if (m_pending_redraw.isEmpty() && m_pending_update.isEmpty())
+		return;
+	TRACE_SCOPE("DrawingLayerPicture::finish_changes");
+	if (!m_pending_redraw.isEmpty())
+		redraw(m_pending_redraw);
+	if (!m_pending_update.isEmpty())
+		redraw_current(m_pending_update);
+	QRect rect = m_pending_redraw | m_pending_update;
+	m_pending_redraw = QRect();
+	m_pending_update = QRect();
+	emit update(rect);
+}
+
+void DrawingLayerPicture::add_checkpoint(ptr_Stroke stroke) {
+	// Strokes of the temporary layer fade in any order. While a redraw is pending, the pixels are not right yet.
+	if (!std::holds_alternative<NormalLayer*>(m_layer) || !m_pending_redraw.isEmpty())
+		return;
+	QRect rect = committed_strokes.stroke_extents(stroke) & QRect(QPoint(0, 0), transformation().image_size);
+	QImage pixels = rect.isEmpty() ? QImage() : committed_strokes.copy_rect(rect);
+	m_checkpoints.push_back(Checkpoint{convert_variant<PathStroke*>(stroke), rect, pixels});
+	m_checkpoint_bytes += m_checkpoints.back().pixels.sizeInBytes();
+	while (m_checkpoint_bytes > CHECKPOINT_MEMORY) {
+		m_checkpoint_bytes -= m_checkpoints.front().pixels.sizeInBytes();
+		m_checkpoints.pop_front();
+	}
+}
+
+// A stroke with the same style (width, color, pen/eraser) as the given stroke, but with the given points.
+static unique_ptr_Stroke stroke_with_points(ptr_Stroke style, const std::vector<Point>& points) {
+	return std::visit(overloaded{[&](const PenStroke* st) -> unique_ptr_Stroke {
+		                             auto n = std::make_unique<PenStroke>(st->width(), st->color());
+		                             for (Point p : points)
+			                             n->push_back(p);
+		                             return n;
+	                             },
+	                             [&](const EraserStroke* st) -> unique_ptr_Stroke {
+		                             auto n = std::make_unique<EraserStroke>(st->width());
+		                             for (Point p : points)
+			                             n->push_back(p);
+		                             return n;
+	                             }},
+	                  style);
+}
+
+void DrawingLayerPicture::draw_polyline(const std::vector<Point>& points, ptr_Stroke stroke) {
+	TRACE_SCOPE("DrawingLayerPicture::draw_polyline");
+	QRect rect = all_strokes.stroke_extents(get(stroke_with_points(stroke, points)));
+	redraw_current(rect);
+	emit update(rect);
+}
+
+void DrawingLayerPicture::set_predicted_tip(const std::vector<Point>& points) {
+	if (!m_current_stroke)
+		return;
+	QRect rect = m_predicted_tip_rect;
+	if (points.size() >= 2) {
+		m_predicted_tip = stroke_with_points(m_current_stroke.value(), points);
+		m_predicted_tip_rect = all_strokes.stroke_extents(get(*m_predicted_tip));
+	} else {
+		m_predicted_tip.reset();
+		m_predicted_tip_rect = QRect();
+	}
+	rect |= m_predicted_tip_rect;
+	if (rect.isEmpty())
+		return;
 	redraw_current(rect);
 	emit update(rect);
 }
@@ -217,7 +649,20 @@ PDFLayerPicture::PDFLayerPicture(PDFLayer* layer, const PictureTransformation& t
 }
 
 void PDFLayerPicture::redraw() {
+	TRACE_SCOPE("PDFLayerPicture::redraw");
 	cairo_surface = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, transformation().image_size.width(), transformation().image_size.height());
+	m_raster_cache_key.clear();
+	m_in_raster_cache = false;
+	if (RasterCache::self()->enabled()) {
+		m_raster_cache_key = RasterCache::key(m_layer, transformation().image_size, transformation().unit2pixel);
+		QImage image = RasterCache::self()->load(m_raster_cache_key, transformation().image_size);
+		if (!image.isNull()) {
+			copy_image_to_surface(image, cairo_surface);
+			m_in_raster_cache = true;
+			emit update(QRect(QPoint(0, 0), transformation().image_size));
+			return;
+		}
+	}
 	Cairo::RefPtr<Cairo::Context> cr = Cairo::Context::create(cairo_surface);
 	cr->set_antialias(Cairo::ANTIALIAS_GRAY);
 	Cairo::FontOptions font_options;
@@ -226,13 +671,25 @@ void PDFLayerPicture::redraw() {
 	double scale = POINT_TO_UNIT * transformation().unit2pixel;
 	cr->scale(scale, scale);
 	// TODO Render asynchronously
-	poppler_page_render(m_layer->page(), cr->cobj());
+	{
+		TRACE_SCOPE("poppler_page_render");
+		std::lock_guard<std::mutex> lock(poppler_mutex());
+		poppler_page_render(m_layer->page(), cr->cobj());
+	}
 	emit update(QRect(QPoint(0, 0), transformation().image_size));
 }
 
+void PDFLayerPicture::store_in_raster_cache() {
+	if (m_in_raster_cache || m_raster_cache_key.isEmpty() || !RasterCache::self()->enabled())
+		return;
+	RasterCache::self()->store(m_raster_cache_key, img());
+	m_in_raster_cache = true;
+}
+
 PagePicture::PagePicture(SPage* _page, int _width, int _height) :
     page(_page),
     m_transformation(_page, _width, _height) {
+	TRACE_SCOPE("PagePicture");
 	for (size_t i = 0; i < page->layers().size(); i++)
 		register_layer(i);
 
@@ -262,88 +719,241 @@ void PagePicture::unregister_layer(int index) {
 	m_layers.erase(m_layers.begin() + index);
 }
 
+void PagePicture::store_in_raster_cache() {
+	for (ptr_LayerPicture layer : layers())
+		convert_variant<LayerPicture*>(layer)->store_in_raster_cache();
+}
+
 void PagePicture::update_layer(const QRect& rect) {
 	emit update(rect);
 }
 
-void PDFExporter::save(Document* doc, const std::string& file_name) {
-	Cairo::RefPtr<Cairo::PdfSurface> surface = Cairo::PdfSurface::create(file_name, 0, 0);
+namespace {
+
+// How eraser strokes are drawn on a page
+enum class PDFPageMode {
+	Simplistic,  // Paint them white
+	Clip,  // See PDFExporter::EraserMode::Clip
+	Groups  // See PDFExporter::EraserMode::Groups
+};
+
+PDFPageMode pdf_page_mode(SPage* page, PDFExporter::EraserMode eraser_mode) {
+	// Decide automatically whether to use simplistic mode:
+	// It's safe to use whenever the background is white and there are no eraser strokes on any layer except layer 0.
+	bool simplistic = true;
+	bool first_layer = true;
+	for (auto layer : page->layers()) {
+		if (first_layer) {
+			first_layer = false;
+		} else {
+			std::visit(overloaded{[&](NormalLayer* layer) {
+				                      for (auto stroke : layer->strokes()) {
+					                      if (std::holds_alternative<EraserStroke*>(stroke))
+						                      simplistic = false;
+				                      }
+			                      },
+			                      [&](PDFLayer*) {
+			                      }},
+			           layer);
+		}
+	}
+	if (simplistic)
+		return PDFPageMode::Simplistic;
+	return eraser_mode == PDFExporter::EraserMode::Groups ? PDFPageMode::Groups : PDFPageMode::Clip;
+}
+
+Cairo::RefPtr<Cairo::Context> create_pdf_context(Cairo::RefPtr<Cairo::PdfSurface> surface) {
 	Cairo::RefPtr<Cairo::Context> cr = Cairo::Context::create(surface);
 	cr->set_line_cap(Cairo::LINE_CAP_ROUND);
 	cr->set_line_join(Cairo::LINE_JOIN_ROUND);
 	cr->scale(UNIT_TO_POINT, UNIT_TO_POINT);
-	for (SPage* page : doc->pages()) {
-		// Decide automatically whether to use simplistic mode:
-		// It's safe to use whenever the background is white and there are no eraser strokes on any layer except layer 0.
-		bool simplistic = true;
-		bool first_layer = true;
-		for (auto layer : page->layers()) {
-			if (first_layer) {
-				first_layer = false;
-			} else {
-				std::visit(overloaded{[&](NormalLayer* layer) {
-					                      for (auto stroke : layer->strokes()) {
-						                      if (std::holds_alternative<EraserStroke*>(stroke))
-							                      simplistic = false;
-					                      }
-				                      },
-				                      [&](PDFLayer*) {
-				                      }},
-				           layer);
-			}
-		}
-		qDebug() << "Drawing mode:" << (simplistic ? "simplistic" : "general");
-		surface->set_size(UNIT_TO_POINT * page->width(), UNIT_TO_POINT * page->height());
-		CairoGroup cg(cr);
-		cr->rectangle(0, 0, page->width(), page->height());
-		cr->clip();
-		if (!simplistic) {
-			for ([[maybe_unused]] auto layer : page->layers())
-				cr->push_group_with_content(Cairo::CONTENT_COLOR_ALPHA);
-			cr->set_source_rgb(1, 1, 1);
+	return cr;
+}
+
+// Draws the layers first, ..., last - 1 of the page on the current page of the surface.
+// In groups mode, all layers have to be drawn at once.
+void draw_pdf_layers(Cairo::RefPtr<Cairo::PdfSurface> surface, Cairo::RefPtr<Cairo::Context> cr, SPage* page, PDFPageMode mode, size_t first, size_t last) {
+	bool simplistic = mode == PDFPageMode::Simplistic;
+	bool groups = mode == PDFPageMode::Groups;
+	assert(!groups || (first == 0 && last == page->layers().size()));
+	surface->set_size(UNIT_TO_POINT * page->width(), UNIT_TO_POINT * page->height());
+	CairoGroup cg(cr);
+	cr->rectangle(0, 0, page->width(), page->height());
+	cr->clip();
+	if (groups) {
+		for ([[maybe_unused]] auto layer : page->layers())
+			cr->push_group_with_content(Cairo::CONTENT_COLOR_ALPHA);
+		cr->set_source_rgb(1, 1, 1);
+		cr->paint();
+	}
+	for (size_t i = first; i < last; i++) {
+		auto layer = page->layers()[i];
+		// Retrieve and draw the previous layers
+		Cairo::RefPtr<Cairo::Pattern> background;
+		if (groups) {
+			background = cr->pop_group();
+			cr->set_source(background);
 			cr->paint();
 		}
-		for (auto layer : page->layers()) {
-			// Retrieve and draw the previous layers
-			Cairo::RefPtr<Cairo::Pattern> background;
-			if (!simplistic) {
-				background = cr->pop_group();
-				cr->set_source(background);
-				cr->paint();
-			}
-			std::visit(overloaded{[&](NormalLayer* layer) {
-				                      // TODO Find a better way to support the eraser.
-				                      // The operator CAIRO_OPERATOR_SOURCE is apparently not supported by PDF files. Therefore Cairo falls back to saving a raster image in the PDF file, which uses a lot of space!
-				                      // 			cairo_set_operator(cr->cobj(), CAIRO_OPERATOR_SOURCE);
-				                      for (auto stroke : layer->strokes()) {
-					                      std::visit(overloaded{[&](PenStroke* st) {
-						                                            cr->set_line_width(st->width());
-						                                            Color co = st->color();
-						                                            cr->set_source_rgba(co.r(), co.g(), co.b(), co.a());
-						                                            construct_path(cr, st->points(), 1.0);
-						                                            cr->stroke();
-					                                            },
-					                                            [&](EraserStroke* st) {
-						                                            cr->set_line_width(st->width());
-						                                            if (!simplistic) {
-							                                            // TODO This seems to slow down the PDF viewer.
-							                                            cr->set_source(background);  // Erase = draw the background again on top of this layer
-						                                            } else {
-							                                            cr->set_source_rgb(1, 1, 1);
+		std::visit(overloaded{[&](NormalLayer* layer) {
+			                      // The operator CAIRO_OPERATOR_SOURCE is apparently not supported by PDF files. Therefore Cairo falls back to saving a raster image in the PDF file, which uses a lot of space!
+			                      std::optional<EraserClip> eraser_clip;
+			                      if (!simplistic && !groups)
+				                      eraser_clip.emplace(layer);
+			                      size_t position = 0;
+			                      for (auto stroke : layer->strokes()) {
+				                      std::visit(overloaded{[&](PenStroke* st) {
+					                                            std::optional<CairoGroup> clip_group;
+					                                            if (eraser_clip) {
+						                                            std::optional<std::vector<EraserClip::Trapezoid> > region = eraser_clip->visible_region(position);
+						                                            if (region) {
+							                                            if (region->empty())
+								                                            return;  // Erased completely
+							                                            clip_group.emplace(cr);
+							                                            for (const EraserClip::Trapezoid& t : *region) {
+								                                            cr->move_to(t.top_left, t.top);
+								                                            cr->line_to(t.top_right, t.top);
+								                                            cr->line_to(t.bottom_right, t.bottom);
+								                                            cr->line_to(t.bottom_left, t.bottom);
+								                                            cr->close_path();
+							                                            }
+							                                            cr->clip();
 						                                            }
-						                                            construct_path(cr, st->points(), 1.0);
-						                                            cr->stroke();
-					                                            }},
-					                                 stroke);
-				                      }
+					                                            }
+					                                            cr->set_line_width(st->width());
+					                                            Color co = st->color();
+					                                            cr->set_source_rgba(co.r(), co.g(), co.b(), co.a());
+					                                            construct_path(cr, st->points(), 1.0);
+					                                            cr->stroke();
+				                                            },
+				                                            [&](EraserStroke* st) {
+					                                            if (eraser_clip)
+						                                            return;  // Already taken into account by clipping the pen strokes
+					                                            cr->set_line_width(st->width());
+					                                            if (groups) {
+						                                            // TODO This seems to slow down the PDF viewer.
+						                                            cr->set_source(background);  // Erase = draw the background again on top of this layer
+					                                            } else {
+						                                            cr->set_source_rgb(1, 1, 1);
+					                                            }
+					                                            construct_path(cr, st->points(), 1.0);
+					                                            cr->stroke();
+				                                            }},
+				                                 stroke);
+				                      position++;
+			                      }
+		                      },
+		                      [&](PDFLayer* layer) {
+			                      CairoGroup cg(cr);
+			                      cr->scale(POINT_TO_UNIT, POINT_TO_UNIT);  // Use original scale
+			                      std::lock_guard<std::mutex> lock(poppler_mutex());
+			                      poppler_page_render(layer->page(), cr->cobj());
+		                      }},
+		           layer);
+	}
+}
+
+}  // namespace
+
+void PDFExporter::save(Document* doc, const std::string& file_name, EraserMode eraser_mode) {
+	TRACE_SCOPE("PDFExporter::save");
+	bool pdf_layers = false;
+	for (SPage* page : doc->pages()) {
+		for (ptr_Layer layer : page->layers())
+			pdf_layers |= std::holds_alternative<PDFLayer*>(layer);
+	}
+	if (!pdf_layers) {
+		save_rendered(doc, file_name, eraser_mode);
+		return;
+	}
+	try {
+		save_with_copied_pages(doc, file_name, eraser_mode);
+	} catch (const std::exception& e) {
+		qDebug() << "Cannot copy the pages of the embedded PDF files:" << e.what();
+		qDebug() << "Rendering them instead";
+		save_rendered(doc, file_name, eraser_mode);
+	}
+}
+
+void PDFExporter::save_rendered(Document* doc, const std::string& file_name, EraserMode eraser_mode) {
+	Cairo::RefPtr<Cairo::PdfSurface> surface = Cairo::PdfSurface::create(file_name, 0, 0);
+	Cairo::RefPtr<Cairo::Context> cr = create_pdf_context(surface);
+	for (SPage* page : doc->pages()) {
+		draw_pdf_layers(surface, cr, page, pdf_page_mode(page, eraser_mode), 0, page->layers().size());
+		surface->show_page();
+	}
+}
+
+void PDFExporter::save_with_copied_pages(Document* doc, const std::string& file_name, EraserMode eraser_mode) {
+	// First draw the ink with cairo: one page for each run of consecutive normal layers (or for the whole page in groups mode, where erasing needs the layers below).
+	QTemporaryFile ink_file;
+	if (!ink_file.open())
+		throw std::runtime_error("cannot create a temporary file: " + ink_file.errorString().toStdString());
+	// For each page, what to stack on top of each other: pages of ink_file or PDF layers
+	std::vector<std::vector<std::variant<int, PDFLayer*> > > stacks(doc->pages().size());
+	int ink_pages = 0;
+	{
+		TRACE_SCOPE("PDFExporter::save_with_copied_pages (ink)");
+		Cairo::RefPtr<Cairo::PdfSurface> surface = Cairo::PdfSurface::create(ink_file.fileName().toStdString(), 0, 0);
+		Cairo::RefPtr<Cairo::Context> cr = create_pdf_context(surface);
+		for (size_t i_page = 0; i_page < doc->pages().size(); i_page++) {
+			SPage* page = doc->pages()[i_page];
+			PDFPageMode mode = pdf_page_mode(page, eraser_mode);
+			auto draw = [&](size_t first, size_t last) {
+				draw_pdf_layers(surface, cr, page, mode, first, last);
+				surface->show_page();
+				stacks[i_page].push_back(ink_pages++);
+			};
+			size_t n = page->layers().size();
+			if (mode == PDFPageMode::Groups) {
+				draw(0, n);
+				continue;
+			}
+			size_t first = 0;
+			bool ink = false;  // Whether the layers since first contain any strokes
+			for (size_t i = 0; i <= n; i++) {
+				if (i < n && std::holds_alternative<NormalLayer*>(page->layers()[i])) {
+					ink |= std::get<NormalLayer*>(page->layers()[i])->strokes().size() > 0;
+					continue;
+				}
+				if (ink)
+					draw(first, i);
+				if (i < n)
+					stacks[i_page].push_back(std::get<PDFLayer*>(page->layers()[i]));
+				first = i + 1;
+				ink = false;
+			}
+		}
+		surface->finish();
+	}
+
+	// Then put the ink on top of the original PDF pages.
+	PDFPageStacker stacker;
+	int ink_source = -1;
+	if (ink_pages > 0) {
+		ink_file.seek(0);
+		ink_source = stacker.add_source(ink_file.readAll(), "ink");
+	}
+	std::map<EmbeddedPDF*, int> pdf_sources;
+	for (size_t i_page = 0; i_page < doc->pages().size(); i_page++) {
+		SPage* page = doc->pages()[i_page];
+		double width = UNIT_TO_POINT * page->width(), height = UNIT_TO_POINT * page->height();
+		stacker.add_page(width, height);
+		for (std::variant<int, PDFLayer*> part : stacks[i_page]) {
+			std::visit(overloaded{[&](int ink_page) {
+				                      stacker.stack_page(ink_source, ink_page, width, height);
 			                      },
 			                      [&](PDFLayer* layer) {
-				                      CairoGroup cg(cr);
-				                      cr->scale(POINT_TO_UNIT, POINT_TO_UNIT);  // Use original scale
-				                      poppler_page_render(layer->page(), cr->cobj());
+				                      auto it = pdf_sources.find(layer->pdf());
+				                      if (it == pdf_sources.end())
+					                      it = pdf_sources.emplace(layer->pdf(), stacker.add_source(layer->pdf()->contents(), layer->pdf()->name().toStdString())).first;
+				                      // Poppler draws the page with its original size at the top left corner.
+				                      double pdf_width, pdf_height;
+				                      poppler_page_get_size(layer->page(), &pdf_width, &pdf_height);
+				                      stacker.stack_page(it->second, layer->page_number(), pdf_width, pdf_height);
 			                      }},
-			           layer);
+			           part);
 		}
-		surface->show_page();
 	}
+	stacker.write(file_name);
 }
@@ -3,10 +3,15 @@
 
 #include "all-types.h"
 
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <unordered_map>
 
 #include <QObject>
 #include <QImage>
+#include <QPointF>
 
 #include <cairomm/context.h>
 #include <cairomm/surface.h>
@@ -53,6 +58,10 @@ public:
 	    m_transformation(transformation) {
 	}
 	virtual QImage img() const = 0;
+	// Memory (in bytes) used by the image surfaces (and caches).
+	virtual size_t memory_usage() const = 0;
+	// Writes the image to the RasterCache (if enabled), unless it is already stored there. The layer must still exist.
+	virtual void store_in_raster_cache() = 0;
 	const PictureTransformation& transformation() const {
 		return m_transformation;
 	}
@@ -64,24 +73,88 @@ private:
 	const PictureTransformation& m_transformation;
 };
 
+// The points of strokes in pixel coordinates, so that repeated redraws at the same scale don't need to transform every point again.
+// At small scales, the points are taken from a simplified path (see PathStroke::simplified_points), so that the cost of drawing depends on the number of pixels rather than the number of points.
+// Strokes only ever get more points (see PathStroke::push_back), so an entry stays valid as long as the number of points is unchanged.
+// Entries of deleted strokes must be removed because their address may be reused.
+// This class is thread-safe.
+class DevicePathCache {
+public:
+	explicit DevicePathCache(double unit2pixel) :
+	    m_unit2pixel(unit2pixel) {
+	}
+	// Computes the points if they are not cached yet.
+	std::shared_ptr<const std::vector<QPointF> > get(const PathStroke* stroke);
+	void remove(const PathStroke* stroke);
+	// Memory (in bytes) used by the cached points.
+	size_t memory_usage() const;
+
+private:
+	struct Entry {
+		size_t number_of_points;
+		std::shared_ptr<const std::vector<QPointF> > points;
+	};
+	const double m_unit2pixel;
+	mutable std::mutex m_mutex;
+	std::unordered_map<const PathStroke*, Entry> m_entries;
+	size_t m_bytes = 0;
+};
+
 class Renderer {
 public:
-	Renderer(const PictureTransformation& transformation);
+	// How strokes are rasterized.
+	enum class Backend {
+		Cairo,  // cairo's general path stroker
+		Scanline  // ScanlineRasterizer, which is specialized to our strokes
+	};
+	// The backend chosen by the environment variable SAUKLAUE_RASTERIZER ("cairo" or "scanline"). The default is cairo.
+	static Backend default_backend();
+
+	Renderer(const PictureTransformation& transformation, Backend backend = default_backend());
 
 	// Resets every pixel to transparent.
 	// If a rectangle is given, only pixels inside the rectangle (in pixel coordinates) are reset.
 	void set_transparent(std::optional<QRect> rect = std::nullopt);
 	QImage img() const;
+	// Replaces the pixels covered by the image (in Format_ARGB32_Premultiplied) placed at the given position.
+	void load_image(const QImage& image, QPoint position = QPoint(0, 0));
+	// A copy of the pixels in the given rectangle (which must lie inside the image).
+	QImage copy_rect(const QRect& rect) const;
 	// Copies the contents of the given rectangle from another cairo image.
 	void copy_from(const Renderer& other_renderer, std::optional<QRect> rect = std::nullopt);
 	QRect draw_stroke(ptr_Stroke stroke, std::optional<QRect> clip_rect = std::nullopt);
+	// Draws the strokes in the given order. This gives the same picture as calling draw_stroke for each stroke, but is faster:
+	// Consecutive strokes with the same style (see can_draw_together) whose pixel bounds don't overlap are combined into a single path.
+	// (Where strokes overlap, the antialiased edges of a single path differ from strokes drawn one after the other.)
+	// The optional cache must belong to the same scale and may only be used for strokes whose points are not going to change (see DevicePathCache).
+	void draw_strokes(const std::vector<ptr_Stroke>& strokes, std::optional<QRect> clip_rect = std::nullopt, DevicePathCache* cache = nullptr);
+	// Like draw_strokes, but splits the image into horizontal bands and draws them in parallel on all cores.
+	// Each band only draws the strokes whose bounding box intersects it (in their original order).
+	void draw_strokes_parallel(const std::vector<ptr_Stroke>& strokes, std::optional<QRect> clip_rect = std::nullopt, DevicePathCache* cache = nullptr);
+	// Whether both strokes can be drawn as a single path: They need the same style and the same operator, and the color must be opaque.
+	// This only gives the same pixels as drawing one after the other if the strokes don't overlap (see draw_strokes).
+	static bool can_draw_together(ptr_Stroke a, ptr_Stroke b);
 	QRect stroke_extents(ptr_Stroke stroke);
+	// Memory (in bytes) used by the image surface.
+	size_t memory_usage() const {
+		return (size_t)cairo_surface->get_stride() * cairo_surface->get_height();
+	}
 
 private:
+	// A renderer for the rows top <= y < bottom of another renderer's image. It draws directly into the other renderer's pixels.
+	// All coordinates (e.g. clip rectangles) remain those of the full image.
+	Renderer(Renderer& full, int top, int bottom);
+
 	const PictureTransformation& m_transformation;
 	Cairo::RefPtr<Cairo::ImageSurface> cairo_surface;
 	Cairo::RefPtr<Cairo::Context> cr;
-	void setup_stroke(ptr_Stroke stroke);
+	Backend m_backend;
+	int m_top = 0;  // The y coordinate of the first row of cairo_surface
+	void setup_stroke(ptr_Stroke stroke, DevicePathCache* cache = nullptr);
+	void append_path(ptr_Stroke stroke, DevicePathCache* cache);
+	QRect draw_stroke_scanline(ptr_Stroke stroke, std::optional<QRect> clip_rect);
+	// A rectangle (in pixels) containing everything the stroke draws, computed from its bounding box.
+	QRect pixel_bounds(ptr_Stroke stroke) const;
 	QRect current_stroke_extents();  // Bounding rectangle of the current path in output coordinates
 };
 
@@ -93,11 +166,24 @@ public:
 	QImage img() const override {
 		return all_strokes.img();
 	}
+	size_t memory_usage() const override {
+		return committed_strokes.memory_usage() + all_strokes.memory_usage() + m_path_cache.memory_usage() + m_checkpoint_bytes;
+	}
 
 	void set_current_stroke(ptr_Stroke current_stroke);
 	void reset_current_stroke();
 
+	void store_in_raster_cache() override;
+
 private:
+	// Takes the committed strokes from the RasterCache instead of drawing them. Returns false if they are not cached.
+	bool load_from_raster_cache();
+	void layer_changed();
+	// Remembers the pixels that the stroke is about to cover.
+	void add_checkpoint(ptr_Stroke stroke);
+	// Does the work that was postponed during a ChangeTransaction and emits a single update.
+	void finish_changes();
+
 	// Redraw all strokes in the given rectangle.
 	void redraw(std::optional<QRect> rect = std::nullopt);
 	// Redraw only the current stroke in the given rectangle.
@@ -105,18 +191,51 @@ private:
 
 	void stroke_added(ptr_Stroke stroke);
 	void stroke_deleted(ptr_Stroke stroke);
+	void strokes_deleted(const std::vector<ptr_Stroke>& strokes);
+	// Strokes that may lie below others were deleted or inserted: Redraws the region they cover.
+	void redraw_strokes(const std::vector<ptr_Stroke>& strokes);
 
 	// A picture of all strokes except the current one.
 	Renderer committed_strokes;
 	// A picture of all strokes including the current one.
 	Renderer all_strokes;
+	// The paths of the committed strokes for redrawing them (only used for a NormalLayer)
+	DevicePathCache m_path_cache;
+	// The RasterCache key of the committed strokes (empty if not computed since the last change)
+	QByteArray m_raster_cache_key;
+	// Whether the committed strokes are stored in the RasterCache as they are now
+	bool m_in_raster_cache = false;
+
+	// The pixels of committed_strokes in the extents of a stroke, taken just before the stroke was drawn.
+	// Undo deletes the last stroke, which is then restored from the last checkpoint instead of redrawing all strokes below it.
+	struct Checkpoint {
+		const PathStroke* stroke;
+		QRect rect;
+		QImage pixels;  // Null if the rectangle is empty
+	};
+	// One checkpoint for each of the last strokes (as many as fit into CHECKPOINT_MEMORY)
+	std::deque<Checkpoint> m_checkpoints;
+	size_t m_checkpoint_bytes = 0;
+	static constexpr size_t CHECKPOINT_MEMORY = 16 * 1024 * 1024;
+
+	// During a ChangeTransaction: The region of committed_strokes that still needs to be redrawn, and the region that was changed otherwise (but not yet copied to all_strokes).
+	QRect m_pending_redraw;
+	QRect m_pending_update;
 
 	std::variant<NormalLayer*, TemporaryLayer*> m_layer;
-	std::optional<ptr_Stroke> m_current_stroke;  // This is drawn after all the strokes in m_layer. When the stroke is extended, you must call draw_line. When it is finished, add it to m_layer. The current_stroke is then automatically reset to nullptr.
+	std::optional<ptr_Stroke> m_current_stroke;  // This is drawn after all the strokes in m_layer. When the stroke is extended, you must call draw_polyline. When it is finished, add it to m_layer. The current_stroke is then automatically reset to nullptr.
 	void draw_strokes();
 
 public:
-	void draw_line(Point a, Point b, ptr_Stroke stroke);
+	// Redraws the region covered by the given polyline (consecutive points of the current stroke) and emits a single update for it.
+	void draw_polyline(const std::vector<Point>& points, ptr_Stroke stroke);
+	// Draws a guess of where the current stroke continues on top of it, in the same style.
+	// The predicted tip is not part of any stroke. It is replaced by the next call (an empty list removes it) and removed together with the current stroke.
+	void set_predicted_tip(const std::vector<Point>& points);
+
+private:
+	std::optional<unique_ptr_Stroke> m_predicted_tip;
+	QRect m_predicted_tip_rect;
 };
 
 class PDFLayerPicture : public LayerPicture {
@@ -127,12 +246,18 @@ public:
 		cairo_surface->flush();
 		return QImage((const uchar*)cairo_surface->get_data(), cairo_surface->get_width(), cairo_surface->get_height(), QImage::Format_ARGB32_Premultiplied);
 	}
+	size_t memory_usage() const override {
+		return (size_t)cairo_surface->get_stride() * cairo_surface->get_height();
+	}
+	void store_in_raster_cache() override;
 
 private:
 	void redraw();
 
 	PDFLayer* m_layer;
 	Cairo::RefPtr<Cairo::ImageSurface> cairo_surface;
+	QByteArray m_raster_cache_key;  // Empty if the RasterCache is disabled
+	bool m_in_raster_cache = false;
 };
 
 class PagePicture : public QObject {
@@ -150,6 +275,8 @@ public:
 	const PictureTransformation& transformation() const {
 		return m_transformation;
 	}
+	// Writes the images of the layers to the RasterCache (see LayerPicture::store_in_raster_cache).
+	void store_in_raster_cache();
 
 private:
 	PictureTransformation m_transformation;
@@ -169,7 +296,19 @@ signals:
 
 class PDFExporter {
 public:
-	static void save(Document* doc, const std::string& file_name);
+	// How eraser strokes are exported on pages that need more than painting them white (because they are not on the first layer).
+	enum class EraserMode {
+		Clip,  // Clip the pen strokes to the region that is not erased (see EraserClip). The file only contains plain vector paths.
+		Groups  // Draw the layers into transparency groups and erase by drawing the layers below again. This slows down PDF viewers.
+	};
+	// The pages of embedded PDF files are copied into the file as they are, with the ink on top. If that fails, they are rendered like the ink (with poppler).
+	static void save(Document* doc, const std::string& file_name, EraserMode eraser_mode = EraserMode::Clip);
+
+private:
+	// Draws everything with cairo.
+	static void save_rendered(Document* doc, const std::string& file_name, EraserMode eraser_mode);
+	// Draws the ink with cairo and then stacks it on top of the copied PDF pages (see PDFPageStacker). May throw std::exception.
+	static void save_with_copied_pages(Document* doc, const std::string& file_name, EraserMode eraser_mode);
 };
 
 #endif  // RENDERER_H
@@ -0,0 +1,170 @@
+#include "scanline-rasterizer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// A segment of the polyline in pixel coordinates.
+struct Segment {
+	float ax, ay;  // Start point
+	float dx, dy;  // End point minus start point
+	float inv_length2;  // 1 / (dx^2 + dy^2), or 0 if the segment is a single point
+	// The pixels that may be covered (inclusive)
+	int x0, x1, y0, y1;
+};
+
+// For each pixel x0 <= x <= x1 in row y, replaces dist2[x - left] by the squared distance of the pixel center to the segment if that is smaller.
+// dist2 must have room for three more floats after x1.
+void min_distance2(const Segment& s, int y, int left, float* dist2) {
+	float py = y + 0.5f;
+#ifdef __SSE2__
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+	const __m128 ax = _mm_set1_ps(s.ax), dx = _mm_set1_ps(s.dx), dy = _mm_set1_ps(s.dy), inv = _mm_set1_ps(s.inv_length2);
+	const __m128 ry = _mm_set1_ps(py - s.ay);
+	const __m128 ry_dy = _mm_mul_ps(ry, dy);
+	__m128 px = _mm_add_ps(_mm_set1_ps(s.x0 + 0.5f), _mm_set_ps(3, 2, 1, 0));
+	const __m128 step = _mm_set1_ps(4);
+	for (int x = s.x0; x <= s.x1; x += 4) {
+		__m128 rx = _mm_sub_ps(px, ax);
+		// Parameter of the closest point on the segment
+		__m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(rx, dx), ry_dy), inv);
+		t = _mm_min_ps(_mm_max_ps(t, zero), one);
+		__m128 ex = _mm_sub_ps(rx, _mm_mul_ps(t, dx));
+		__m128 ey = _mm_sub_ps(ry, _mm_mul_ps(t, dy));
+		__m128 d2 = _mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey));
+		float* out = dist2 + (x - left);
+		_mm_storeu_ps(out, _mm_min_ps(_mm_loadu_ps(out), d2));
+		px = _mm_add_ps(px, step);
+	}
+#else
+	float ry = py - s.ay;
+	for (int x = s.x0; x <= s.x1; x++) {
+		float rx = x + 0.5f - s.ax;
+		float t = std::clamp((rx * s.dx + ry * s.dy) * s.inv_length2, 0.f, 1.f);
+		float ex = rx - t * s.dx, ey = ry - t * s.dy;
+		float& out = dist2[x - left];
+		out = std::min(out, ex * ex + ey * ey);
+	}
+#endif
+}
+
+}  // namespace
+
+QRect ScanlineRasterizer::extents(const std::vector<Point>& points, double unit2pixel, double line_width) {
+	assert(!points.empty());
+	double x1 = std::numeric_limits<double>::infinity(), y1 = x1, x2 = -x1, y2 = -x1;
+	for (Point p : points) {
+		x1 = std::min(x1, p.x * unit2pixel);
+		y1 = std::min(y1, p.y * unit2pixel);
+		x2 = std::max(x2, p.x * unit2pixel);
+		y2 = std::max(y2, p.y * unit2pixel);
+	}
+	double r = line_width / 2;
+	x1 -= r;
+	y1 -= r;
+	x2 += r;
+	y2 += r;
+	return QRect(QPoint((int)x1 - 1, (int)y1 - 1), QPoint((int)x2 + 2, (int)y2 + 2));
+}
+
+void ScanlineRasterizer::draw(const Image& image, const std::vector<Point>& points, double unit2pixel, double line_width, std::optional<Color> color, std::optional<QRect> clip_rect) {
+	if (points.empty())
+		return;
+	QRect area = extents(points, unit2pixel, line_width) & QRect(0, image.top, image.width, image.height);
+	if (clip_rect)
+		area &= *clip_rect;
+	if (area.isEmpty())
+		return;
+	float r = line_width / 2;
+	// Pixels whose center is further away than this from the polyline are not covered at all.
+	float reach = r + 0.5f;
+	float reach2 = reach * reach;
+
+	// Split the polyline into segments. (A single point is a segment of length 0.)
+	std::vector<Segment> segments;
+	segments.reserve(points.size());
+	for (size_t i = 0; i == 0 || i + 1 < points.size(); i++) {
+		const Point& a = points[i];
+		const Point& b = points[std::min(i + 1, points.size() - 1)];
+		Segment s;
+		s.ax = a.x * unit2pixel;
+		s.ay = a.y * unit2pixel;
+		s.dx = b.x * unit2pixel - s.ax;
+		s.dy = b.y * unit2pixel - s.ay;
+		float length2 = s.dx * s.dx + s.dy * s.dy;
+		s.inv_length2 = length2 > 0 ? 1 / length2 : 0;
+		s.x0 = std::max(area.left(), (int)std::floor(std::min(s.ax, s.ax + s.dx) - reach));
+		s.x1 = std::min(area.right(), (int)std::ceil(std::max(s.ax, s.ax + s.dx) + reach));
+		s.y0 = std::max(area.top(), (int)std::floor(std::min(s.ay, s.ay + s.dy) - reach));
+		s.y1 = std::min(area.bottom(), (int)std::ceil(std::max(s.ay, s.ay + s.dy) + reach));
+		if (s.x0 <= s.x1 && s.y0 <= s.y1)
+			segments.push_back(s);
+	}
+	std::sort(segments.begin(), segments.end(), [](const Segment& a, const Segment& b) { return a.y0 < b.y0; });
+
+	// Premultiplied source color
+	float sa = 0, sr = 0, sg = 0, sb = 0;
+	if (color) {
+		sa = color->a();
+		sr = color->r() * sa * 255;
+		sg = color->g() * sa * 255;
+		sb = color->b() * sa * 255;
+	}
+
+	// Squared distance of each pixel center in the current row to the polyline. (Padded for the SSE2 loop.)
+	std::vector<float> dist2(area.width() + 4, std::numeric_limits<float>::infinity());
+	std::vector<const Segment*> active;
+	size_t next_segment = 0;
+	for (int y = area.top(); y <= area.bottom(); y++) {
+		// Update the list of segments touching this row.
+		active.erase(std::remove_if(active.begin(), active.end(), [y](const Segment* s) { return s->y1 < y; }), active.end());
+		while (next_segment < segments.size() && segments[next_segment].y0 <= y)
+			active.push_back(&segments[next_segment++]);
+		if (active.empty())
+			continue;
+		int lo = area.right(), hi = area.left();
+		for (const Segment* s : active) {
+			lo = std::min(lo, s->x0);
+			hi = std::max(hi, s->x1);
+		}
+		std::fill(dist2.begin() + (lo - area.left()), dist2.begin() + (hi - area.left() + 1), std::numeric_limits<float>::infinity());
+		for (const Segment* s : active)
+			min_distance2(*s, y, area.left(), dist2.data());
+		// Blend the covered pixels.
+		uint32_t* row = (uint32_t*)(image.data + (size_t)(y - image.top) * image.stride);
+		for (int x = lo; x <= hi; x++) {
+			float d2 = dist2[x - area.left()];
+			if (d2 >= reach2)
+				continue;
+			float d = std::sqrt(d2);
+			// The part of the pixel (as a box of width 1 perpendicular to the stroke) inside the stroke of width 2r
+			float coverage = std::clamp(std::min(d + 0.5f, r) - std::max(d - 0.5f, -r), 0.f, 1.f);
+			if (coverage <= 0)
+				continue;
+			uint32_t p = row[x];
+			float da = p >> 24, dr = (p >> 16) & 255, dg = (p >> 8) & 255, db = p & 255;
+			float keep;  // Factor for the old color
+			if (color) {
+				keep = 1 - sa * coverage;
+				da = sa * 255 * coverage + da * keep;
+				dr = sr * coverage + dr * keep;
+				dg = sg * coverage + dg * keep;
+				db = sb * coverage + db * keep;
+			} else {
+				keep = 1 - coverage;
+				da *= keep;
+				dr *= keep;
+				dg *= keep;
+				db *= keep;
+			}
+			row[x] = ((uint32_t)(da + 0.5f) << 24) | ((uint32_t)(dr + 0.5f) << 16) | ((uint32_t)(dg + 0.5f) << 8) | (uint32_t)(db + 0.5f);
+		}
+	}
+}
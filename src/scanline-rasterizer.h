@@ -0,0 +1,33 @@
+#ifndef SCANLINE_RASTERIZER_H
+#define SCANLINE_RASTERIZER_H
+
+#include "all-types.h"
+#include "document.h"
+
+#include <optional>
+#include <vector>
+
+#include <QRect>
+
+// A rasterizer for the only kind of path we draw: A polyline of constant width with round caps and joins.
+// Such a stroke consists of all points whose distance to the polyline is at most half the line width. So instead of constructing the outline (as cairo's general path stroker does), we compute the distance of every pixel center to the polyline (four pixels at a time with SSE2, if available) and derive the coverage from it.
+// The antialiasing of the boundary differs slightly from cairo's (see BM_ScanlineRasterizerDifference in the benchmark).
+class ScanlineRasterizer {
+public:
+	// An image in cairo's FORMAT_ARGB32 (32 bit native-endian pixels with premultiplied alpha).
+	struct Image {
+		unsigned char* data;
+		int width, height;
+		int stride;  // In bytes
+		int top;  // The y coordinate of the first row (if the image is a band of a larger picture)
+	};
+
+	// The rectangle (in pixels) that contains all pixels touched by the stroke. (This has the same margin as Renderer::stroke_extents.)
+	static QRect extents(const std::vector<Point>& points, double unit2pixel, double line_width);
+	// Draws the polyline (in page units, multiplied by unit2pixel) with the given line width (in pixels) into the image.
+	// With a color, the stroke is drawn on top of the image (cairo's OPERATOR_OVER). Without a color, the covered pixels are made transparent (like the eraser with OPERATOR_SOURCE).
+	// Only pixels in clip_rect are changed.
+	static void draw(const Image& image, const std::vector<Point>& points, double unit2pixel, double line_width, std::optional<Color> color, std::optional<QRect> clip_rect = std::nullopt);
+};
+
+#endif  // SCANLINE_RASTERIZER_H
@@ -1,6 +1,7 @@
 #include "serializer.h"
 
 #include "document.h"
+#include "trace.h"
 
 #include "src/file4.capnp.h"
 #include <capnp/message.h>
@@ -9,7 +10,7 @@
 #include <iostream>
 
 #include <QDebug>
-#include <QElapsedTimer>
+#include <QBuffer>
 #include <QCoreApplication>
 #include <QDataStream>
 
@@ -26,13 +27,30 @@ void write_path(file4::Path::Builder s_path, const std::vector<Point>& points) {
 	}
 }
 
+void write_stroke(file4::Stroke::Builder s_stroke, ptr_Stroke stroke) {
+	std::visit(overloaded{[&](const PenStroke* st) {
+		                      auto s_special_stroke = s_stroke.initPen();
+		                      s_special_stroke.setWidth(st->width());
+		                      s_special_stroke.setColor(st->color().x);
+		                      auto s_path = s_special_stroke.initPath();
+		                      write_path(s_path, st->points());
+	                      },
+	                      [&](const EraserStroke* st) {
+		                      auto s_special_stroke = s_stroke.initEraser();
+		                      s_special_stroke.setWidth(st->width());
+		                      auto s_path = s_special_stroke.initPath();
+		                      write_path(s_path, st->points());
+	                      }},
+	           stroke);
+}
+
 void Serializer::save(Document* doc, QDataStream& stream) {
+	TRACE_SCOPE("Serializer::save");
 	stream.writeRawData(magic_string.data(), magic_string.size());
 	stream << FILE_FORMAT_VERSION;
 	stream.setVersion(QDataStream::Qt_5_6);
 	capnp::MallocMessageBuilder message;
-	QElapsedTimer construct_timer;
-	construct_timer.start();
+	uint64_t construct_start = Trace::now();
 	auto s_file = message.initRoot<file4::File>();
 	auto s_pdfs = s_file.initEmbeddedPDFs(doc->embedded_pdfs().size());
 	std::map<EmbeddedPDF*, int> embedded_pdf_index;
@@ -63,20 +81,7 @@ void Serializer::save(Document* doc, QDataStream& stream) {
 				                      for (size_t i_stroke = 0; i_stroke < layer->strokes().size(); i_stroke++) {
 					                      auto stroke = layer->strokes()[i_stroke];
 					                      auto s_stroke = s_strokes[i_stroke];
-					                      std::visit(overloaded{[&](const PenStroke* st) {
-						                                            auto s_special_stroke = s_stroke.initPen();
-						                                            s_special_stroke.setWidth(st->width());
-						                                            s_special_stroke.setColor(st->color().x);
-						                                            auto s_path = s_special_stroke.initPath();
-						                                            write_path(s_path, st->points());
-					                                            },
-					                                            [&](const EraserStroke* st) {
-						                                            auto s_special_stroke = s_stroke.initEraser();
-						                                            s_special_stroke.setWidth(st->width());
-						                                            auto s_path = s_special_stroke.initPath();
-						                                            write_path(s_path, st->points());
-					                                            }},
-					                                 stroke);
+					                      write_stroke(s_stroke, stroke);
 				                      }
 			                      },
 			                      [&](PDFLayer* layer) {
@@ -89,16 +94,17 @@ void Serializer::save(Document* doc, QDataStream& stream) {
 			           layer);
 		}
 	}
-	qDebug() << "Construct capnp" << construct_timer.elapsed();
+	Trace::span("construct capnp", construct_start, Trace::now() - construct_start);
 	kj::VectorOutputStream out;
-	QElapsedTimer write_packed_timer;
-	write_packed_timer.start();
-	capnp::writePackedMessage(out, message);
-	qDebug() << "writePackedMessage" << write_packed_timer.elapsed();
-	QElapsedTimer write_bytes_timer;
-	write_bytes_timer.start();
-	stream.writeBytes(out.getArray().asChars().begin(), out.getArray().size());
-	qDebug() << "writeBytes" << write_bytes_timer.elapsed();
+	{
+		TRACE_SCOPE("writePackedMessage");
+		capnp::writePackedMessage(out, message);
+	}
+	{
+		TRACE_SCOPE("writeBytes");
+		stream.writeBytes(out.getArray().asChars().begin(), out.getArray().size());
+	}
+	Trace::counter("file size", out.getArray().size());
 }
 
 void load_path_4(file4::Path::Reader s_path, PathStroke* path) {
@@ -112,7 +118,31 @@ void load_path_4(file4::Path::Reader s_path, PathStroke* path) {
 	}
 }
 
+unique_ptr_Stroke load_stroke_4(file4::Stroke::Reader s_stroke) {
+	unique_ptr_Stroke stroke;
+	switch (s_stroke.which()) {
+	case file4::Stroke::PEN: {
+		auto s_special_stroke = s_stroke.getPen();
+		auto special_stroke = std::make_unique<PenStroke>(s_special_stroke.getWidth(), s_special_stroke.getColor());
+		load_path_4(s_special_stroke.getPath(), special_stroke.get());
+		stroke = std::move(special_stroke);
+		break;
+	}
+	case file4::Stroke::ERASER: {
+		auto s_special_stroke = s_stroke.getEraser();
+		auto special_stroke = std::make_unique<EraserStroke>(s_special_stroke.getWidth());
+		load_path_4(s_special_stroke.getPath(), special_stroke.get());
+		stroke = std::move(special_stroke);
+		break;
+	}
+	default:
+		throw SauklaueReadException(QCoreApplication::tr("Invalid Sauklaue file: Unknown stroke type."));
+	}
+	return stroke;
+}
+
 std::unique_ptr<Document> Serializer::load(QDataStream& stream) {
+	TRACE_SCOPE("Serializer::load");
 	char magic_string_in[magic_string.size() + 10];
 	if (stream.readRawData(magic_string_in, magic_string.size()) != (int)magic_string.size())
 		throw SauklaueReadException(QCoreApplication::tr("Not a Sauklaue file."));
@@ -165,26 +195,7 @@ std::unique_ptr<Document> Serializer::load(QDataStream& stream) {
 					auto s_strokes = s_normal_layer.getStrokes();
 					layer->reserve_strokes(s_strokes.size());
 					for (auto s_stroke : s_strokes) {
-						unique_ptr_Stroke stroke;
-						switch (s_stroke.which()) {
-						case file4::Stroke::PEN: {
-							auto s_special_stroke = s_stroke.getPen();
-							auto special_stroke = std::make_unique<PenStroke>(s_special_stroke.getWidth(), s_special_stroke.getColor());
-							load_path_4(s_special_stroke.getPath(), special_stroke.get());
-							stroke = std::move(special_stroke);
-							break;
-						}
-						case file4::Stroke::ERASER: {
-							auto s_special_stroke = s_stroke.getEraser();
-							auto special_stroke = std::make_unique<EraserStroke>(s_special_stroke.getWidth());
-							load_path_4(s_special_stroke.getPath(), special_stroke.get());
-							stroke = std::move(special_stroke);
-							break;
-						}
-						default:
-							throw SauklaueReadException(QCoreApplication::tr("Invalid Sauklaue file: Unknown stroke type."));
-						}
-						layer->add_stroke(std::move(stroke));
+						layer->add_stroke(load_stroke_4(s_stroke));
 					}
 					page->add_layer(page->layers().size(), std::move(layer));
 					break;
@@ -228,5 +239,40 @@ std::unique_ptr<Document> Serializer::load(QDataStream& stream) {
 	}
 	qDebug() << "Number of strokes:" << num_strokes;
 	qDebug() << "Number of points:" << num_points;
+	Trace::counter("strokes", num_strokes);
+	Trace::counter("points", num_points);
 	return doc;
 }
+
+qint64 Serializer::saved_size(Document* doc) {
+	QBuffer buffer;
+	buffer.open(QBuffer::WriteOnly);
+	QDataStream out(&buffer);
+	save(doc, out);
+	return buffer.size();
+}
+
+QByteArray Serializer::save_strokes(const std::vector<ptr_Stroke>& strokes) {
+	TRACE_SCOPE("Serializer::save_strokes");
+	capnp::MallocMessageBuilder message;
+	auto s_strokes = message.initRoot<file4::NormalLayer>().initStrokes(strokes.size());
+	for (size_t i_stroke = 0; i_stroke < strokes.size(); i_stroke++)
+		write_stroke(s_strokes[i_stroke], strokes[i_stroke]);
+	kj::VectorOutputStream out;
+	capnp::writePackedMessage(out, message);
+	return QByteArray(out.getArray().asChars().begin(), out.getArray().size());
+}
+
+std::vector<unique_ptr_Stroke> Serializer::load_strokes(const QByteArray& data) {
+	TRACE_SCOPE("Serializer::load_strokes");
+	kj::ArrayInputStream in(kj::arrayPtr((const unsigned char*)data.constData(), data.size()));
+	capnp::ReaderOptions opt;
+	opt.traversalLimitInWords = 64 * 1024 * 1024;
+	capnp::PackedMessageReader message(in, opt);
+	std::vector<unique_ptr_Stroke> strokes;
+	auto s_strokes = message.getRoot<file4::NormalLayer>().getStrokes();
+	strokes.reserve(s_strokes.size());
+	for (auto s_stroke : s_strokes)
+		strokes.push_back(load_stroke_4(s_stroke));
+	return strokes;
+}
@@ -3,6 +3,9 @@
 
 #include "all-types.h"
 
+#include <vector>
+
+#include <QByteArray>
 #include <QString>
 #include <QDataStream>
 
@@ -23,6 +26,12 @@ class Serializer {
 public:
 	static void save(Document* doc, QDataStream& stream);
 	static std::unique_ptr<Document> load(QDataStream& stream);  // May throw SauklaueReadException
+	// The size (in bytes) of the file that save would write.
+	static qint64 saved_size(Document* doc);
+
+	// Just the given strokes, in the same encoding as in files.
+	static QByteArray save_strokes(const std::vector<ptr_Stroke>& strokes);
+	static std::vector<unique_ptr_Stroke> load_strokes(const QByteArray& data);  // May throw SauklaueReadException
 };
 
 #endif  // SERIALIZER_H
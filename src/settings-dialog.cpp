@@ -105,6 +105,36 @@ SettingsGeneralWidget::SettingsGeneralWidget(QWidget* parent) :
 		box->setSuffix("s");
 		layout->addRow(tr("Autosave every:"), box);
 	}
+	{
+		QCheckBox* box = new QCheckBox(tr("Capture raw pen input"));
+		box->setObjectName("kcfg_RawPenInput");
+		box->setToolTip(tr("Read all pen positions of the tablets enabled on the Tablet page directly from the X server, so that no samples are lost while the application is busy drawing."));
+		layout->addRow(tr("Tablet input:"), box);
+	}
+	{
+		QSpinBox* box = new QSpinBox;
+		box->setObjectName("kcfg_PredictionHorizon");
+		box->setSuffix(" ms");
+		box->setSpecialValueText(tr("Off"));
+		box->setToolTip(tr("Extends the stroke being drawn by a guess of where the pen will be this much later, to make up for the time it takes to show the ink. The guess is replaced as soon as the real positions arrive."));
+		layout->addRow(tr("Predict ink ahead:"), box);
+	}
+	{
+		QSpinBox* box = new QSpinBox;
+		box->setObjectName("kcfg_RasterCacheSize");
+		box->setSuffix(" MiB");
+		box->setSpecialValueText(tr("Off"));
+		box->setToolTip(tr("Keeps the rendered pages on disk, so that they appear immediately when a document is opened again."));
+		layout->addRow(tr("Page image cache:"), box);
+	}
+	{
+		QSpinBox* box = new QSpinBox;
+		box->setObjectName("kcfg_UndoMemoryBudget");
+		box->setSuffix(" MiB");
+		box->setSpecialValueText(tr("Unlimited"));
+		box->setToolTip(tr("Undo steps beyond this amount of memory are moved to a temporary file and loaded back when they are undone or redone."));
+		layout->addRow(tr("Undo history memory:"), box);
+	}
 	setLayout(layout);
 }
 
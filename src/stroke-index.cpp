@@ -0,0 +1,141 @@
+#include "stroke-index.h"
+
+#include "document.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Squared distance of the point p to the segment from a to a + d, where inv_d2 = 1 / |d|^2 (or 0 if d = 0).
+float point_segment_distance2(float px, float py, float ax, float ay, float dx, float dy, float inv_d2) {
+	float rx = px - ax, ry = py - ay;
+	float t = std::clamp((rx * dx + ry * dy) * inv_d2, 0.f, 1.f);
+	float ex = rx - t * dx, ey = ry - t * dy;
+	return ex * ex + ey * ey;
+}
+
+// Whether the segments from p to q and from (0,0) to e cross, or come within sqrt(r2) of each other.
+bool segments_touch(float px, float py, float qx, float qy, float ex, float ey, float inv_e2, float r2) {
+	float dx = qx - px, dy = qy - py;
+	float d2 = dx * dx + dy * dy;
+	float inv_d2 = d2 > 0 ? 1 / d2 : 0;
+	float dist2 = std::min({point_segment_distance2(px, py, 0, 0, ex, ey, inv_e2),
+	                        point_segment_distance2(qx, qy, 0, 0, ex, ey, inv_e2),
+	                        point_segment_distance2(0, 0, px, py, dx, dy, inv_d2),
+	                        point_segment_distance2(ex, ey, px, py, dx, dy, inv_d2)});
+	if (dist2 <= r2)
+		return true;
+	// If the segments cross, their endpoints lie on different sides of the other segment.
+	float c1 = ex * py - ey * px, c2 = ex * qy - ey * qx;
+	float c3 = dx * py - dy * px, c4 = dx * (py - ey) - dy * (px - ex);
+	return c1 * c2 < 0 && c3 * c4 < 0;
+}
+
+#ifdef __SSE2__
+// The coordinates of the points p[0..3] minus (ox, oy).
+void load_points(const Point* p, __m128 ox, __m128 oy, __m128& x, __m128& y) {
+	static_assert(sizeof(Point) == 2 * sizeof(int));
+	__m128 lo = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)p));  // x0 y0 x1 y1
+	__m128 hi = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(p + 2)));  // x2 y2 x3 y3
+	x = _mm_sub_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)), ox);
+	y = _mm_sub_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)), oy);
+}
+
+// Squared distance of the points (px, py) to the segments from (ax, ay) to (ax, ay) + (dx, dy) (four at a time, like point_segment_distance2).
+__m128 point_segment_distance2(__m128 px, __m128 py, __m128 ax, __m128 ay, __m128 dx, __m128 dy, __m128 inv_d2) {
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+	__m128 rx = _mm_sub_ps(px, ax), ry = _mm_sub_ps(py, ay);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(rx, dx), _mm_mul_ps(ry, dy)), inv_d2);
+	t = _mm_min_ps(_mm_max_ps(t, zero), one);
+	__m128 ex = _mm_sub_ps(rx, _mm_mul_ps(t, dx));
+	__m128 ey = _mm_sub_ps(ry, _mm_mul_ps(t, dy));
+	return _mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey));
+}
+#endif
+
+}  // namespace
+
+QRect StrokeIndex::line_box(const PenStroke* stroke) {
+	int r = (stroke->width() + 1) / 2;
+	return stroke->bounding_box().adjusted(-r, -r, r, r);
+}
+
+void StrokeIndex::insert(const PenStroke* stroke) {
+	if (stroke->points().empty())
+		return;
+	m_grid.insert(line_box(stroke), stroke);
+}
+
+void StrokeIndex::remove(const PenStroke* stroke) {
+	if (stroke->points().empty())
+		return;
+	m_grid.remove(line_box(stroke), stroke);
+}
+
+std::vector<const PenStroke*> StrokeIndex::find(Point a, Point b, double distance) const {
+	int d = std::ceil(distance);
+	QRect rect = QRect(QPoint(std::min(a.x, b.x), std::min(a.y, b.y)), QPoint(std::max(a.x, b.x), std::max(a.y, b.y))).adjusted(-d, -d, d, d);
+	std::vector<const PenStroke*> result;
+	for (const PenStroke* stroke : m_grid.find(rect)) {
+		if (line_box(stroke).intersects(rect) && touches(stroke->points(), a, b, distance + stroke->width() / 2.))
+			result.push_back(stroke);
+	}
+	return result;
+}
+
+size_t StrokeIndex::memory_usage() const {
+	return m_grid.memory_usage();
+}
+
+bool StrokeIndex::touches(const std::vector<Point>& points, Point a, Point b, double distance) {
+	if (points.empty())
+		return false;
+	// All coordinates are taken relative to a. Page coordinates are below 2^24, so they are exact as floats.
+	const float ex = b.x - a.x, ey = b.y - a.y;
+	const float e2 = ex * ex + ey * ey;
+	const float inv_e2 = e2 > 0 ? 1 / e2 : 0;
+	const float r2 = distance * distance;
+	const size_t n = points.size();
+	if (n == 1)
+		return point_segment_distance2(points[0].x - a.x, points[0].y - a.y, 0, 0, ex, ey, inv_e2) <= r2;
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 ax = _mm_set1_ps(a.x), ay = _mm_set1_ps(a.y);
+	const __m128 vex = _mm_set1_ps(ex), vey = _mm_set1_ps(ey), vinv_e2 = _mm_set1_ps(inv_e2), vr2 = _mm_set1_ps(r2);
+	// The segments from points[i + k] to points[i + k + 1] for k = 0, ..., 3
+	for (; i + 4 < n; i += 4) {
+		__m128 px, py, qx, qy;
+		load_points(&points[i], ax, ay, px, py);
+		load_points(&points[i + 1], ax, ay, qx, qy);
+		__m128 dx = _mm_sub_ps(qx, px), dy = _mm_sub_ps(qy, py);
+		__m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+		// 1 / d2, or 0 where d2 = 0
+		__m128 inv_d2 = _mm_and_ps(_mm_div_ps(_mm_set1_ps(1), d2), _mm_cmpgt_ps(d2, zero));
+		__m128 dist2 = _mm_min_ps(_mm_min_ps(point_segment_distance2(px, py, zero, zero, vex, vey, vinv_e2),
+		                                     point_segment_distance2(qx, qy, zero, zero, vex, vey, vinv_e2)),
+		                          _mm_min_ps(point_segment_distance2(zero, zero, px, py, dx, dy, inv_d2),
+		                                     point_segment_distance2(vex, vey, px, py, dx, dy, inv_d2)));
+		__m128 hit = _mm_cmple_ps(dist2, vr2);
+		// Crossing segments (see segments_touch)
+		__m128 c1 = _mm_sub_ps(_mm_mul_ps(vex, py), _mm_mul_ps(vey, px));
+		__m128 c2 = _mm_sub_ps(_mm_mul_ps(vex, qy), _mm_mul_ps(vey, qx));
+		__m128 c3 = _mm_sub_ps(_mm_mul_ps(dx, py), _mm_mul_ps(dy, px));
+		__m128 c4 = _mm_sub_ps(_mm_mul_ps(dx, _mm_sub_ps(py, vey)), _mm_mul_ps(dy, _mm_sub_ps(px, vex)));
+		__m128 cross = _mm_and_ps(_mm_cmplt_ps(_mm_mul_ps(c1, c2), zero), _mm_cmplt_ps(_mm_mul_ps(c3, c4), zero));
+		if (_mm_movemask_ps(_mm_or_ps(hit, cross)))
+			return true;
+	}
+#endif
+	for (; i + 1 < n; i++) {
+		if (segments_touch(points[i].x - a.x, points[i].y - a.y, points[i + 1].x - a.x, points[i + 1].y - a.y, ex, ey, inv_e2, r2))
+			return true;
+	}
+	return false;
+}
@@ -0,0 +1,108 @@
+#ifndef STROKE_INDEX_H
+#define STROKE_INDEX_H
+
+#include "all-types.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <QRect>
+
+// A uniform grid over the page that lists, for each cell, the items (e.g. strokes or segments) that may cover part of the cell.
+template <class T>
+class UniformGrid {
+public:
+	// The side length of a cell in units (about 7 mm): A few cells per line of handwriting.
+	static constexpr int CELL_SIZE = 20000;
+
+	// Adds the item to every cell that intersects the rectangle.
+	void insert(const QRect& rect, T item) {
+		for_cells(rect, [&](uint64_t key) {
+			m_cells[key].push_back(item);
+		});
+	}
+	// Removes the item from every cell that intersects the rectangle (the same rectangle as when it was inserted).
+	void remove(const QRect& rect, T item) {
+		for_cells(rect, [&](uint64_t key) {
+			auto it = m_cells.find(key);
+			assert(it != m_cells.end());
+			std::vector<T>& items = it->second;
+			auto jt = std::find(items.begin(), items.end(), item);
+			assert(jt != items.end());
+			*jt = items.back();
+			items.pop_back();
+			if (items.empty())
+				m_cells.erase(it);
+		});
+	}
+	// The items in the cells that intersect the rectangle, sorted and without duplicates (an item is listed in every cell it covers).
+	std::vector<T> find(const QRect& rect) const {
+		std::vector<T> result;
+		for_cells(rect, [&](uint64_t key) {
+			auto it = m_cells.find(key);
+			if (it != m_cells.end())
+				result.insert(result.end(), it->second.begin(), it->second.end());
+		});
+		std::sort(result.begin(), result.end());
+		result.erase(std::unique(result.begin(), result.end()), result.end());
+		return result;
+	}
+	// The items in the cell that contains the point, or nullptr if there are none.
+	const std::vector<T>* at(int x, int y) const {
+		auto it = m_cells.find(cell_key(floor_div(x, CELL_SIZE), floor_div(y, CELL_SIZE)));
+		return it != m_cells.end() ? &it->second : nullptr;
+	}
+	// Memory (in bytes) used by the grid.
+	size_t memory_usage() const {
+		size_t bytes = m_cells.bucket_count() * sizeof(void*);
+		for (const auto& [key, items] : m_cells)
+			bytes += sizeof(std::pair<const uint64_t, std::vector<T> >) + items.capacity() * sizeof(T);
+		return bytes;
+	}
+
+private:
+	static int floor_div(int a, int b) {
+		return a / b - (a % b < 0 ? 1 : 0);
+	}
+	static uint64_t cell_key(int cx, int cy) {
+		return ((uint64_t)(uint32_t)cx << 32) | (uint32_t)cy;
+	}
+	// Calls f(cell) for every cell that intersects the rectangle.
+	template <class F>
+	static void for_cells(const QRect& rect, F f) {
+		int x1 = floor_div(rect.left(), CELL_SIZE), x2 = floor_div(rect.right(), CELL_SIZE);
+		int y1 = floor_div(rect.top(), CELL_SIZE), y2 = floor_div(rect.bottom(), CELL_SIZE);
+		for (int cx = x1; cx <= x2; cx++) {
+			for (int cy = y1; cy <= y2; cy++)
+				f(cell_key(cx, cy));
+		}
+	}
+
+	std::unordered_map<uint64_t, std::vector<T> > m_cells;
+};
+
+// The pen strokes of a layer in a UniformGrid (by the box around their line).
+// It is used to find the strokes touched by the stroke eraser without looking at every stroke of the page.
+class StrokeIndex {
+public:
+	void insert(const PenStroke* stroke);
+	void remove(const PenStroke* stroke);
+	// The strokes whose line comes within the given distance (in units) of the segment from a to b, in no particular order.
+	std::vector<const PenStroke*> find(Point a, Point b, double distance) const;
+	// Memory (in bytes) used by the grid.
+	size_t memory_usage() const;
+
+	// Whether the polyline comes within the given distance of the segment from a to b.
+	// The segments of the polyline are tested four at a time with SSE2, if available.
+	static bool touches(const std::vector<Point>& points, Point a, Point b, double distance);
+
+private:
+	static QRect line_box(const PenStroke* stroke);
+
+	UniformGrid<const PenStroke*> m_grid;
+};
+
+#endif  // STROKE_INDEX_H
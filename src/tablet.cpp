@@ -2,13 +2,80 @@
 
 #include "cairo-helpers.h"
 #include "settings.h"
+#include "trace.h"
 
-#include <QApplication>
+#include <array>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <QGuiApplication>
 #include <QDebug>
-#include <QTimer>
+#include <QMatrix>
 #include <X11/extensions/XInput2.h>
 // #include <QtX11Extras/QX11Info>
 
+// Everything the worker thread needs to know to compute the transformation matrices.
+struct TabletRequest {
+	QRectF rect_one;
+	QRectF rect_both;
+	QSize screen_size;
+	// Whether we should currently manage the transformation matrix. (We should stop when the application loses focus. For example, if there are multiple instances of this program running, they should cooperate.)
+	bool active;
+	std::map<QString, TabletSettings> tablets;
+	// Reset all matrices and stop the thread.
+	bool quit = false;
+};
+
+// Owns a separate connection to the X server and sets the transformation matrices whenever a new request arrives or devices appear or disappear.
+class TabletWorker {
+public:
+	TabletWorker();
+	~TabletWorker();
+
+	// Called from the GUI thread. Never blocks.
+	void request(std::unique_ptr<TabletRequest> request);
+	std::vector<QString> device_names();
+
+private:
+	void run();
+	bool open_display();
+	// Handles the XInput events (devices appearing, disappearing or changing) that have arrived. Returns whether the matrices need to be updated.
+	bool process_x_events();
+	// Queries the list of pointer devices if it isn't known.
+	void ensure_device_list();
+	void update_matrices(const TabletRequest& request);
+	void write_matrix(int device_id, const std::array<float, 9>& mat);
+
+	LatestValueSlot<TabletRequest> m_requests;
+	// Wakes up the worker thread when a request was published.
+	int m_wake_fd;
+	std::thread m_thread;
+
+	std::mutex m_device_names_mutex;
+	std::vector<QString> m_device_names;  // Protected by m_device_names_mutex
+
+	// The following are only accessed by the worker thread.
+	_XDisplay* display = nullptr;
+	int xi_opcode;
+	Atom matrix_atom;  // "Coordinate Transformation Matrix"
+	Atom float_atom;  // "FLOAT"
+	struct Device {
+		int id;
+		QString name;
+	};
+	// The connected pointer devices. Only valid if m_devices_valid is true. Invalidated whenever the X server notifies us that devices appeared or disappeared.
+	std::vector<Device> m_devices;
+	bool m_devices_valid = false;
+	// The transformation matrices we have set, by device id. Devices we haven't touched (or reset to the identity) are not included.
+	// TODO Save and restore the original transformation matrix.
+	std::map<int, std::array<float, 9> > m_written;
+};
+
 std::unique_ptr<TabletHandler> tablet_singleton;
 
 TabletHandler* TabletHandler::self() {
@@ -20,51 +87,20 @@ TabletHandler* TabletHandler::self() {
 TabletHandler::TabletHandler() {
 	m_rect_one = m_rect_both = QRectF(0, 0, 1, 1);  // TODO
 	m_screen_size = QSize(1, 1);  // TODO
-	on_demand_timer = new QTimer(this);
-	on_demand_timer->setSingleShot(true);
-	periodic_timer = new QTimer(this);
-	connect(on_demand_timer, &QTimer::timeout, this, &TabletHandler::update_matrices_now);
-	connect(periodic_timer, &QTimer::timeout, this, &TabletHandler::update_matrices_now);
-	// 	display = QX11Info::display();
-	display = XOpenDisplay(nullptr);
-	if (!display) {
-		qDebug() << "No X11 display!";
-		return;
-	}
-	int xi_opcode, event, error;
-	if (!XQueryExtension(display, "XInputExtension", &xi_opcode, &event, &error)) {
-		qDebug() << "X Input extension not available.";
-		display = nullptr;
-		return;
-	}
-	// TODO Instead of trying to set the transformation matrix once every second, watch out for "device connected" signals.
-	periodic_timer->start(1000);
+	m_worker = std::make_unique<TabletWorker>();
+	// Whether we manage the matrices depends on the settings and on whether our window is active.
+	connect(Settings::self(), &Settings::configChanged, this, &TabletHandler::publish);
+	connect(qApp, &QGuiApplication::applicationStateChanged, this, &TabletHandler::publish);
+	publish();
 }
 
 TabletHandler::~TabletHandler() {
-	// Immediately reset the transformation matrix to the identity matrix.
-	m_active = false;
-	update_matrices_now();
-	XCloseDisplay(display);
+	// Immediately resets the transformation matrices to the identity matrix.
+	m_worker.reset();
 }
 
 std::vector<QString> TabletHandler::device_list() {
-	if (!display)
-		return {};
-	std::vector<QString> tablet_names;
-	// Print a list of all devices.
-	// See list_xi2() in https://cgit.freedesktop.org/xorg/app/xinput/tree/src/list.c
-	int ndevices;
-	XIDeviceInfo* info;
-	info = XIQueryDevice(display, XIAllDevices, &ndevices);
-	for (int i = 0; i < ndevices; i++) {
-		XIDeviceInfo* device = &info[i];
-		qDebug() << "Device" << device->deviceid << device->name << device->attachment << device->use;
-		if (device->use == XIMasterPointer || device->use == XISlavePointer)
-			tablet_names.emplace_back(device->name);
-	}
-	XIFreeDeviceInfo(info);
-	return tablet_names;
+	return m_worker->device_names();
 }
 
 void TabletHandler::set_active_region(QRectF rect_one, QRectF rect_both, QSize screen_size) {
@@ -73,60 +109,213 @@ void TabletHandler::set_active_region(QRectF rect_one, QRectF rect_both, QSize s
 	m_rect_one = rect_one;
 	m_rect_both = rect_both;
 	m_screen_size = screen_size;
-	if (!on_demand_timer->isActive())
-		on_demand_timer->start(10);
+	publish();
 }
 
-QMatrix TabletHandler::matrix(const TabletSettings& tablet) const {
+void TabletHandler::publish() {
+	auto request = std::make_unique<TabletRequest>();
+	request->rect_one = m_rect_one;
+	request->rect_both = m_rect_both;
+	request->screen_size = m_screen_size;
+	request->active = QGuiApplication::applicationState() == Qt::ApplicationActive;
+	for (const TabletSettings& tablet : Settings::self()->tablets())
+		request->tablets.emplace(tablet.name, tablet);
+	m_worker->request(std::move(request));
+}
+
+QMatrix matrix(const TabletSettings& tablet, const TabletRequest& request) {
 	// Without loss of generality, the unit in reality is 1 pixel.
 	// Tablet -> Reality
 	QMatrix t2r = QMatrix().scale(tablet.width, tablet.height) * QMatrix().rotate(tablet.orientation);
 	// Reality -> Tablet
 	QMatrix r2t = t2r.inverted();
 	// Bounding rectangle for the rectangle to be mapped to in tablet space
-	QRectF rect = r2t.mapRect(tablet.bothSides ? m_rect_both : m_rect_one);
+	QRectF rect = r2t.mapRect(tablet.bothSides ? request.rect_both : request.rect_one);
 	// Rescale the tablet so it becomes at least as large as the bounding rectangle.
 	double scale = std::max(rect.width(), rect.height());
 	// Translate the tablet so it contains the bounding rectangle.
 	double dx = (rect.left() + rect.right() - scale) / 2, dy = (rect.top() + rect.bottom() - scale) / 2;
-	return QMatrix().scale(scale, scale) * QMatrix().translate(dx, dy) * t2r * QMatrix().scale(1. / m_screen_size.width(), 1. / m_screen_size.height());
+	return QMatrix().scale(scale, scale) * QMatrix().translate(dx, dy) * t2r * QMatrix().scale(1. / request.screen_size.width(), 1. / request.screen_size.height());
+}
+
+TabletWorker::TabletWorker() {
+	m_wake_fd = eventfd(0, EFD_CLOEXEC);
+	m_thread = std::thread(&TabletWorker::run, this);
+}
+
+TabletWorker::~TabletWorker() {
+	auto request = std::make_unique<TabletRequest>();
+	request->active = false;
+	request->quit = true;
+	this->request(std::move(request));
+	m_thread.join();
+	close(m_wake_fd);
+}
+
+void TabletWorker::request(std::unique_ptr<TabletRequest> request) {
+	m_requests.publish(std::move(request));
+	uint64_t one = 1;
+	if (write(m_wake_fd, &one, sizeof(one)) != sizeof(one))
+		qDebug() << "Cannot wake up the tablet thread.";
+}
+
+std::vector<QString> TabletWorker::device_names() {
+	std::lock_guard<std::mutex> lock(m_device_names_mutex);
+	return m_device_names;
 }
 
-// TODO We waste quite a bit of time waiting for the X server to respond. It would be better to do this in a separate thread. We could then perhaps even increase the update frequency.
-void TabletHandler::update_matrices_now() {
-	// 	qDebug() << "Setting transformation matrix.";
-	if (!display)
+bool TabletWorker::open_display() {
+	// 	display = QX11Info::display();
+	display = XOpenDisplay(nullptr);
+	if (!display) {
+		qDebug() << "No X11 display!";
+		return false;
+	}
+	int event, error;
+	if (!XQueryExtension(display, "XInputExtension", &xi_opcode, &event, &error)) {
+		qDebug() << "X Input extension not available.";
+		XCloseDisplay(display);
+		return false;
+	}
+	int major = 2, minor = 0;
+	if (XIQueryVersion(display, &major, &minor) != Success) {
+		qDebug() << "X Input extension 2.0 not available.";
+		XCloseDisplay(display);
+		return false;
+	}
+	matrix_atom = XInternAtom(display, "Coordinate Transformation Matrix", False);
+	float_atom = XInternAtom(display, "FLOAT", False);
+	// Get notified when devices are added, removed, enabled, disabled or changed.
+	unsigned char mask_bits[XIMaskLen(XI_LASTEVENT)] = {};
+	XISetMask(mask_bits, XI_HierarchyChanged);
+	XISetMask(mask_bits, XI_DeviceChanged);
+	XIEventMask mask;
+	mask.deviceid = XIAllDevices;
+	mask.mask_len = sizeof(mask_bits);
+	mask.mask = mask_bits;
+	XISelectEvents(display, DefaultRootWindow(display), &mask, 1);
+	return true;
+}
+
+void TabletWorker::run() {
+	if (!open_display())
+		return;  // Requests are simply never taken.
+	ensure_device_list();
+	std::unique_ptr<TabletRequest> current;
+	bool dirty = false;
+	while (true) {
+		if (std::unique_ptr<TabletRequest> request = m_requests.take()) {
+			current = std::move(request);
+			dirty = true;
+		}
+		if (current && dirty) {
+			update_matrices(*current);
+			dirty = false;
+		}
+		if (current && current->quit)
+			break;
+		// Our own requests might have moved events into Xlib's queue, so look there before waiting on the socket.
+		if (process_x_events()) {
+			dirty = true;
+			continue;
+		}
+		XFlush(display);
+		pollfd fds[2] = {{m_wake_fd, POLLIN, 0}, {ConnectionNumber(display), POLLIN, 0}};
+		poll(fds, 2, -1);
+		if (fds[0].revents & POLLIN) {
+			uint64_t count;
+			if (read(m_wake_fd, &count, sizeof(count)) != sizeof(count))
+				qDebug() << "Cannot read from the tablet thread's eventfd.";
+		}
+	}
+	XCloseDisplay(display);
+}
+
+void TabletWorker::ensure_device_list() {
+	if (m_devices_valid)
 		return;
-	// See do_set_prop_xi2() in https://cgit.freedesktop.org/xorg/app/xinput/tree/src/property.c
-	static_assert(sizeof(float) == 4);
+	m_devices.clear();
+	// See list_xi2() in https://cgit.freedesktop.org/xorg/app/xinput/tree/src/list.c
 	int ndevices;
 	XIDeviceInfo* info;
 	info = XIQueryDevice(display, XIAllDevices, &ndevices);
-	bool active = m_active && (qApp && qApp->activeWindow() != nullptr);
-	//	bool found = false;
 	for (int i = 0; i < ndevices; i++) {
 		XIDeviceInfo* device = &info[i];
-		if (!(device->use == XIMasterPointer || device->use == XISlavePointer))
+		qDebug() << "Device" << device->deviceid << device->name << device->attachment << device->use;
+		if (device->use == XIMasterPointer || device->use == XISlavePointer)
+			m_devices.push_back({device->deviceid, device->name});
+	}
+	XIFreeDeviceInfo(info);
+	m_devices_valid = true;
+	std::vector<QString> names;
+	for (const Device& device : m_devices)
+		names.push_back(device.name);
+	std::lock_guard<std::mutex> lock(m_device_names_mutex);
+	m_device_names = std::move(names);
+}
+
+bool TabletWorker::process_x_events() {
+	bool changed = false;
+	while (XPending(display)) {
+		XEvent event;
+		XNextEvent(display, &event);
+		XGenericEventCookie* cookie = &event.xcookie;
+		if (cookie->type != GenericEvent || cookie->extension != xi_opcode || !XGetEventData(display, cookie))
 			continue;
-		std::optional<TabletSettings> tablet = Settings::self()->tablet(device->name);
-		if (active && tablet && tablet->enabled) {
-			m_changed.insert(device->deviceid);
-			QMatrix cmat = matrix(*tablet);
-			// 	QProcess::execute("xinput", {"set-prop", "XPPEN Tablet Pen (0)", "--type=float", "Coordinate Transformation Matrix", QString::number(e1x), QString::number(e2x), QString::number(dx), QString::number(e1y), QString::number(e2y), QString::number(dy), "0", "0", "1"});
-			float mat[9] = {(float)cmat.m11(), (float)cmat.m21(), (float)cmat.dx(), (float)cmat.m12(), (float)cmat.m22(), (float)cmat.dy(), 0, 0, 1};
-			XIChangeProperty(display, device->deviceid, XInternAtom(display, "Coordinate Transformation Matrix", False), XInternAtom(display, "FLOAT", False), 32, PropModeReplace, (unsigned char*)mat, 9);
-			//			found = true;
-		} else if (auto it = m_changed.find(device->deviceid); it != m_changed.end()) {
-			m_changed.erase(it);
-			float mat[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
-			XIChangeProperty(display, device->deviceid, XInternAtom(display, "Coordinate Transformation Matrix", False), XInternAtom(display, "FLOAT", False), 32, PropModeReplace, (unsigned char*)mat, 9);
+		if (cookie->evtype == XI_HierarchyChanged) {
+			XIHierarchyEvent* hev = (XIHierarchyEvent*)cookie->data;
+			for (int i = 0; i < hev->num_info; i++) {
+				// A new device might reuse the id of a removed one, and a re-enabled device might have lost its matrix.
+				if (hev->info[i].flags & (XIMasterAdded | XIMasterRemoved | XISlaveAdded | XISlaveRemoved | XIDeviceEnabled | XIDeviceDisabled))
+					m_written.erase(hev->info[i].deviceid);
+			}
+			m_devices_valid = false;
+			changed = true;
+		} else if (cookie->evtype == XI_DeviceChanged) {
+			XIDeviceChangedEvent* dev = (XIDeviceChangedEvent*)cookie->data;
+			// Ignore the (frequent) events that only say that a different slave device now drives the master pointer.
+			if (dev->reason == XIDeviceChange) {
+				m_written.erase(dev->deviceid);
+				changed = true;
+			}
+		}
+		XFreeEventData(display, cookie);
+	}
+	if (changed)
+		ensure_device_list();
+	return changed;
+}
+
+void TabletWorker::update_matrices(const TabletRequest& request) {
+	TRACE_SCOPE("TabletWorker::update_matrices");
+	ensure_device_list();
+	bool written = false;
+	for (const Device& device : m_devices) {
+		auto tablet = request.tablets.find(device.name);
+		if (request.active && tablet != request.tablets.end() && tablet->second.enabled) {
+			QMatrix cmat = matrix(tablet->second, request);
+			std::array<float, 9> mat = {(float)cmat.m11(), (float)cmat.m21(), (float)cmat.dx(), (float)cmat.m12(), (float)cmat.m22(), (float)cmat.dy(), 0, 0, 1};
+			auto it = m_written.find(device.id);
+			if (it != m_written.end() && it->second == mat)
+				continue;  // Unchanged
+			write_matrix(device.id, mat);
+			m_written[device.id] = mat;
+			written = true;
+		} else if (auto it = m_written.find(device.id); it != m_written.end()) {
+			m_written.erase(it);
+			write_matrix(device.id, {1, 0, 0, 0, 1, 0, 0, 0, 1});
+			written = true;
 		}
 	}
-	// 	if (!found)
-	// 		qDebug() << "Couldn't find device.";
-	XIFreeDeviceInfo(info);
 	// I don't understand why, but somehow the changed coordinate transformation matrix is not always applied immediately.
-	// However, it seems to be applied the next time we get a list of all devices, or when we close the display.
-	info = XIQueryDevice(display, XIAllDevices, &ndevices);
-	XIFreeDeviceInfo(info);
+	// However, it seems to be applied after the next round trip to the X server, or when we close the display.
+	if (written)
+		XSync(display, False);
+}
+
+void TabletWorker::write_matrix(int device_id, const std::array<float, 9>& mat) {
+	// See do_set_prop_xi2() in https://cgit.freedesktop.org/xorg/app/xinput/tree/src/property.c
+	static_assert(sizeof(float) == 4);
+	// 	QProcess::execute("xinput", {"set-prop", "XPPEN Tablet Pen (0)", "--type=float", "Coordinate Transformation Matrix", QString::number(e1x), QString::number(e2x), QString::number(dx), QString::number(e1y), QString::number(e2y), QString::number(dy), "0", "0", "1"});
+	XIChangeProperty(display, device_id, matrix_atom, float_atom, 32, PropModeReplace, (unsigned char*)mat.data(), 9);
 }
@@ -0,0 +1,268 @@
+#include "thumbnail-cache.h"
+
+#include "document.h"
+#include "renderer.h"
+#include "trace.h"
+
+#include <algorithm>
+
+#include <QMetaObject>
+#include <QPainter>
+#include <QRunnable>
+#include <QThread>
+#include <QTimer>
+
+#include <cairomm/context.h>
+#include <cairomm/surface.h>
+
+// The header poppler.h defines a variable called signals, which is a qt keyword.
+#undef signals
+#include <poppler.h>
+#define signals Q_SIGNALS
+
+namespace {
+
+// Everything needed to render the thumbnail of a page, copied from the page on the GUI thread.
+class ThumbnailJob : public QRunnable {
+public:
+	ThumbnailJob(ThumbnailCache* cache, SPage* page, int version) :
+	    m_cache(cache),
+	    m_page(page),
+	    m_version(version),
+	    m_transformation(page, ThumbnailCache::box_size().width(), ThumbnailCache::box_size().height()) {
+		for (ptr_Layer layer : page->layers()) {
+			std::visit(overloaded{[&](NormalLayer* l) {
+				                      Layer& copy = m_layers.emplace_back();
+				                      for (ptr_Stroke stroke : l->strokes()) {
+					                      copy.strokes.emplace_back(std::visit(
+					                              [](auto* t) -> unique_ptr_Stroke {
+						                              return std::make_unique<typename std::remove_pointer_t<decltype(t)> >(*t);
+					                              },
+					                              stroke));
+				                      }
+			                      },
+			                      [&](PDFLayer* l) {
+				                      // The page keeps its poppler document alive, so the job does not depend on the EmbeddedPDF.
+				                      m_layers.emplace_back().pdf_page.reset((_PopplerPage*)g_object_ref(l->page()));
+			                      }},
+			           layer);
+		}
+	}
+
+	void run() override {
+		TRACE_SCOPE("ThumbnailJob");
+		QImage image(m_transformation.image_size, QImage::Format_ARGB32_Premultiplied);
+		image.fill(Qt::white);
+		{
+			QPainter painter(&image);
+			for (const Layer& layer : m_layers) {
+				if (layer.pdf_page) {
+					draw_pdf_page(painter, layer.pdf_page.get());
+				} else {
+					std::vector<ptr_Stroke> strokes;
+					strokes.reserve(layer.strokes.size());
+					for (const unique_ptr_Stroke& stroke : layer.strokes)
+						strokes.push_back(get(stroke));
+					Renderer renderer(m_transformation);
+					// The cache lets the renderer use the simplified paths (see PathStroke::simplified_points).
+					DevicePathCache path_cache(m_transformation.unit2pixel);
+					renderer.draw_strokes(strokes, std::nullopt, &path_cache);
+					painter.drawImage(0, 0, renderer.img());
+				}
+			}
+		}
+		ThumbnailCache* cache = m_cache;
+		SPage* page = m_page;
+		int version = m_version;
+		QMetaObject::invokeMethod(
+		        cache, [cache, page, version, image]() {
+			        cache->finished(page, version, image);
+		        },
+		        Qt::QueuedConnection);
+	}
+
+private:
+	void draw_pdf_page(QPainter& painter, _PopplerPage* page) const {
+		Cairo::RefPtr<Cairo::ImageSurface> surface = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, m_transformation.image_size.width(), m_transformation.image_size.height());
+		{
+			Cairo::RefPtr<Cairo::Context> cr = Cairo::Context::create(surface);
+			double scale = POINT_TO_UNIT * m_transformation.unit2pixel;
+			cr->scale(scale, scale);
+			std::lock_guard<std::mutex> lock(poppler_mutex());
+			poppler_page_render(page, cr->cobj());
+		}
+		surface->flush();
+		painter.drawImage(0, 0, QImage((const uchar*)surface->get_data(), surface->get_width(), surface->get_height(), surface->get_stride(), QImage::Format_ARGB32_Premultiplied));
+	}
+
+	struct Layer {
+		std::vector<unique_ptr_Stroke> strokes;
+		GObjectWrapper<_PopplerPage> pdf_page;  // Only set for PDF layers
+	};
+
+	ThumbnailCache* m_cache;
+	SPage* m_page;  // Only used as a key. The page may be deleted while the job is running.
+	int m_version;
+	PictureTransformation m_transformation;
+	std::vector<Layer> m_layers;
+};
+
+}  // namespace
+
+ThumbnailCache::ThumbnailCache(QObject* parent) :
+    QObject(parent) {
+	m_cache.setMaxCost(32 * 1024);  // 32 MB, i.e. several hundred thumbnails
+	// Leave one core for the GUI thread.
+	m_pool.setMaxThreadCount(std::max(1, QThread::idealThreadCount() - 1));
+	m_invalidation_timer = new QTimer(this);
+	m_invalidation_timer->setSingleShot(true);
+	m_invalidation_timer->setInterval(300);
+	connect(m_invalidation_timer, &QTimer::timeout, this, &ThumbnailCache::invalidate_pending);
+}
+
+ThumbnailCache::~ThumbnailCache() {
+	m_pool.clear();
+	m_pool.waitForDone();
+}
+
+void ThumbnailCache::setDocument(Document* doc) {
+	if (m_doc) {
+		disconnect(m_doc, nullptr, this, nullptr);
+		for (SPage* page : m_doc->pages()) {
+			disconnect(page, nullptr, this, nullptr);
+			for (ptr_Layer layer : page->layers())
+				disconnect(convert_variant<QObject*>(layer), nullptr, this, nullptr);
+		}
+	}
+	// Jobs that are already running still deliver their result, which is ignored because the page is unknown or the version is older than the page (see finished).
+	m_pool.clear();
+	m_cache.clear();
+	m_versions.clear();
+	m_requested.clear();
+	m_pending_invalidations.clear();
+	m_invalidation_timer->stop();
+	m_doc = doc;
+	if (m_doc) {
+		connect(m_doc, &Document::pages_added, this, &ThumbnailCache::update_pages);
+		connect(m_doc, &Document::pages_deleted, this, &ThumbnailCache::update_pages);
+	}
+	update_pages();
+}
+
+QImage ThumbnailCache::thumbnail(SPage* page) {
+	auto it = m_versions.find(page);
+	if (it == m_versions.end())
+		return QImage();
+	int version = it->second.current;
+	Entry* entry = m_cache.object(page);
+	if ((!entry || entry->version != version) && m_requested[page] != version) {
+		m_requested[page] = version;
+		// The most recently requested page gets the highest priority.
+		m_pool.start(new ThumbnailJob(this, page, version), m_next_priority++);
+	}
+	return entry ? entry->image : QImage();
+}
+
+size_t ThumbnailCache::memory_usage() const {
+	size_t bytes = 0;
+	for (SPage* page : m_cache.keys())
+		bytes += m_cache.object(page)->image.sizeInBytes();
+	return bytes;
+}
+
+void ThumbnailCache::connect_page(SPage* page) {
+	// A page that is added again (e.g. by undoing its deletion) is still connected.
+	disconnect(page, nullptr, this, nullptr);
+	connect(page, &SPage::layer_added, this, [this, page](int index) {
+		connect_layer(page, page->layers()[index]);
+		invalidate(page);
+	});
+	connect(page, &SPage::layer_deleted, this, [this, page]() {
+		invalidate(page);
+	});
+	for (ptr_Layer layer : page->layers())
+		connect_layer(page, layer);
+}
+
+void ThumbnailCache::connect_layer(SPage* page, ptr_Layer layer) {
+	disconnect(convert_variant<QObject*>(layer), nullptr, this, nullptr);
+	std::visit(overloaded{[&](NormalLayer* l) {
+		                      connect(l, &DrawingLayer::stroke_added, this, [this, page]() {
+			                      invalidate(page);
+		                      });
+		                      connect(l, &DrawingLayer::stroke_deleted, this, [this, page]() {
+			                      invalidate(page);
+		                      });
+		                      connect(l, &NormalLayer::strokes_deleted, this, [this, page]() {
+			                      invalidate(page);
+		                      });
+		                      connect(l, &NormalLayer::strokes_inserted, this, [this, page]() {
+			                      invalidate(page);
+		                      });
+	                      },
+	                      [&](PDFLayer* l) {
+		                      connect(l, &PDFLayer::changed, this, [this, page]() {
+			                      invalidate(page);
+		                      });
+	                      }},
+	           layer);
+}
+
+// Called whenever pages were added or deleted: Forgets the pages that are no longer in the document.
+void ThumbnailCache::update_pages() {
+	std::map<SPage*, Versions> versions;
+	if (m_doc) {
+		for (SPage* page : m_doc->pages()) {
+			auto it = m_versions.find(page);
+			if (it != m_versions.end()) {
+				versions.insert(*it);
+			} else {
+				connect_page(page);
+				// Versions are never reused, so a result for a deleted page cannot be mistaken for a new page at the same address.
+				int version = m_next_version++;
+				versions[page] = Versions{version, version};
+			}
+		}
+	}
+	for (const auto& [page, version] : m_versions) {
+		if (!versions.count(page)) {
+			m_cache.remove(page);
+			m_requested.erase(page);
+			m_pending_invalidations.erase(page);
+		}
+	}
+	m_versions = std::move(versions);
+}
+
+void ThumbnailCache::invalidate(SPage* page) {
+	if (!m_versions.count(page))
+		return;  // A deleted page (e.g. changed by the undo stack) or a page of another document
+	m_pending_invalidations.insert(page);
+	m_invalidation_timer->start();
+}
+
+void ThumbnailCache::invalidate_pending() {
+	std::set<SPage*> pages;
+	std::swap(pages, m_pending_invalidations);
+	for (SPage* page : pages) {
+		auto it = m_versions.find(page);
+		if (it == m_versions.end())
+			continue;
+		it->second.current = m_next_version++;
+		emit thumbnail_changed(page);
+	}
+}
+
+void ThumbnailCache::finished(SPage* page, int version, QImage image) {
+	auto it = m_versions.find(page);
+	if (it == m_versions.end() || version < it->second.first)
+		return;  // From a deleted page or a page of the previous document
+	if (m_requested[page] == version)
+		m_requested.erase(page);
+	Entry* entry = m_cache.object(page);
+	if (entry && entry->version > version)
+		return;  // Results may arrive out of order.
+	// Even an outdated result (of this page) is better than nothing. It is shown until the next one is ready.
+	m_cache.insert(page, new Entry{image, version}, std::max(1, (int)(image.sizeInBytes() / 1024)));
+	emit thumbnail_changed(page);
+}
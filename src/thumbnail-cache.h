@@ -0,0 +1,79 @@
+#ifndef THUMBNAIL_CACHE_H
+#define THUMBNAIL_CACHE_H
+
+#include "all-types.h"
+
+#include <map>
+#include <set>
+
+#include <QCache>
+#include <QImage>
+#include <QObject>
+#include <QSize>
+#include <QThreadPool>
+
+class QTimer;
+
+// Small pictures of the pages of a document, rendered in worker threads.
+// A job copies everything it needs from the page (on the GUI thread), so the document can change while the job is running.
+// Pages that were requested last are rendered first (the overview requests the visible pages whenever it repaints).
+// A thumbnail is invalidated when its page changes (after a short pause, so that continuous changes like erasing don't copy the page again and again). It is kept (and shown) until the new one is ready.
+class ThumbnailCache : public QObject {
+	Q_OBJECT
+public:
+	// The thumbnails are fitted into a box of this size (in pixels).
+	static QSize box_size() {
+		return QSize(150, 200);
+	}
+
+	explicit ThumbnailCache(QObject* parent = nullptr);
+	~ThumbnailCache();
+
+	void setDocument(Document* doc);
+
+	// The current thumbnail of the page, possibly outdated. It is null if the page was never rendered.
+	// If the thumbnail is missing or outdated, it is rendered in the background and thumbnail_changed is emitted when it is ready.
+	QImage thumbnail(SPage* page);
+	// Memory (in bytes) used by the thumbnails.
+	size_t memory_usage() const;
+
+	// Called on the GUI thread when a job has rendered the given version of the page.
+	void finished(SPage* page, int version, QImage image);
+
+signals:
+	// Emitted when a page changed or a new thumbnail is ready.
+	void thumbnail_changed(SPage* page);
+
+private:
+	void connect_page(SPage* page);
+	void connect_layer(SPage* page, ptr_Layer layer);
+	void update_pages();
+	// Gives the page a new version when the invalidation timer fires.
+	void invalidate(SPage* page);
+	void invalidate_pending();
+
+	struct Entry {
+		QImage image;
+		int version;  // The version of the page shown in the image
+	};
+
+	Document* m_doc = nullptr;
+	// Cost in kilobytes
+	QCache<SPage*, Entry> m_cache;
+	struct Versions {
+		int current;
+		int first;  // When the page was added. Older results belong to another page that had the same address.
+	};
+	// The versions of every page of the document. Every change gives the page a new version number.
+	std::map<SPage*, Versions> m_versions;
+	// Pages that have changed since the invalidation timer was started
+	std::set<SPage*> m_pending_invalidations;
+	QTimer* m_invalidation_timer;
+	// The version that is being rendered for each page with a queued or running job.
+	std::map<SPage*, int> m_requested;
+	int m_next_version = 1;
+	QThreadPool m_pool;
+	int m_next_priority = 0;
+};
+
+#endif  // THUMBNAIL_CACHE_H
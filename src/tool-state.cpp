@@ -13,3 +13,7 @@ void ToolState::setPenColor(QColor pen_color) {
 void ToolState::setPenSize(int pen_size) {
 	m_pen_size = pen_size;
 }
+
+void ToolState::setEraseStrokes(bool erase_strokes) {
+	m_erase_strokes = erase_strokes;
+}
@@ -26,7 +26,7 @@ public:
 	void setPenColor(QColor pen_color);
 
 private:
-	QColor m_pen_color;
+	QColor m_pen_color = Qt::black;
 
 public:
 	int penSize() {
@@ -35,7 +35,17 @@ public:
 	void setPenSize(int pen_size);
 
 private:
-	int m_pen_size;
+	int m_pen_size = 1000;
+
+public:
+	// Whether the eraser deletes the strokes it touches (instead of painting over them).
+	bool eraseStrokes() {
+		return m_erase_strokes;
+	}
+	void setEraseStrokes(bool erase_strokes);
+
+private:
+	bool m_erase_strokes = false;
 };
 
 #endif  // TOOLSTATE_H
@@ -0,0 +1,111 @@
+#include "trace.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <QDebug>
+#include <QSaveFile>
+
+std::atomic<bool> Trace::s_enabled(false);
+
+namespace {
+
+const std::chrono::steady_clock::time_point trace_epoch = std::chrono::steady_clock::now();
+
+struct TraceEvent {
+	const char* name;
+	char phase;  // 'X' = complete span, 'C' = counter
+	uint64_t timestamp;
+	uint64_t duration;
+	double value;
+};
+
+// Every thread appends to its own buffer, so threads don't contend with each other.
+// The mutex only protects against concurrently writing the trace file.
+struct ThreadBuffer {
+	std::mutex mutex;
+	int tid;
+	std::vector<TraceEvent> events;
+};
+
+std::mutex buffers_mutex;
+std::vector<std::shared_ptr<ThreadBuffer> > buffers;  // Kept alive after the thread ends.
+QString trace_file_name;
+
+ThreadBuffer& thread_buffer() {
+	thread_local std::shared_ptr<ThreadBuffer> buffer;
+	if (!buffer) {
+		buffer = std::make_shared<ThreadBuffer>();
+		std::lock_guard<std::mutex> lock(buffers_mutex);
+		buffer->tid = buffers.size() + 1;
+		buffers.push_back(buffer);
+	}
+	return *buffer;
+}
+
+void record(const TraceEvent& event) {
+	ThreadBuffer& buffer = thread_buffer();
+	std::lock_guard<std::mutex> lock(buffer.mutex);
+	buffer.events.push_back(event);
+}
+
+}  // namespace
+
+void Trace::start(const QString& file_name) {
+	std::lock_guard<std::mutex> lock(buffers_mutex);
+	for (const auto& buffer : buffers) {
+		std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+		buffer->events.clear();
+	}
+	trace_file_name = file_name;
+	s_enabled = true;
+}
+
+bool Trace::stop() {
+	if (!s_enabled.exchange(false))
+		return true;
+	QByteArray json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+	std::lock_guard<std::mutex> lock(buffers_mutex);
+	for (const auto& buffer : buffers) {
+		std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+		for (const TraceEvent& event : buffer->events) {
+			if (!first)
+				json += ",\n";
+			first = false;
+			json += "{\"name\":\"" + QByteArray(event.name) + "\",\"cat\":\"sauklaue\",\"ph\":\"" + event.phase + "\",\"pid\":1,\"tid\":" + QByteArray::number(buffer->tid) + ",\"ts\":" + QByteArray::number((qulonglong)event.timestamp);
+			if (event.phase == 'X')
+				json += ",\"dur\":" + QByteArray::number((qulonglong)event.duration);
+			else
+				json += ",\"args\":{\"value\":" + QByteArray::number(event.value) + "}";
+			json += "}";
+		}
+		buffer->events.clear();
+	}
+	json += "\n]}\n";
+	QSaveFile file(trace_file_name);
+	if (!file.open(QSaveFile::WriteOnly) || file.write(json) != json.size() || !file.commit()) {
+		qDebug() << "Cannot write trace file" << trace_file_name << file.errorString();
+		return false;
+	}
+	qDebug() << "Trace written to" << trace_file_name;
+	return true;
+}
+
+uint64_t Trace::now() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - trace_epoch).count();
+}
+
+void Trace::span(const char* name, uint64_t start, uint64_t duration) {
+	if (!enabled())
+		return;
+	record({name, 'X', start, duration, 0});
+}
+
+void Trace::counter(const char* name, double value) {
+	if (!enabled())
+		return;
+	record({name, 'C', now(), 0, value});
+}
@@ -0,0 +1,58 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+
+#include <QString>
+
+// Records where time is spent, as scoped spans and counters.
+// Recording is compiled in, but switched off by default. While it is off, a span costs one relaxed atomic load.
+// The recorded trace is written in the Chrome trace event format (JSON), which can be viewed in chrome://tracing or https://ui.perfetto.dev.
+class Trace {
+public:
+	static bool enabled() {
+		return s_enabled.load(std::memory_order_relaxed);
+	}
+	// Starts recording. The trace is written to the given file when recording is stopped.
+	static void start(const QString& file_name);
+	// Stops recording and writes the trace file. Returns false if the file could not be written.
+	static bool stop();
+
+	// Microseconds since the program started.
+	static uint64_t now();
+	// Records a span that started at the given time.
+	static void span(const char* name, uint64_t start, uint64_t duration);
+	// Records the current value of a counter.
+	static void counter(const char* name, double value);
+
+private:
+	static std::atomic<bool> s_enabled;
+};
+
+// RAII: Records a span from construction to destruction. The name must be a string literal (or otherwise outlive the trace).
+class TraceSpan {
+public:
+	explicit TraceSpan(const char* name) :
+	    m_name(Trace::enabled() ? name : nullptr) {
+		if (m_name)
+			m_start = Trace::now();
+	}
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+	~TraceSpan() {
+		if (m_name)
+			Trace::span(m_name, m_start, Trace::now() - m_start);
+	}
+
+private:
+	const char* m_name;
+	uint64_t m_start = 0;
+};
+
+#define TRACE_CONCAT_HELPER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_HELPER(a, b)
+// Records a span covering the rest of the current scope.
+#define TRACE_SCOPE(name) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name)
+
+#endif  // TRACE_H
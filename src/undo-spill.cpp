@@ -0,0 +1,200 @@
+#include "undo-spill.h"
+
+#include "commands.h"
+#include "document.h"
+#include "memory-stats.h"
+#include "serializer.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+#include <QDebug>
+#include <QDir>
+#include <QStandardPaths>
+#include <QUndoStack>
+
+#include <kj/exception.h>
+
+std::unique_ptr<UndoSpillFile> undo_spill_file_singleton;
+
+UndoSpillFile* UndoSpillFile::self() {
+	if (!undo_spill_file_singleton)
+		undo_spill_file_singleton.reset(new UndoSpillFile);
+	return undo_spill_file_singleton.get();
+}
+
+UndoSpillFile::Block& UndoSpillFile::Block::operator=(Block&& b) {
+	if (this != &b) {
+		if (m_size >= 0)
+			UndoSpillFile::self()->release(m_offset, m_size);
+		m_offset = b.m_offset;
+		m_size = std::exchange(b.m_size, -1);
+	}
+	return *this;
+}
+
+UndoSpillFile::Block::~Block() {
+	if (m_size >= 0)
+		UndoSpillFile::self()->release(m_offset, m_size);
+}
+
+UndoSpillFile::Block UndoSpillFile::write(const QByteArray& data) {
+	TRACE_SCOPE("UndoSpillFile::write");
+	Block block;
+	if (!m_file.isOpen()) {
+		// Not in QDir::tempPath(), which is often kept in memory (tmpfs).
+		QString directory = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/sauklaue";
+		if (!QDir().mkpath(directory))
+			directory = QDir::tempPath();
+		m_file.setFileTemplate(directory + "/undo-XXXXXX");
+		if (!m_file.open()) {
+			qDebug() << "Cannot create a temporary file for the undo history:" << m_file.errorString();
+			return block;
+		}
+	}
+	// Use the first free range that is large enough, so that commands that are loaded and spilled again don't make the file grow.
+	auto it = std::find_if(m_free.begin(), m_free.end(), [&](const auto& range) {
+		return range.second >= data.size();
+	});
+	qint64 offset = it != m_free.end() ? it->first : m_file_size;
+	if (!m_file.seek(offset) || m_file.write(data) != data.size()) {
+		qDebug() << "Cannot write the undo history to" << m_file.fileName() << ":" << m_file.errorString();
+		if (it == m_free.end())
+			m_file.resize(m_file_size);
+		return block;
+	}
+	if (it != m_free.end()) {
+		qint64 rest = it->second - data.size();
+		m_free.erase(it);
+		if (rest > 0)
+			m_free[offset + data.size()] = rest;
+	} else {
+		m_file_size += data.size();
+	}
+	block.m_offset = offset;
+	block.m_size = data.size();
+	return block;
+}
+
+QByteArray UndoSpillFile::read(const Block& block) {
+	TRACE_SCOPE("UndoSpillFile::read");
+	assert(block);
+	QByteArray data;
+	if (m_file.seek(block.m_offset))
+		data = m_file.read(block.m_size);
+	if (data.size() != block.m_size)
+		throw SauklaueReadException(QString("Cannot read the undo history from %1: %2").arg(m_file.fileName(), m_file.errorString()));
+	return data;
+}
+
+void UndoSpillFile::release(qint64 offset, qint64 size) {
+	auto next = m_free.lower_bound(offset);
+	assert(next == m_free.end() || next->first >= offset + size);
+	if (next != m_free.end() && next->first == offset + size) {
+		size += next->second;
+		next = m_free.erase(next);
+	}
+	if (next != m_free.begin()) {
+		auto prev = std::prev(next);
+		assert(prev->first + prev->second <= offset);
+		if (prev->first + prev->second == offset) {
+			offset = prev->first;
+			size += prev->second;
+			m_free.erase(prev);
+		}
+	}
+	if (offset + size == m_file_size) {
+		// Cut off the end of the file. Once all blocks are freed (e.g. when the undo stack is cleared), the file is empty.
+		m_file_size = offset;
+		if (m_file.isOpen())
+			m_file.resize(m_file_size);
+	} else {
+		m_free[offset] = size;
+	}
+}
+
+void spill_undo_history(const QUndoStack* stack, size_t budget) {
+	TRACE_SCOPE("spill_undo_history");
+	// Commands (including child commands) by their distance from the current state, i.e. the number of undo/redo steps until they are undone/redone next.
+	std::vector<std::pair<int, Command*> > commands;
+	std::function<void(const QUndoCommand*, int)> collect = [&](const QUndoCommand* command, int distance) {
+		// QUndoStack only gives out const pointers, but spilling does not change what the command does.
+		if (const Command* c = dynamic_cast<const Command*>(command))
+			commands.emplace_back(distance, const_cast<Command*>(c));
+		for (int i = 0; i < command->childCount(); i++)
+			collect(command->child(i), distance);
+	};
+	for (int i = 0; i < stack->count(); i++)
+		collect(stack->command(i), i < stack->index() ? stack->index() - 1 - i : i - stack->index());
+	std::stable_sort(commands.begin(), commands.end(), [](const auto& a, const auto& b) {
+		return a.first < b.first;
+	});
+	size_t used = 0;
+	for (const auto& [distance, command] : commands) {
+		if (used <= budget) {
+			MemoryStats stats;
+			command->account_memory(stats);
+			used += stats.total();
+		}
+		if (used > budget)
+			command->spill();
+	}
+}
+
+bool load_spilled_commands(const QUndoStack* stack, int index, QString& error) {
+	TRACE_SCOPE("load_spilled_commands");
+	std::function<void(const QUndoCommand*)> load = [&](const QUndoCommand* command) {
+		// Like in spill_undo_history, loading the data does not change what the command does.
+		if (const Command* c = dynamic_cast<const Command*>(command))
+			const_cast<Command*>(c)->unspill();
+		for (int i = 0; i < command->childCount(); i++)
+			load(command->child(i));
+	};
+	bool ok = true;
+	for (int i = std::min(index, stack->index()); i < std::max(index, stack->index()); i++) {
+		QUndoCommand* command = const_cast<QUndoCommand*>(stack->command(i));
+		try {
+			load(command);
+			continue;
+		} catch (const SauklaueReadException& e) {
+			error = e.reason();
+		} catch (const kj::Exception& e) {
+			// Thrown by Serializer::load_strokes if the data is corrupt
+			error = QString::fromStdString(e.getDescription().cStr());
+		}
+		// QUndoStack drops obsolete commands instead of undoing or redoing them.
+		command->setObsolete(true);
+		ok = false;
+	}
+	return ok;
+}
+
+void SpilledLayers::spill(const std::vector<std::unique_ptr<SPage> >& pages) {
+	for (const auto& page : pages) {
+		for (ptr_Layer layer : page->layers()) {
+			if (!std::holds_alternative<NormalLayer*>(layer))
+				continue;
+			NormalLayer* normal_layer = std::get<NormalLayer*>(layer);
+			if (normal_layer->strokes().size() == 0)
+				continue;
+			std::vector<ptr_Stroke> strokes;
+			for (ptr_Stroke stroke : normal_layer->strokes())
+				strokes.push_back(stroke);
+			UndoSpillFile::Block block = UndoSpillFile::self()->write(Serializer::save_strokes(strokes));
+			if (!block)
+				return;  // Keep the rest in memory.
+			normal_layer->take_strokes();
+			m_layers.emplace_back(normal_layer, std::move(block));
+		}
+	}
+}
+
+void SpilledLayers::restore() {
+	while (!m_layers.empty()) {
+		auto& [layer, block] = m_layers.back();
+		layer->restore_strokes(Serializer::load_strokes(UndoSpillFile::self()->read(block)));
+		m_layers.pop_back();
+	}
+}
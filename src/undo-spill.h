@@ -0,0 +1,74 @@
+#ifndef UNDO_SPILL_H
+#define UNDO_SPILL_H
+
+#include "all-types.h"
+
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <QByteArray>
+#include <QString>
+#include <QTemporaryFile>
+
+class QUndoStack;
+
+// A temporary file that holds the data of undo commands that are far away from the current state, so that long sessions don't keep all deleted pages and undone strokes in memory.
+// The data is loaded back when the command is undone or redone.
+class UndoSpillFile {
+public:
+	static UndoSpillFile* self();
+
+	// A piece of data in the file. Its space is freed when the block is destroyed.
+	class Block {
+	public:
+		Block() {
+		}
+		Block(const Block&) = delete;
+		Block(Block&& b) :
+		    m_offset(b.m_offset), m_size(std::exchange(b.m_size, -1)) {
+		}
+		Block& operator=(Block&& b);
+		~Block();
+		operator bool() const {
+			return m_size >= 0;
+		}
+
+	private:
+		friend class UndoSpillFile;
+		qint64 m_offset = 0;
+		qint64 m_size = -1;  // -1 if the block is empty
+	};
+
+	// Writes the data to a free range of the file (or appends it). Returns an empty block if that fails (e.g. because the disk is full).
+	Block write(const QByteArray& data);
+	QByteArray read(const Block& block);  // May throw SauklaueReadException
+
+private:
+	void release(qint64 offset, qint64 size);
+
+	QTemporaryFile m_file;
+	qint64 m_file_size = 0;
+	// The ranges of the file that belong to no block (offset -> size). Adjacent ranges are merged, and a range at the end of the file is cut off.
+	std::map<qint64, qint64> m_free;
+};
+
+// Moves the data of the undo commands that are farthest from the current index of the stack to the UndoSpillFile, until the data of the remaining commands takes at most budget bytes (see Command::account_memory).
+void spill_undo_history(const QUndoStack* stack, size_t budget);
+// Loads the spilled data of the commands that are undone or redone when the stack goes to the given index (see QUndoStack::setIndex).
+// A command whose data cannot be read is marked obsolete, so that QUndoStack drops it instead of undoing or redoing it. Returns false and sets the error message if that happens.
+bool load_spilled_commands(const QUndoStack* stack, int index, QString& error);
+
+// The strokes of the normal layers of pages owned by an undo command, moved to the UndoSpillFile.
+class SpilledLayers {
+public:
+	void spill(const std::vector<std::unique_ptr<SPage> >& pages);
+	// Puts the strokes back into their layers. May throw SauklaueReadException (the layers that could not be read stay spilled).
+	void restore();
+
+private:
+	std::vector<std::pair<NormalLayer*, UndoSpillFile::Block> > m_layers;
+};
+
+#endif  // UNDO_SPILL_H
@@ -3,6 +3,7 @@
 
 // Helpers for std::variant copied from https://en.cppreference.com/w/cpp/utility/variant/visit
 
+#include <atomic>
 #include <cassert>
 #include <list>
 #include <memory>
@@ -114,4 +115,23 @@ ListView<unique_to_ptr_helper<T> > list_unique_to_pointer(const std::list<std::u
 	return ListView<unique_to_ptr_helper<T> >(v);
 }
 
+// Holds the most recent value published by one thread until another thread takes it. Older values that were never taken are dropped.
+template <class T>
+class LatestValueSlot {
+public:
+	~LatestValueSlot() {
+		delete m_value.exchange(nullptr);
+	}
+	void publish(std::unique_ptr<T> value) {
+		delete m_value.exchange(value.release(), std::memory_order_acq_rel);
+	}
+	// Returns nullptr if nothing new was published.
+	std::unique_ptr<T> take() {
+		return std::unique_ptr<T>(m_value.exchange(nullptr, std::memory_order_acq_rel));
+	}
+
+private:
+	std::atomic<T*> m_value{nullptr};
+};
+
 #endif